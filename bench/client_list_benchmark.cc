@@ -0,0 +1,147 @@
+#include "cli/client.h"
+#include "common/null_buffer.h"
+#include "srv/server.h"
+
+#include <grpcpp/grpcpp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "proto/helloworld.pb.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+void print_usage(const char* program_name) {
+  std::cout << "Usage: " << program_name << " [options]\n";
+  std::cout << "Options:\n";
+  std::cout << "  -n <counts>            Comma-separated registry sizes (default: 100000,1000000)\n";
+  std::cout << "  -a <addresses>         Distinct client addresses (default: 1000)\n";
+  std::cout << "  -r <repetitions>       Times each list is encoded and decoded (default: 5)\n";
+  std::cout << "  -h                     Show this help message\n";
+}
+
+// Clients fill one address after another, on consecutive ports, as when
+// each host runs a block of them
+void Fill(helloworld::ClientRegistryServiceImpl* service, size_t count, size_t address_count) {
+  const size_t per_address = std::max<size_t>(count / address_count, 1);
+  for (size_t i = 0; i < count; ++i) {
+    char id[32];
+    std::snprintf(id, sizeof(id), "client-%08zu", i);
+    const size_t host = i / per_address;
+    helloworld::ClientRegistration request;
+    request.set_client_id(id);
+    request.set_client_address("10.0." + std::to_string(host / 256) + "." + std::to_string(host % 256));
+    request.set_client_port(50000 + static_cast<int32_t>(i % per_address));
+    helloworld::RegistrationResponse reply;
+    grpc::ServerContext context;
+    service->RegisterClient(&context, &request, &reply);
+  }
+}
+
+// Mean time of run over repetitions, in ms
+template <typename Run>
+double TimeMs(size_t repetitions, Run run) {
+  const auto start = Clock::now();
+  for (size_t i = 0; i < repetitions; ++i) {
+    run();
+  }
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count() / repetitions;
+}
+
+void Report(const std::string& format, size_t bytes, double encode_ms, double decode_ms,
+            double to_entries_ms) {
+  std::cout << "  " << format << ": " << bytes << " bytes, encode " << encode_ms << " ms, decode "
+            << decode_ms << " ms, decode to ClientEntry " << to_entries_ms << " ms" << std::endl;
+}
+
+}  // namespace
+
+// Compares ListClients replies in the full and the compact format: wire
+// bytes, registry-side encoding, and client-side decoding, both reading
+// entries in place and converting them to ClientEntry
+int main(const int argc, const char* const argv[]) {
+  std::vector<size_t> counts = {100000, 1000000};
+  size_t address_count = 1000;
+  size_t repetitions = 5;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i + 1 < argc) {
+      counts.clear();
+      std::istringstream stream(argv[++i]);
+      for (std::string count; std::getline(stream, count, ',');) {
+        counts.push_back(std::stoul(count));
+      }
+    } else if (arg == "-a" && i + 1 < argc) {
+      address_count = std::max<size_t>(std::stoul(argv[++i]), 1);
+    } else if (arg == "-r" && i + 1 < argc) {
+      repetitions = std::max<size_t>(std::stoul(argv[++i]), 1);
+    } else if (arg == "-h") {
+      print_usage(argv[0]);
+      return 0;
+    } else {
+      std::cout << "Unknown option: " << arg << std::endl;
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // Discards the registry's per-call logging
+  helloworld::NullBuffer discarded;
+  for (size_t count : counts) {
+    if (count == 0) {
+      continue;
+    }
+    helloworld::ClientRegistryServiceImpl service;
+    std::string wire[2];
+    double encode_ms[2];
+    {
+      helloworld::CoutRedirect quiet(&discarded);
+      Fill(&service, count, address_count);
+      for (bool compact : {false, true}) {
+        helloworld::ClientListRequest request;
+        request.set_compact(compact);
+        encode_ms[compact] = TimeMs(repetitions, [&] {
+          helloworld::ClientList reply;
+          grpc::ServerContext context;
+          service.ListClients(&context, &request, &reply);
+          wire[compact] = reply.SerializeAsString();
+        });
+      }
+    }
+
+    std::cout << count << " clients on " << std::min(address_count, count) << " addresses:" << std::endl;
+    for (bool compact : {false, true}) {
+      size_t visited = 0;
+      const double decode_ms = TimeMs(repetitions, [&] {
+        helloworld::ClientList reply;
+        reply.ParseFromString(wire[compact]);
+        helloworld::ForEachListedClient(reply, [&visited](const helloworld::ListedClient& client) {
+          visited += client.online;
+        });
+      });
+      const double to_entries_ms = TimeMs(repetitions, [&] {
+        helloworld::ClientList reply;
+        reply.ParseFromString(wire[compact]);
+        std::vector<helloworld::ClientEntry> clients;
+        clients.reserve(count);
+        helloworld::ForEachListedClient(reply, [&clients](const helloworld::ListedClient& client) {
+          clients.emplace_back(client.client_id, client.address, client.port, client.online);
+        });
+      });
+      if (visited != count * repetitions) {
+        std::cout << "Decoded " << visited / repetitions << " of " << count << " clients" << std::endl;
+        return 1;
+      }
+      Report(compact ? "compact" : "full", wire[compact].size(), encode_ms[compact], decode_ms, to_entries_ms);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,171 @@
+#include "cli/client.h"
+#include "cli/message_codec.h"
+#include "common/null_buffer.h"
+
+#include <grpcpp/grpcpp.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+void print_usage(const char* program_name) {
+  std::cout << "Usage: " << program_name << " [options]\n";
+  std::cout << "Options:\n";
+  std::cout << "  -n <messages>          Messages encoded and decoded per codec (default: 200000)\n";
+  std::cout << "  -e <messages>          Messages sent per codec over gRPC (default: 20000)\n";
+  std::cout << "  -c <senders>           Concurrent senders over gRPC (default: 4)\n";
+  std::cout << "  -s <payload_bytes>     Message content size (default: 256)\n";
+  std::cout << "  -h                     Show this help message\n";
+  std::cout << "Each measurement prints one JSON object per line.\n";
+}
+
+double NanosPer(Clock::duration elapsed, size_t count) {
+  return std::chrono::duration<double, std::nano>(elapsed).count() / count;
+}
+
+// Encode, decode in place, and decode into a ClientMessage the mailbox
+// could keep, each timed over the same messages
+void BenchmarkCodec(const helloworld::MessageCodec& codec, const helloworld::ClientMessage& message,
+                    size_t messages, std::ostream& results) {
+  size_t checksum = 0;
+
+  auto start = Clock::now();
+  for (size_t i = 0; i < messages; ++i) {
+    checksum += codec.Encode(message).Length();
+  }
+  const double encode_ns = NanosPer(Clock::now() - start, messages);
+
+  const grpc::ByteBuffer encoded = codec.Encode(message);
+  start = Clock::now();
+  for (size_t i = 0; i < messages; ++i) {
+    // Copying a buffer only takes references to its slices
+    grpc::ByteBuffer received(encoded);
+    helloworld::DecodedMessage decoded;
+    codec.Decode(&received, &decoded);
+    checksum += decoded.view.message_content.size();
+  }
+  const double decode_ns = NanosPer(Clock::now() - start, messages);
+
+  start = Clock::now();
+  for (size_t i = 0; i < messages; ++i) {
+    grpc::ByteBuffer received(encoded);
+    helloworld::DecodedMessage decoded;
+    codec.Decode(&received, &decoded);
+    checksum += helloworld::ToMessage(decoded.view).message_content().size();
+  }
+  const double materialize_ns = NanosPer(Clock::now() - start, messages);
+
+  results << "{\"case\":\"codec\",\"codec\":\"" << codec.name() << "\",\"messages\":" << messages
+          << ",\"wire_bytes\":" << encoded.Length() << ",\"encode_ns\":" << encode_ns
+          << ",\"decode_ns\":" << decode_ns << ",\"decode_to_message_ns\":" << materialize_ns
+          << ",\"checksum\":" << checksum << "}" << std::endl;
+}
+
+}  // namespace
+
+// Compares the protobuf and flat encodings of ClientMessage, in memory and
+// end to end through a mailbox served over gRPC
+int main(const int argc, const char* const argv[]) {
+  size_t messages = 200000;
+  size_t sent_messages = 20000;
+  size_t senders = 4;
+  size_t payload_bytes = 256;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "-n" && i + 1 < argc) {
+      messages = std::max<size_t>(std::stoul(argv[++i]), 1);
+    } else if (arg == "-e" && i + 1 < argc) {
+      sent_messages = std::max<size_t>(std::stoul(argv[++i]), 1);
+    } else if (arg == "-c" && i + 1 < argc) {
+      senders = std::max<size_t>(std::stoul(argv[++i]), 1);
+    } else if (arg == "-s" && i + 1 < argc) {
+      payload_bytes = std::stoul(argv[++i]);
+    } else if (arg == "-h") {
+      print_usage(argv[0]);
+      return 0;
+    } else {
+      std::cout << "Unknown option: " << arg << std::endl;
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  helloworld::ClientMessage message;
+  message.set_from_client_id("bench_sender");
+  message.set_to_client_id("bench_receiver");
+  message.set_message_content(std::string(payload_bytes, 'x'));
+  message.set_timestamp("1700000000");
+  message.set_sender_epoch(1);
+
+  const helloworld::ProtobufMessageCodec protobuf;
+  const helloworld::FlatMessageCodec flat;
+  std::ostream results(std::cout.rdbuf());
+  BenchmarkCodec(protobuf, message, messages, results);
+  BenchmarkCodec(flat, message, messages, results);
+
+  // Every sent message stays queued in the normal lane (with one warm-up
+  // per path), so the mailbox never refuses one
+  helloworld::ClientCommunicationServiceImpl mailbox((sent_messages + 1) * 3 * helloworld::kMailboxLanes);
+  helloworld::EncodedMessageService encoded_service(&mailbox);
+  grpc::ServerBuilder builder;
+  int port = 0;
+  builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(), &port);
+  builder.RegisterService(&mailbox);
+  builder.RegisterCallbackGenericService(&encoded_service);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  if (!server) {
+    std::cout << "Failed to start server" << std::endl;
+    return 1;
+  }
+  helloworld::ClientCommunicationClient client(
+      grpc::CreateChannel("127.0.0.1:" + std::to_string(port), grpc::InsecureChannelCredentials()));
+
+  helloworld::NullBuffer discarded;
+  helloworld::CoutRedirect redirect(&discarded);
+
+  // The generated stub, then each codec through the generic stub
+  const helloworld::MessageCodec* paths[] = {nullptr, &protobuf, &flat};
+  for (const helloworld::MessageCodec* codec : paths) {
+    helloworld::MessageResponse warm_up;
+    client.Send(message, &warm_up);
+
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> failed{0};
+    const auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < senders; ++t) {
+      threads.emplace_back([&]() {
+        while (next++ < sent_messages) {
+          helloworld::MessageResponse reply;
+          const grpc::Status status =
+              codec == nullptr ? client.Send(message, &reply) : client.SendEncoded(*codec, message, &reply);
+          if (!status.ok() || !reply.success()) {
+            ++failed;
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    results << "{\"case\":\"send\",\"path\":\"" << (codec == nullptr ? "stub" : codec->name())
+            << "\",\"messages\":" << sent_messages << ",\"senders\":" << senders << ",\"failed\":" << failed
+            << ",\"msgs_per_sec\":" << sent_messages / seconds << "}" << std::endl;
+  }
+
+  server->Shutdown();
+  return 0;
+}
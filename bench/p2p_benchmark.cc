@@ -0,0 +1,380 @@
+#include "cli/client.h"
+#include "common/null_buffer.h"
+#include "srv/server.h"
+
+#include <grpcpp/grpcpp.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Payloads start with the send time so the receiver can measure latency
+constexpr size_t kTimestampBytes = 20;
+
+// Threads draining each receiver's mailbox, so that taking one message
+// per RPC does not become the bottleneck
+constexpr int kDrainThreads = 4;
+
+// How long a drain call waits for a message before asking again
+constexpr std::chrono::milliseconds kReceiveWait(100);
+
+const char* const kModes[] = {"per-send", "pooled", "batched"};
+
+void print_usage(const char* program_name) {
+  std::cout << "Usage: " << program_name << " [options]\n";
+  std::cout << "Options:\n";
+  std::cout << "  -n <messages>          Messages per sender in each run (default: 1000)\n";
+  std::cout << "  -s <payload_bytes>     Comma-separated payload sizes (default: 64,1024,16384)\n";
+  std::cout << "  -c <senders>           Comma-separated sender counts (default: 1,4,16)\n";
+  std::cout << "  -r <receivers>         Comma-separated receiver counts; senders spread their\n";
+  std::cout << "                         messages round robin over the group (default: 1,4)\n";
+  std::cout << "  -m <modes>             Comma-separated send modes: per-send, pooled, batched\n";
+  std::cout << "                         (default: all)\n";
+  std::cout << "  -L <linger_ms>         Batch linger in batched mode (default: 1)\n";
+  std::cout << "  -h                     Show this help message\n";
+  std::cout << "Each run prints one JSON object per line.\n";
+}
+
+std::vector<std::string> SplitList(const std::string& list) {
+  std::vector<std::string> items;
+  std::istringstream stream(list);
+  for (std::string item; std::getline(stream, item, ',');) {
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+std::string MakePayload(size_t payload_bytes) {
+  char stamp[kTimestampBytes + 1];
+  std::snprintf(stamp, sizeof(stamp), "%020lld",
+                static_cast<long long>(Clock::now().time_since_epoch().count()));
+  std::string payload(stamp, kTimestampBytes);
+  payload.resize(std::max(payload_bytes, kTimestampBytes), 'x');
+  return payload;
+}
+
+// One-way latencies of the messages every receiver dequeued, from the
+// sender's call to the receiver dequeuing it
+class Deliveries {
+ public:
+  void Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    latencies_.clear();
+  }
+
+  void Record(const helloworld::ClientMessage& message) {
+    const Clock::time_point sent(Clock::duration(std::stoll(message.message_content().substr(0, kTimestampBytes))));
+    std::lock_guard<std::mutex> lock(mutex_);
+    latencies_.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+    cv_.notify_all();
+  }
+
+  // Latencies in microseconds once total messages arrived; false on timeout
+  bool WaitFor(size_t total, std::chrono::seconds timeout, std::vector<double>* latencies) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const bool arrived = cv_.wait_for(lock, timeout, [&] { return latencies_.size() >= total; });
+    *latencies = latencies_;
+    return arrived;
+  }
+
+ private:
+  std::vector<double> latencies_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+// Drains one receiving client's mailbox. Each call waits in the mailbox
+// until a message arrives, so a message is taken as soon as it is queued.
+class Receiver {
+ public:
+  Receiver(const std::string& address, Deliveries* deliveries)
+      : stub_(helloworld::ClientCommunication::NewStub(
+            grpc::CreateChannel(address, grpc::InsecureChannelCredentials()))),
+        deliveries_(deliveries) {
+    for (int i = 0; i < kDrainThreads; ++i) {
+      threads_.emplace_back([this]() { Drain(); });
+    }
+  }
+
+  ~Receiver() {
+    stopping_ = true;
+    for (std::thread& thread : threads_) {
+      thread.join();
+    }
+  }
+
+ private:
+  void Drain() {
+    helloworld::MessageRequest request;
+    request.set_wait_ms(static_cast<uint32_t>(kReceiveWait.count()));
+    while (!stopping_) {
+      grpc::ClientContext context;
+      context.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(5));
+      helloworld::ClientMessage message;
+      const grpc::Status status = stub_->ReceiveMessage(&context, request, &message);
+      if (!status.ok()) {
+        // Only while the receiving client stops
+        std::this_thread::sleep_for(kReceiveWait);
+        continue;
+      }
+      if (!message.from_client_id().empty()) {
+        deliveries_->Record(message);
+      }
+    }
+  }
+
+  std::unique_ptr<helloworld::ClientCommunication::Stub> stub_;
+  Deliveries* deliveries_;
+  std::atomic<bool> stopping_{false};
+  std::vector<std::thread> threads_;
+};
+
+double Percentile(const std::vector<double>& sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[std::min(sorted.size() - 1, static_cast<size_t>(sorted.size() * fraction))];
+}
+
+// Percentiles of latencies in microseconds as a JSON object
+std::string LatencyJson(std::vector<double> latencies) {
+  std::sort(latencies.begin(), latencies.end());
+  std::ostringstream json;
+  json << "{\"p50\":" << Percentile(latencies, 0.50) << ",\"p90\":" << Percentile(latencies, 0.90)
+       << ",\"p99\":" << Percentile(latencies, 0.99) << ",\"max\":" << Percentile(latencies, 1.0) << "}";
+  return json.str();
+}
+
+void Report(std::ostream& out, const std::string& mode, size_t senders, size_t receivers, size_t payload_bytes,
+            size_t sent, size_t failed, Clock::duration elapsed, const std::vector<double>& latencies,
+            const std::vector<double>& send_latencies) {
+  const double seconds = std::chrono::duration<double>(elapsed).count();
+  out << "{\"mode\":\"" << mode << "\",\"senders\":" << senders << ",\"receivers\":" << receivers
+      << ",\"payload_bytes\":" << payload_bytes
+      << ",\"sent\":" << sent << ",\"failed\":" << failed << ",\"delivered\":" << latencies.size()
+      << ",\"seconds\":" << seconds << ",\"msgs_per_sec\":" << latencies.size() / seconds
+      << ",\"latency_us\":" << LatencyJson(latencies) << ",\"send_us\":" << LatencyJson(send_latencies) << "}"
+      << std::endl;
+}
+
+}  // namespace
+
+// Measures peer-to-peer message throughput and latency between groups of
+// Client instances on localhost, for each send mode, sender count, receiver
+// count and payload size.
+// latency_us is one-way, until the receiver dequeues the message; send_us is
+// how long the sender's call took. The modes:
+//   per-send  SendMessageToClient as is: a registry lookup per message
+//   pooled    the peer send alone, skipping the lookup
+//   batched   SendMessageToClientAsync with message coalescing, so that
+//             messages queued while a batch lingers join it
+int main(const int argc, const char* const argv[]) {
+  size_t messages = 1000;
+  std::vector<size_t> payload_sizes = {64, 1024, 16384};
+  std::vector<size_t> sender_counts = {1, 4, 16};
+  std::vector<size_t> receiver_counts = {1, 4};
+  std::vector<std::string> modes(std::begin(kModes), std::end(kModes));
+  int linger_ms = 1;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "-n" && i + 1 < argc) {
+      messages = std::max<size_t>(std::stoul(argv[++i]), 1);
+    } else if (arg == "-s" && i + 1 < argc) {
+      payload_sizes.clear();
+      for (const std::string& size : SplitList(argv[++i])) {
+        payload_sizes.push_back(std::stoul(size));
+      }
+    } else if (arg == "-c" && i + 1 < argc) {
+      sender_counts.clear();
+      for (const std::string& count : SplitList(argv[++i])) {
+        sender_counts.push_back(std::max<size_t>(std::stoul(count), 1));
+      }
+    } else if (arg == "-r" && i + 1 < argc) {
+      receiver_counts.clear();
+      for (const std::string& count : SplitList(argv[++i])) {
+        receiver_counts.push_back(std::max<size_t>(std::stoul(count), 1));
+      }
+    } else if (arg == "-m" && i + 1 < argc) {
+      modes = SplitList(argv[++i]);
+      for (const std::string& mode : modes) {
+        if (std::find(std::begin(kModes), std::end(kModes), mode) == std::end(kModes)) {
+          std::cout << "Unknown mode: " << mode << std::endl;
+          print_usage(argv[0]);
+          return 1;
+        }
+      }
+    } else if (arg == "-L" && i + 1 < argc) {
+      linger_ms = std::stoi(argv[++i]);
+    } else if (arg == "-h") {
+      print_usage(argv[0]);
+      return 0;
+    } else {
+      std::cout << "Unknown option: " << arg << std::endl;
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (payload_sizes.empty() || sender_counts.empty() || receiver_counts.empty() || modes.empty()) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  // Results go to stdout; the clients' own logging is discarded
+  std::ostream results(std::cout.rdbuf());
+  helloworld::NullBuffer discarded;
+  helloworld::CoutRedirect redirect(&discarded);
+
+  helloworld::ClientRegistryServiceImpl registry;
+  grpc::ServerBuilder builder;
+  int registry_port = 0;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(), &registry_port);
+  builder.RegisterService(&registry);
+  std::unique_ptr<grpc::Server> registry_server = builder.BuildAndStart();
+  if (!registry_server) {
+    std::cerr << "Failed to start registry" << std::endl;
+    return 1;
+  }
+  const std::string registry_address = "localhost:" + std::to_string(registry_port);
+  const size_t max_senders = *std::max_element(sender_counts.begin(), sender_counts.end());
+  const size_t max_receivers = *std::max_element(receiver_counts.begin(), receiver_counts.end());
+
+  // Each mode gets fresh clients, on ports picked by the system
+  for (const std::string& mode : modes) {
+    Deliveries deliveries;
+    std::vector<std::unique_ptr<helloworld::Client>> receiver_clients;
+    std::vector<std::unique_ptr<Receiver>> receivers;
+    std::vector<std::string> receiver_ids;
+    for (size_t j = 0; j < max_receivers; ++j) {
+      receiver_ids.push_back("bench_receiver_" + std::to_string(j));
+      auto receiver_client = std::make_unique<helloworld::Client>(registry_address, receiver_ids.back(),
+                                                                  "localhost", 0);
+      receiver_client->SetMailboxCapacity(1 << 20);
+      if (!receiver_client->Start()) {
+        std::cerr << "Failed to start receiver " << j << std::endl;
+        return 1;
+      }
+      receivers.push_back(
+          std::make_unique<Receiver>("localhost:" + std::to_string(receiver_client->port()), &deliveries));
+      receiver_clients.push_back(std::move(receiver_client));
+    }
+
+    std::vector<std::unique_ptr<helloworld::Client>> senders;
+    // Per sender, one channel to each receiver
+    std::vector<std::vector<std::unique_ptr<helloworld::ClientCommunicationClient>>> channels(max_senders);
+    for (size_t i = 0; i < max_senders; ++i) {
+      auto sender = std::make_unique<helloworld::Client>(registry_address, "bench_sender_" + std::to_string(i),
+                                                         "localhost", 0);
+      sender->SetBackpressureMode(helloworld::BackpressureMode::kBlock);
+      if (mode == "batched") {
+        helloworld::BatchingOptions options;
+        options.linger = std::chrono::milliseconds(linger_ms);
+        sender->EnableMessageBatching(options);
+        sender->SetMaxOutstandingSends(messages);
+      }
+      if (!sender->Start()) {
+        std::cerr << "Failed to start sender " << i << std::endl;
+        return 1;
+      }
+      senders.push_back(std::move(sender));
+      for (const auto& receiver_client : receiver_clients) {
+        channels[i].push_back(std::make_unique<helloworld::ClientCommunicationClient>(grpc::CreateChannel(
+            "localhost:" + std::to_string(receiver_client->port()), grpc::InsecureChannelCredentials())));
+      }
+    }
+
+    for (size_t sender_count : sender_counts) {
+      for (size_t receiver_count : receiver_counts) {
+        for (size_t payload_bytes : payload_sizes) {
+          deliveries.Reset();
+          std::atomic<size_t> failed{0};
+          std::vector<std::vector<double>> send_latencies(sender_count);
+          std::vector<std::thread> threads;
+          const auto start = Clock::now();
+          for (size_t i = 0; i < sender_count; ++i) {
+            threads.emplace_back([&, i]() {
+              const std::string sender_id = "bench_sender_" + std::to_string(i);
+              send_latencies[i].reserve(messages);
+              std::vector<std::future<helloworld::DeliveryReceipt>> receipts;
+              for (size_t n = 0; n < messages; ++n) {
+                // Senders start on different receivers, so a group shares the load evenly
+                const size_t target = (i + n) % receiver_count;
+                const auto call = Clock::now();
+                bool sent;
+                if (mode == "batched") {
+                  receipts.push_back(
+                      senders[i]->SendMessageToClientAsync(receiver_ids[target], MakePayload(payload_bytes)));
+                  continue;
+                } else if (mode == "pooled") {
+                  helloworld::ClientMessage message;
+                  message.set_from_client_id(sender_id);
+                  message.set_to_client_id(receiver_ids[target]);
+                  message.set_message_content(MakePayload(payload_bytes));
+                  helloworld::MessageResponse reply;
+                  sent = channels[i][target]->Send(message, &reply).ok() && reply.success();
+                } else {
+                  sent = senders[i]->SendMessageToClient(receiver_ids[target], MakePayload(payload_bytes));
+                }
+                send_latencies[i].push_back(std::chrono::duration<double, std::micro>(Clock::now() - call).count());
+                if (!sent) {
+                  ++failed;
+                }
+              }
+              // An asynchronous send's call lasts until its receipt
+              for (auto& receipt : receipts) {
+                const helloworld::DeliveryReceipt delivered = receipt.get();
+                send_latencies[i].push_back(delivered.latency.count());
+                if (!delivered.delivered) {
+                  ++failed;
+                }
+              }
+            });
+          }
+          for (std::thread& thread : threads) {
+            thread.join();
+          }
+
+          const size_t sent = sender_count * messages;
+          std::vector<double> latencies;
+          if (!deliveries.WaitFor(sent - failed, std::chrono::seconds(30), &latencies)) {
+            std::cerr << "Timed out waiting for deliveries" << std::endl;
+          }
+          const auto elapsed = Clock::now() - start;
+          std::vector<double> all_send_latencies;
+          for (const std::vector<double>& sender_latencies : send_latencies) {
+            all_send_latencies.insert(all_send_latencies.end(), sender_latencies.begin(), sender_latencies.end());
+          }
+          Report(results, mode, sender_count, receiver_count, std::max(payload_bytes, kTimestampBytes), sent,
+                 failed, elapsed, latencies, all_send_latencies);
+        }
+      }
+    }
+
+    for (auto& sender : senders) {
+      sender->Stop();
+    }
+    receivers.clear();
+    for (auto& receiver_client : receiver_clients) {
+      receiver_client->Stop();
+    }
+  }
+
+  registry_server->Shutdown();
+  return 0;
+}
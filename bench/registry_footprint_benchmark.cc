@@ -0,0 +1,132 @@
+#include "srv/client_table.h"
+
+#include <malloc.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+void print_usage(const char* program_name) {
+  std::cout << "Usage: " << program_name << " [options]\n";
+  std::cout << "Options:\n";
+  std::cout << "  -n <counts>            Comma-separated registry sizes (default: 1000000,10000000)\n";
+  std::cout << "  -a <addresses>         Distinct client addresses (default: 1000)\n";
+  std::cout << "  -l                     Also measure the previous std::map layout\n";
+  std::cout << "  -h                     Show this help message\n";
+}
+
+// Heap bytes in use, including large blocks served by mmap
+size_t HeapInUse() {
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+// The registry's entry before ClientTable, for comparison
+struct MapEntry {
+  std::string client_id;
+  std::string address;
+  int32_t port;
+  bool online;
+  std::map<std::string, std::string> labels;
+};
+
+struct Workload {
+  std::vector<std::string> addresses;
+  std::vector<helloworld::RegistryLabels> label_sets;
+
+  explicit Workload(size_t address_count) {
+    for (size_t i = 0; i < address_count; ++i) {
+      addresses.push_back("10.0." + std::to_string(i / 256) + "." + std::to_string(i % 256));
+    }
+    for (const char* role : {"worker", "gateway"}) {
+      for (const char* region : {"eu", "us", "ap"}) {
+        label_sets.push_back({{"role", role}, {"region", region}});
+      }
+    }
+  }
+
+  std::string Id(size_t i) const {
+    char id[32];
+    std::snprintf(id, sizeof(id), "client-%08zu", i);
+    return id;
+  }
+};
+
+void Report(const std::string& layout, size_t clients, size_t bytes, Clock::duration elapsed) {
+  std::cout << layout << ": " << clients << " clients, " << bytes / (1024 * 1024) << " MiB, "
+            << static_cast<double>(bytes) / clients << " bytes/client, "
+            << std::chrono::duration<double, std::milli>(elapsed).count() << " ms to fill" << std::endl;
+}
+
+}  // namespace
+
+// Measures registry memory per client for the compact ClientTable layout
+int main(const int argc, const char* const argv[]) {
+  std::vector<size_t> counts = {1000000, 10000000};
+  size_t address_count = 1000;
+  bool measure_map = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "-n" && i + 1 < argc) {
+      counts.clear();
+      std::istringstream stream(argv[++i]);
+      for (std::string count; std::getline(stream, count, ',');) {
+        counts.push_back(std::stoul(count));
+      }
+    } else if (arg == "-a" && i + 1 < argc) {
+      address_count = std::max<size_t>(std::stoul(argv[++i]), 1);
+    } else if (arg == "-l") {
+      measure_map = true;
+    } else if (arg == "-h") {
+      print_usage(argv[0]);
+      return 0;
+    } else {
+      std::cout << "Unknown option: " << arg << std::endl;
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  const Workload workload(address_count);
+  for (size_t count : counts) {
+    if (count == 0) {
+      continue;
+    }
+    {
+      const size_t before = HeapInUse();
+      const auto start = Clock::now();
+      helloworld::ClientTable table;
+      for (size_t i = 0; i < count; ++i) {
+        table.Insert(workload.Id(i), workload.addresses[i % workload.addresses.size()],
+                     50000 + static_cast<int32_t>(i % 10000), true,
+                     workload.label_sets[i % workload.label_sets.size()]);
+      }
+      Report("compact", count, HeapInUse() - before, Clock::now() - start);
+    }
+
+    if (measure_map) {
+      const size_t before = HeapInUse();
+      const auto start = Clock::now();
+      std::map<std::string, MapEntry> table;
+      for (size_t i = 0; i < count; ++i) {
+        const std::string id = workload.Id(i);
+        table[id] = MapEntry{id, workload.addresses[i % workload.addresses.size()],
+                             50000 + static_cast<int32_t>(i % 10000), true,
+                             workload.label_sets[i % workload.label_sets.size()]};
+      }
+      Report("map", count, HeapInUse() - before, Clock::now() - start);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,160 @@
+#include "cli/relay_client.h"
+#include "srv/relay.h"
+
+#include <grpcpp/grpcpp.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+void print_usage(const char* program_name) {
+  std::cout << "Usage: " << program_name << " [options]\n";
+  std::cout << "Options:\n";
+  std::cout << "  -n <messages>          Messages per phase (default: 20000)\n";
+  std::cout << "  -w <window>            Unacked messages in the windowed phase (default: 256)\n";
+  std::cout << "  -s <payload_bytes>     Message content size (default: 64)\n";
+  std::cout << "  -h                     Show this help message\n";
+}
+
+double Micros(Clock::duration d) {
+  return std::chrono::duration<double, std::micro>(d).count();
+}
+
+// Counts relayed messages and lets the benchmark wait for a total
+class Receiver {
+ public:
+  void OnMessage(const helloworld::ClientMessage&) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++received_;
+    cv_.notify_all();
+  }
+
+  bool WaitFor(size_t total, std::chrono::seconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cv_.wait_for(lock, timeout, [&] { return received_ >= total; });
+  }
+
+ private:
+  size_t received_ = 0;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+void Report(const std::string& phase, size_t messages, size_t payload_bytes, Clock::duration elapsed) {
+  const double seconds = std::chrono::duration<double>(elapsed).count();
+  std::cout << phase << ": " << messages << " messages in " << seconds * 1000 << " ms, "
+            << messages / seconds << " msg/s, "
+            << messages * payload_bytes / seconds / (1024 * 1024) << " MiB/s" << std::endl;
+}
+
+}  // namespace
+
+// Measures message throughput and ack latency through an in-process relay
+int main(const int argc, const char* const argv[]) {
+  size_t messages = 20000;
+  size_t window = 256;
+  size_t payload_bytes = 64;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "-n" && i + 1 < argc) {
+      messages = std::stoul(argv[++i]);
+    } else if (arg == "-w" && i + 1 < argc) {
+      window = std::max<size_t>(std::stoul(argv[++i]), 1);
+    } else if (arg == "-s" && i + 1 < argc) {
+      payload_bytes = std::stoul(argv[++i]);
+    } else if (arg == "-h") {
+      print_usage(argv[0]);
+      return 0;
+    } else {
+      std::cout << "Unknown option: " << arg << std::endl;
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  helloworld::MessageRelayServiceImpl relay_service;
+  grpc::ServerBuilder builder;
+  int port = 0;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(), &port);
+  builder.RegisterService(&relay_service);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  if (!server) {
+    std::cout << "Failed to start relay" << std::endl;
+    return 1;
+  }
+
+  auto channel = grpc::CreateChannel("localhost:" + std::to_string(port), grpc::InsecureChannelCredentials());
+  Receiver receiver;
+  helloworld::RelayClient sender(channel, "bench_sender", [](const helloworld::ClientMessage&) {});
+  helloworld::RelayClient target(channel, "bench_target",
+                                 [&receiver](const helloworld::ClientMessage& message) {
+                                   receiver.OnMessage(message);
+                                 });
+  if (!sender.Connect(std::chrono::seconds(5)) || !target.Connect(std::chrono::seconds(5))) {
+    return 1;
+  }
+
+  helloworld::ClientMessage message;
+  message.set_from_client_id("bench_sender");
+  message.set_to_client_id("bench_target");
+  message.set_message_content(std::string(payload_bytes, 'x'));
+
+  // One message at a time: ack round-trip latency
+  std::vector<double> latencies;
+  latencies.reserve(messages);
+  auto start = Clock::now();
+  for (size_t i = 0; i < messages; ++i) {
+    auto sent = Clock::now();
+    if (!sender.Send(message, std::chrono::seconds(5))) {
+      std::cout << "Sequential send " << i << " failed" << std::endl;
+      return 1;
+    }
+    latencies.push_back(Micros(Clock::now() - sent));
+  }
+  receiver.WaitFor(messages, std::chrono::seconds(30));
+  Report("sequential", messages, payload_bytes, Clock::now() - start);
+
+  std::sort(latencies.begin(), latencies.end());
+  std::cout << "ack latency: p50 " << latencies[latencies.size() / 2] << " us, p99 "
+            << latencies[latencies.size() * 99 / 100] << " us, max " << latencies.back() << " us"
+            << std::endl;
+
+  // Up to window unacked messages: relay throughput
+  std::deque<std::future<bool>> in_flight;
+  size_t failed = 0;
+  start = Clock::now();
+  for (size_t i = 0; i < messages; ++i) {
+    if (in_flight.size() >= window) {
+      failed += in_flight.front().get() ? 0 : 1;
+      in_flight.pop_front();
+    }
+    in_flight.push_back(sender.SendAsync(message));
+  }
+  for (auto& acked : in_flight) {
+    failed += acked.get() ? 0 : 1;
+  }
+  if (!receiver.WaitFor(2 * messages - failed, std::chrono::seconds(30))) {
+    std::cout << "Timed out waiting for deliveries" << std::endl;
+  }
+  Report("windowed (" + std::to_string(window) + ")", messages - failed, payload_bytes, Clock::now() - start);
+  if (failed > 0) {
+    std::cout << failed << " messages refused by the relay" << std::endl;
+  }
+
+  sender.Close();
+  target.Close();
+  server->Shutdown();
+  return 0;
+}
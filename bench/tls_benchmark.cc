@@ -0,0 +1,191 @@
+#include "cli/client.h"
+#include "common/null_buffer.h"
+#include "common/tls.h"
+
+#include <grpcpp/grpcpp.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+void print_usage(const char* program_name) {
+  std::cout << "Usage: " << program_name << " -c <cert_file> -k <key_file> [options]\n";
+  std::cout << "Options:\n";
+  std::cout << "  -c <cert_file>         Server certificate chain (PEM)\n";
+  std::cout << "  -k <key_file>          Server private key (PEM)\n";
+  std::cout << "  -a <ca_file>           CA the certificate chains to (default: the certificate)\n";
+  std::cout << "  -O <name>              Name in the certificate (default: localhost)\n";
+  std::cout << "  -n <messages>          Messages per case (default: 500)\n";
+  std::cout << "  -s <payload_bytes>     Message content size (default: 64)\n";
+  std::cout << "  -h                     Show this help message\n";
+  std::cout << "Each case prints one JSON object per line.\n";
+}
+
+// Percentiles of latencies in microseconds as a JSON object
+std::string LatencyJson(std::vector<double> latencies) {
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double fraction) {
+    return latencies[std::min(latencies.size() - 1, static_cast<size_t>(latencies.size() * fraction))];
+  };
+  std::ostringstream json;
+  json << "{\"p50\":" << percentile(0.50) << ",\"p90\":" << percentile(0.90) << ",\"p99\":" << percentile(0.99)
+       << ",\"max\":" << percentile(1.0) << "}";
+  return json.str();
+}
+
+// Channel settings for one case: new_connection gives every message a
+// channel with its own subchannel pool, so nothing is shared with earlier
+// channels except, when enabled, the TLS session cache
+struct Case {
+  std::string transport;
+  std::string connection;
+  std::string target;
+  bool new_connection;
+  std::function<std::shared_ptr<grpc::Channel>(const std::string&, grpc::ChannelArguments)> create;
+};
+
+}  // namespace
+
+// Measures the latency of one peer send over plaintext and TLS, on a warm
+// connection and on a new connection per message, with and without TLS
+// session resumption
+int main(const int argc, const char* const argv[]) {
+  helloworld::TlsOptions tls;
+  tls.server_name_override = "localhost";
+  size_t messages = 500;
+  size_t payload_bytes = 64;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "-c" && i + 1 < argc) {
+      tls.cert_file = argv[++i];
+    } else if (arg == "-k" && i + 1 < argc) {
+      tls.key_file = argv[++i];
+    } else if (arg == "-a" && i + 1 < argc) {
+      tls.ca_file = argv[++i];
+    } else if (arg == "-O" && i + 1 < argc) {
+      tls.server_name_override = argv[++i];
+    } else if (arg == "-n" && i + 1 < argc) {
+      messages = std::max<size_t>(std::stoul(argv[++i]), 1);
+    } else if (arg == "-s" && i + 1 < argc) {
+      payload_bytes = std::stoul(argv[++i]);
+    } else if (arg == "-h") {
+      print_usage(argv[0]);
+      return 0;
+    } else {
+      std::cout << "Unknown option: " << arg << std::endl;
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (tls.cert_file.empty() || tls.key_file.empty()) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if (tls.ca_file.empty()) {
+    tls.ca_file = tls.cert_file;
+  }
+
+  // Every case's messages stay queued in the normal lane, which holds a
+  // third of the capacity, so the mailbox never refuses one
+  helloworld::ClientCommunicationServiceImpl service(messages * 8 * helloworld::kMailboxLanes);
+  std::shared_ptr<grpc::ServerCredentials> credentials = helloworld::MakeServerCredentials(tls);
+  if (!credentials) {
+    return 1;
+  }
+  grpc::ServerBuilder builder;
+  int insecure_port = 0;
+  int secure_port = 0;
+  builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(), &insecure_port);
+  builder.AddListeningPort("127.0.0.1:0", credentials, &secure_port);
+  builder.RegisterService(&service);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  if (!server) {
+    std::cout << "Failed to start server" << std::endl;
+    return 1;
+  }
+  const std::string insecure_target = "127.0.0.1:" + std::to_string(insecure_port);
+  const std::string secure_target = "127.0.0.1:" + std::to_string(secure_port);
+
+  const helloworld::ChannelFactory plaintext;
+  const helloworld::ChannelFactory resuming(tls);
+  // The factory always resumes sessions; full handshakes need plain SSL
+  // credentials without the session cache
+  grpc::SslCredentialsOptions ssl;
+  if (!helloworld::ReadPemFile(tls.ca_file, &ssl.pem_root_certs)) {
+    return 1;
+  }
+  const std::shared_ptr<grpc::ChannelCredentials> full_handshake = grpc::SslCredentials(ssl);
+
+  auto create_plaintext = [&](const std::string& target, grpc::ChannelArguments args) {
+    return plaintext.Create(target, args);
+  };
+  auto create_resuming = [&](const std::string& target, grpc::ChannelArguments args) {
+    return resuming.Create(target, args);
+  };
+  auto create_full = [&](const std::string& target, grpc::ChannelArguments args) {
+    args.SetSslTargetNameOverride(tls.server_name_override);
+    return grpc::CreateCustomChannel(target, full_handshake, args);
+  };
+  const std::vector<Case> cases = {
+      {"insecure", "warm", insecure_target, false, create_plaintext},
+      {"insecure", "new", insecure_target, true, create_plaintext},
+      {"tls", "warm", secure_target, false, create_resuming},
+      {"tls", "new", secure_target, true, create_full},
+      {"tls", "new_resumed", secure_target, true, create_resuming},
+  };
+
+  std::ostream results(std::cout.rdbuf());
+  // The receiver's per-message logging is discarded
+  helloworld::NullBuffer discarded;
+  helloworld::CoutRedirect redirect(&discarded);
+
+  helloworld::ClientMessage message;
+  message.set_from_client_id("bench_sender");
+  message.set_to_client_id("bench_receiver");
+  message.set_message_content(std::string(payload_bytes, 'x'));
+
+  for (const Case& run : cases) {
+    grpc::ChannelArguments args;
+    if (run.new_connection) {
+      args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    }
+    std::unique_ptr<helloworld::ClientCommunicationClient> client;
+    if (!run.new_connection) {
+      client = std::make_unique<helloworld::ClientCommunicationClient>(run.create(run.target, args));
+      // Connect before timing anything
+      helloworld::MessageResponse reply;
+      client->Send(message, &reply);
+    }
+
+    std::vector<double> latencies;
+    size_t failed = 0;
+    for (size_t i = 0; i < messages; ++i) {
+      const auto start = Clock::now();
+      if (run.new_connection) {
+        client = std::make_unique<helloworld::ClientCommunicationClient>(run.create(run.target, args));
+      }
+      helloworld::MessageResponse reply;
+      if (!client->Send(message, &reply).ok()) {
+        ++failed;
+      }
+      latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+    }
+
+    results << "{\"transport\":\"" << run.transport << "\",\"connection\":\"" << run.connection
+            << "\",\"messages\":" << messages << ",\"failed\":" << failed
+            << ",\"latency_us\":" << LatencyJson(latencies) << "}" << std::endl;
+  }
+
+  server->Shutdown();
+  return 0;
+}
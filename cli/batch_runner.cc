@@ -0,0 +1,110 @@
+#include "batch_runner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+namespace helloworld {
+
+BatchCommand ParseBatchCommand(const std::string& line) {
+  BatchCommand command;
+  std::istringstream iss(line);
+  std::string name;
+  iss >> name;
+  if (name.empty() || name[0] == '#') {
+    return command;
+  }
+
+  iss >> command.destination;
+  std::getline(iss, command.message);
+  if (!command.message.empty() && command.message[0] == ' ') {
+    command.message.erase(0, 1);
+  }
+  command.kind = name == "send" && !command.destination.empty() && !command.message.empty()
+                     ? BatchCommand::Kind::kSend
+                     : BatchCommand::Kind::kInvalid;
+  return command;
+}
+
+double BatchStats::Percentile(double fraction) const {
+  if (latencies_ms.empty()) {
+    return 0.0;
+  }
+  const size_t index = static_cast<size_t>(latencies_ms.size() * fraction);
+  return latencies_ms[std::min(index, latencies_ms.size() - 1)];
+}
+
+BatchStats RunBatch(std::istream& input,
+                    size_t in_flight,
+                    const std::function<bool(const std::string& destination, const std::string& message)>& send) {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<BatchCommand> queue;
+  bool done = false;
+  BatchStats stats;
+
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < in_flight; ++i) {
+    workers.emplace_back([&]() {
+      while (true) {
+        BatchCommand command;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          cv.wait(lock, [&] { return done || !queue.empty(); });
+          if (queue.empty()) {
+            return;
+          }
+          command = std::move(queue.front());
+          queue.pop_front();
+        }
+        cv.notify_all();
+
+        const auto call = std::chrono::steady_clock::now();
+        const bool ok = send(command.destination, command.message);
+        const double elapsed_ms =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - call).count();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        ++stats.sent;
+        stats.failed += ok ? 0 : 1;
+        stats.latencies_ms.push_back(elapsed_ms);
+      }
+    });
+  }
+
+  std::string line;
+  while (std::getline(input, line)) {
+    BatchCommand command = ParseBatchCommand(line);
+    if (command.kind == BatchCommand::Kind::kIgnored) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if (command.kind == BatchCommand::Kind::kInvalid) {
+      ++stats.skipped;
+      continue;
+    }
+    cv.wait(lock, [&] { return queue.size() < in_flight; });
+    queue.push_back(std::move(command));
+    lock.unlock();
+    cv.notify_all();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+  }
+  cv.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::sort(stats.latencies_ms.begin(), stats.latencies_ms.end());
+  return stats;
+}
+
+}  // namespace helloworld
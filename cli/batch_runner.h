@@ -0,0 +1,52 @@
+#ifndef HELLOWORLD_BATCH_RUNNER_H
+#define HELLOWORLD_BATCH_RUNNER_H
+
+#include <cstddef>
+#include <functional>
+#include <istream>
+#include <string>
+#include <vector>
+
+namespace helloworld {
+
+// One line of a batch command file
+struct BatchCommand {
+  enum class Kind {
+    // Blank or a # comment
+    kIgnored,
+    // "send <destination> <message>"
+    kSend,
+    // Anything else; counted as skipped
+    kInvalid,
+  };
+  Kind kind = Kind::kIgnored;
+  std::string destination;
+  std::string message;
+};
+
+BatchCommand ParseBatchCommand(const std::string& line);
+
+// Outcome of a batch run
+struct BatchStats {
+  size_t sent = 0;
+  size_t failed = 0;
+  size_t skipped = 0;
+  double seconds = 0;
+  // Per send, sorted
+  std::vector<double> latencies_ms;
+
+  // Latency below which this fraction of sends completed; 0 without sends
+  double Percentile(double fraction) const;
+};
+
+// Runs the send commands read from input with up to in_flight calls to send
+// outstanding. send returns whether the message was delivered. Only one more
+// command per call in flight is read ahead, so a long stream is not held in
+// memory.
+BatchStats RunBatch(std::istream& input,
+                    size_t in_flight,
+                    const std::function<bool(const std::string& destination, const std::string& message)>& send);
+
+}  // namespace helloworld
+
+#endif  // HELLOWORLD_BATCH_RUNNER_H
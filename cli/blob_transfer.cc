@@ -0,0 +1,263 @@
+#include "blob_transfer.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cinttypes>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <system_error>
+#include <utility>
+
+namespace helloworld {
+
+namespace {
+
+// Table for the reflected Castagnoli polynomial
+std::array<uint32_t, 256> MakeCrc32cTable() {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < table.size(); ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78u : 0);
+    }
+    table[i] = crc;
+  }
+  return table;
+}
+
+}  // namespace
+
+uint32_t Crc32c(const char* data, size_t size) {
+  static const std::array<uint32_t, 256> table = MakeCrc32cTable();
+  uint32_t crc = ~0u;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+std::string BlobTransferId(const std::string& path, uint64_t size, int64_t modified_ns) {
+  // 64-bit FNV-1a over the path and the modification time
+  uint64_t hash = 0xcbf29ce484222325u;
+  auto mix = [&hash](uint8_t byte) { hash = (hash ^ byte) * 0x100000001b3u; };
+  for (char c : path) {
+    mix(static_cast<uint8_t>(c));
+  }
+  for (int shift = 0; shift < 64; shift += 8) {
+    mix(static_cast<uint8_t>(static_cast<uint64_t>(modified_ns) >> shift));
+  }
+  char id[40];
+  std::snprintf(id, sizeof(id), "%016" PRIx64 "-%zu", hash, size);
+  return id;
+}
+
+bool ValidTransferId(const std::string& transfer_id) {
+  if (transfer_id.empty() || transfer_id.size() > kMaxTransferIdLength || transfer_id == "." ||
+      transfer_id == "..") {
+    return false;
+  }
+  return std::all_of(transfer_id.begin(), transfer_id.end(), [](char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_' || c == '.';
+  });
+}
+
+MappedFile::MappedFile(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) == 0) {
+    size_ = static_cast<size_t>(info.st_size);
+    modified_ns_ = int64_t{info.st_mtim.tv_sec} * 1000000000 + info.st_mtim.tv_nsec;
+    if (size_ == 0) {
+      ok_ = true;
+    } else {
+      void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapping != MAP_FAILED) {
+        // Chunks are read front to back exactly once
+        madvise(mapping, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(mapping);
+        ok_ = true;
+      }
+    }
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+}
+
+BlobReceiver::BlobReceiver(std::string directory) : directory_(std::move(directory)) {}
+
+void BlobReceiver::SetDirectory(const std::string& directory) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  directory_ = directory;
+}
+
+grpc::Status BlobReceiver::Receive(grpc::ServerReaderInterface<helloworld::BlobChunk>* reader,
+                                   helloworld::BlobTransferResponse* reply) {
+  helloworld::BlobChunk chunk;
+  if (!reader->Read(&chunk) || !ValidTransferId(chunk.transfer_id())) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "A valid transfer id is required");
+  }
+  if (chunk.total_size() > kMaxBlobSize) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "Blob is larger than " + std::to_string(kMaxBlobSize) + " bytes");
+  }
+  const std::string transfer_id = chunk.transfer_id();
+
+  Transfer* transfer;
+  std::string partial_path;
+  std::string final_path;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (transfers_.count(transfer_id) > 0) {
+      return grpc::Status(grpc::StatusCode::ABORTED, "Transfer already in progress");
+    }
+    Transfer found = LookupLocked(transfer_id);
+    if (found.complete) {
+      reply->set_committed_offset(found.committed);
+      reply->set_complete(true);
+      return grpc::Status::OK;
+    }
+    if (chunk.total_size() < found.committed) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Blob is shorter than the data already received");
+    }
+    found.total_size = chunk.total_size();
+    transfer = &transfers_.emplace(transfer_id, found).first->second;
+    partial_path = PathLocked(transfer_id, true);
+    final_path = PathLocked(transfer_id, false);
+  }
+
+  std::error_code error;
+  std::filesystem::create_directories(std::filesystem::path(partial_path).parent_path(), error);
+
+  // Only one stream writes a transfer at a time, so the file and the
+  // committed offset are used without the lock until it is released
+  uint64_t committed = transfer->committed;
+  std::fstream file;
+  if (committed == 0) {
+    file.open(partial_path, std::ios::binary | std::ios::out | std::ios::trunc);
+  } else {
+    file.open(partial_path, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(static_cast<std::streamoff>(committed));
+  }
+
+  grpc::Status status;
+  if (!file) {
+    status = grpc::Status(grpc::StatusCode::INTERNAL, "Cannot open blob file");
+  }
+  while (status.ok()) {
+    if (chunk.transfer_id() != transfer_id) {
+      status = grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Transfer id changed mid-stream");
+    } else if (chunk.offset() != committed) {
+      status = grpc::Status(grpc::StatusCode::FAILED_PRECONDITION,
+                            "Expected offset " + std::to_string(committed));
+    } else if (committed + chunk.data().size() > transfer->total_size) {
+      status = grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Chunk runs past the end of the blob");
+    } else if (Crc32c(chunk.data().data(), chunk.data().size()) != chunk.crc32c()) {
+      status = grpc::Status(grpc::StatusCode::DATA_LOSS,
+                            "Checksum mismatch at offset " + std::to_string(committed));
+    } else {
+      file.write(chunk.data().data(), static_cast<std::streamsize>(chunk.data().size()));
+      file.flush();
+      if (!file) {
+        status = grpc::Status(grpc::StatusCode::INTERNAL, "Failed to write blob file");
+        break;
+      }
+      committed += chunk.data().size();
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      transfer->committed = committed;
+    }
+
+    if (!status.ok() || !reader->Read(&chunk)) {
+      break;
+    }
+  }
+  file.close();
+
+  // From here on the files hold the transfer's state
+  std::lock_guard<std::mutex> lock(mutex_);
+  const bool finished = status.ok() && committed == transfer->total_size;
+  transfers_.erase(transfer_id);
+  if (finished) {
+    std::filesystem::rename(partial_path, final_path, error);
+    if (error) {
+      return grpc::Status(grpc::StatusCode::INTERNAL, "Failed to store blob: " + error.message());
+    }
+    std::cout << "Received blob " << transfer_id << " (" << committed << " bytes) at " << final_path
+              << std::endl;
+  }
+
+  reply->set_committed_offset(committed);
+  reply->set_complete(finished);
+  return status;
+}
+
+grpc::Status BlobReceiver::Progress(const std::string& transfer_id, helloworld::BlobTransferResponse* reply) {
+  if (!ValidTransferId(transfer_id)) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "A valid transfer id is required");
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  const Transfer transfer = LookupLocked(transfer_id);
+  reply->set_committed_offset(transfer.committed);
+  reply->set_complete(transfer.complete);
+  return grpc::Status::OK;
+}
+
+std::string BlobReceiver::CompletedPath(const std::string& transfer_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!LookupLocked(transfer_id).complete) {
+    return "";
+  }
+  return PathLocked(transfer_id, false);
+}
+
+BlobReceiver::Transfer BlobReceiver::LookupLocked(const std::string& transfer_id) const {
+  auto it = transfers_.find(transfer_id);
+  if (it != transfers_.end()) {
+    return it->second;
+  }
+
+  Transfer transfer;
+  std::error_code error;
+  const uint64_t final_size = std::filesystem::file_size(PathLocked(transfer_id, false), error);
+  if (!error) {
+    transfer.total_size = final_size;
+    transfer.committed = final_size;
+    transfer.complete = true;
+    return transfer;
+  }
+  const uint64_t partial_size = std::filesystem::file_size(PathLocked(transfer_id, true), error);
+  if (!error) {
+    transfer.committed = partial_size;
+  }
+  return transfer;
+}
+
+std::string BlobReceiver::PathLocked(const std::string& transfer_id, bool partial) const {
+  std::filesystem::path path = std::filesystem::path(directory_) / transfer_id;
+  return partial ? path.string() + ".part" : path.string();
+}
+
+std::string DefaultBlobDirectory() {
+  std::error_code error;
+  std::filesystem::path temp = std::filesystem::temp_directory_path(error);
+  return ((error ? std::filesystem::path("/tmp") : temp) / "helloworld-blobs").string();
+}
+
+}  // namespace helloworld
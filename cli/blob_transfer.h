@@ -0,0 +1,104 @@
+#ifndef HELLOWORLD_BLOB_TRANSFER_H
+#define HELLOWORLD_BLOB_TRANSFER_H
+
+#include <grpcpp/grpcpp.h>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "proto/helloworld.grpc.pb.h"
+
+namespace helloworld {
+
+// Blob chunk size; well under gRPC's default 4 MiB message limit
+constexpr size_t kDefaultBlobChunkSize = 256 * 1024;
+
+// Largest blob a receiver accepts
+constexpr uint64_t kMaxBlobSize = uint64_t{4} << 30;
+
+// Longest transfer id a receiver accepts
+constexpr size_t kMaxTransferIdLength = 128;
+
+// CRC-32C (Castagnoli) checksum carried by every blob chunk
+uint32_t Crc32c(const char* data, size_t size);
+
+// Transfer id of a file, from a hash of its path and modification time and
+// its size, so the same file sent again resumes rather than restarts. Costs
+// nothing per byte, unlike hashing the content.
+std::string BlobTransferId(const std::string& path, uint64_t size, int64_t modified_ns);
+
+// Transfer ids come from peers and name files on the receiver: only
+// letters, digits, '-', '_' and '.', and never "." or ".."
+bool ValidTransferId(const std::string& transfer_id);
+
+// Read-only memory mapping of a whole file, so a blob can be streamed
+// without reading it into memory first
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& path);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool ok() const { return ok_; }
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  // Modification time, in nanoseconds since the epoch
+  int64_t modified_ns() const { return modified_ns_; }
+
+ private:
+  bool ok_ = false;
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  int64_t modified_ns_ = 0;
+};
+
+// Receiving end of blob transfers. Each transfer is written straight to a
+// partial file in the blob directory, so memory use stays flat whatever the
+// blob size, and is renamed once every byte has arrived. Only transfers
+// being received are held in memory; the committed offset of any other is
+// recovered from its partial file, and a completed one from its final file,
+// so progress outlives a broken stream and a restart too.
+class BlobReceiver {
+ public:
+  explicit BlobReceiver(std::string directory);
+
+  void SetDirectory(const std::string& directory);
+
+  // Read one stream of chunks, appending each at the committed offset
+  grpc::Status Receive(grpc::ServerReaderInterface<helloworld::BlobChunk>* reader,
+                       helloworld::BlobTransferResponse* reply);
+
+  // Progress of a transfer, for a sender about to resume it
+  grpc::Status Progress(const std::string& transfer_id, helloworld::BlobTransferResponse* reply);
+
+  // Path of a completed blob; empty while it is still incomplete
+  std::string CompletedPath(const std::string& transfer_id);
+
+ private:
+  struct Transfer {
+    uint64_t total_size = 0;
+    uint64_t committed = 0;
+    bool complete = false;
+  };
+
+  // State of a transfer: an active one's, or else recovered from its files
+  Transfer LookupLocked(const std::string& transfer_id) const;
+
+  std::string PathLocked(const std::string& transfer_id, bool partial) const;
+
+  std::string directory_;
+  std::mutex mutex_;
+  // Transfers with a stream writing them
+  std::map<std::string, Transfer> transfers_;
+};
+
+// Default directory received blobs are written to
+std::string DefaultBlobDirectory();
+
+}  // namespace helloworld
+
+#endif  // HELLOWORLD_BLOB_TRANSFER_H
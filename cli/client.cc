@@ -1,75 +1,641 @@
 #include "client.h"
 
 #include <iostream>
+#include <grpcpp/generic/generic_stub.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <filesystem>
 #include <memory>
 #include <string>
 #include <chrono>
 
 namespace helloworld {
 
+namespace {
+
+// State of one in-flight callback RPC; deleted from its completion callback
+template <typename Request, typename Response>
+struct AsyncCall {
+  explicit AsyncCall(std::chrono::milliseconds timeout) {
+    context.set_deadline(std::chrono::system_clock::now() + timeout);
+  }
+
+  grpc::ClientContext context;
+  Request request;
+  Response reply;
+};
+
+// Weight of the newest sample in an endpoint's latency average
+constexpr double kLatencySmoothing = 0.2;
+
+// Latency charged to an endpoint for a failed read
+constexpr std::chrono::microseconds kFailedReadLatency(std::chrono::seconds(1));
+
+// With latency balancing, every Nth read goes round robin so slower
+// endpoints keep being measured and can win back traffic
+constexpr uint64_t kLatencyProbeInterval = 16;
+
+// Retry policy for idempotent registry reads. Registration, unregistration
+// and publish are not retried: a lost reply would make a retry fail or repeat.
+const char kRegistryServiceConfig[] = R"({
+  "loadBalancingConfig": [{"round_robin": {}}],
+  "healthCheckConfig": {"serviceName": ""},
+  "methodConfig": [{
+    "name": [
+      {"service": "helloworld.ClientRegistry", "method": "GetClient"},
+      {"service": "helloworld.ClientRegistry", "method": "GetClients"},
+      {"service": "helloworld.ClientRegistry", "method": "ListClients"},
+      {"service": "helloworld.ClientRegistry", "method": "QueryClients"}
+    ],
+    "retryPolicy": {
+      "maxAttempts": 3,
+      "initialBackoff": "0.05s",
+      "maxBackoff": "0.5s",
+      "backoffMultiplier": 2,
+      "retryableStatusCodes": ["UNAVAILABLE"]
+    }
+  }]
+})";
+
+// State of one hedged lookup, shared with its attempts' callbacks so it
+// outlives the caller when attempts are still in flight
+struct HedgedLookup {
+  struct Attempt {
+    grpc::ClientContext context;
+    helloworld::ClientInfo reply;
+  };
+
+  helloworld::ClientLookup request;
+  std::vector<std::unique_ptr<Attempt>> attempts;
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t failed = 0;
+  bool done = false;
+  grpc::Status status = grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED, "No registry answered");
+  helloworld::ClientInfo reply;
+};
+
+// Priority served by each mailbox lane, in lane order
+const helloworld::MessagePriority kLanePriorities[kMailboxLanes] = {
+    helloworld::MESSAGE_PRIORITY_HIGH,
+    helloworld::MESSAGE_PRIORITY_NORMAL,
+    helloworld::MESSAGE_PRIORITY_BULK,
+};
+
+// Lane of normal-priority messages, in kLanePriorities
+constexpr size_t kNormalLane = 1;
+
+// Lane for a message; priorities this build does not know go in normal
+size_t LaneFor(const helloworld::ClientMessage& message) {
+  for (size_t lane = 0; lane < kMailboxLanes; ++lane) {
+    if (kLanePriorities[lane] == message.priority()) {
+      return lane;
+    }
+  }
+  return kNormalLane;
+}
+
+// Every lane holds at least one message
+size_t MailboxCapacity(size_t capacity) {
+  return std::max(capacity, kMailboxLanes);
+}
+
+// Visit the clients of a ListClients reply; false, logging why, if the call
+// failed or the list is malformed
+template <typename Visitor>
+bool VisitClientList(const grpc::Status& status, const helloworld::ClientList& list, Visitor visit) {
+  if (!status.ok()) {
+    std::cout << "Failed to list clients: " << status.error_message() << std::endl;
+    return false;
+  }
+  // A registry without compact lists answers with the full form
+  if (!ForEachListedClient(list, visit)) {
+    std::cout << "Failed to list clients: malformed compact list" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Entries of a ListClients reply in either form; empty if it failed. Each
+// entry is built in place from the views, with no temporary strings.
+std::vector<ClientEntry> ToClientEntries(const grpc::Status& status, const helloworld::ClientList& list) {
+  std::vector<ClientEntry> clients;
+  clients.reserve(list.has_compact() ? list.compact().id_lengths_size() : list.clients_size());
+  VisitClientList(status, list, [&clients](const ListedClient& client) {
+    clients.emplace_back(client.client_id, client.address, client.port, client.online);
+  });
+  return clients;
+}
+
+// Mailbox's retry-after hint from a refused call's trailers
+std::chrono::milliseconds RetryAfterHint(const grpc::ClientContext& context) {
+  auto hint = context.GetServerTrailingMetadata().find(kRetryAfterMetadataKey);
+  if (hint == context.GetServerTrailingMetadata().end()) {
+    return kMailboxFullRetryAfter;
+  }
+  return std::chrono::milliseconds(
+      std::strtoll(std::string(hint->second.data(), hint->second.size()).c_str(), nullptr, 10));
+}
+
+// One encoded message served through the generic service: a single
+// request and a single reply
+class EncodedMessageReactor final : public grpc::ServerGenericBidiReactor {
+ public:
+  EncodedMessageReactor(grpc::GenericCallbackServerContext* context,
+                        const MailboxResolver* resolver,
+                        const MessageCodec* codec)
+      : context_(context), resolver_(resolver), codec_(codec) {
+    if (codec_ == nullptr) {
+      Finish(grpc::Status(grpc::StatusCode::UNIMPLEMENTED, "Unknown method " + context_->method()));
+      return;
+    }
+    StartRead(&request_);
+  }
+
+  void OnReadDone(bool ok) override {
+    if (!ok) {
+      Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "No message sent"));
+      return;
+    }
+    DecodedMessage decoded;
+    grpc::Status status = codec_->Decode(&request_, &decoded);
+    if (!status.ok()) {
+      Finish(status);
+      return;
+    }
+    std::shared_ptr<ClientCommunicationServiceImpl> mailbox = (*resolver_)(decoded.view.to_client_id);
+    if (!mailbox) {
+      Finish(grpc::Status(grpc::StatusCode::NOT_FOUND,
+                          "No client " + std::string(decoded.view.to_client_id) + " here"));
+      return;
+    }
+    helloworld::MessageResponse reply;
+    status = mailbox->SendMessageView(context_, decoded.view, &reply);
+    if (!status.ok()) {
+      Finish(status);
+      return;
+    }
+    bool own_buffer = false;
+    grpc::SerializationTraits<helloworld::MessageResponse>::Serialize(reply, &response_, &own_buffer);
+    StartWriteAndFinish(&response_, grpc::WriteOptions(), grpc::Status::OK);
+  }
+
+  void OnDone() override { delete this; }
+
+ private:
+  grpc::GenericCallbackServerContext* context_;
+  const MailboxResolver* resolver_;
+  const MessageCodec* codec_;
+  grpc::ByteBuffer request_;
+  grpc::ByteBuffer response_;
+};
+
+// Adapt a callback-style call into a future
+template <typename T, typename Start>
+std::future<T> MakeFuture(Start start) {
+  auto promise = std::make_shared<std::promise<T>>();
+  std::future<T> future = promise->get_future();
+  start([promise](T value) { promise->set_value(std::move(value)); });
+  return future;
+}
+
+}  // namespace
+
 // Client communication service implementation
+ClientCommunicationServiceImpl::ClientCommunicationServiceImpl(size_t capacity)
+    : capacity_(MailboxCapacity(capacity)) {}
+
 grpc::Status ClientCommunicationServiceImpl::SendMessage(grpc::ServerContext* context,
                                                         const helloworld::ClientMessage* request,
                                                         helloworld::MessageResponse* reply) {
+  return HandleMessage(context, *request, reply);
+}
+
+grpc::Status ClientCommunicationServiceImpl::SendMessageView(grpc::ServerContextBase* context,
+                                                            const ClientMessageView& message,
+                                                            helloworld::MessageResponse* reply) {
+  return HandleMessage(context, ToMessage(message), reply);
+}
+
+grpc::Status ClientCommunicationServiceImpl::HandleMessage(grpc::ServerContextBase* context,
+                                                          const helloworld::ClientMessage& message,
+                                                          helloworld::MessageResponse* reply) {
+  Span span(tracer_.get(), "HandleSendMessage", Tracer::Extract(*context));
+  span.SetAttribute("from", message.from_client_id());
   std::lock_guard<std::mutex> lock(message_mutex_);
   
-  // Store the message in the queue
-  message_queue_.push_back(*request);
-  
-  std::cout << "Received message from " << request->from_client_id() 
-            << ": " << request->message_content() << std::endl;
+  DeliveryResult result = DeliverLocked(message);
+  if (result == DeliveryResult::kMailboxFull) {
+    context->AddTrailingMetadata(kRetryAfterMetadataKey, std::to_string(kMailboxFullRetryAfter.count()));
+    return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "Mailbox is full");
+  }
   
+  // A resend of a message that already arrived still succeeds
   reply->set_success(true);
+  reply->set_credits(CreditsLocked(message));
+  if (result == DeliveryResult::kDuplicate) {
+    reply->set_duplicate(true);
+    reply->set_message("Duplicate message ignored");
+    return grpc::Status::OK;
+  }
+  
   reply->set_message("Message received");
   
   return grpc::Status::OK;
 }
 
+EncodedMessageService::EncodedMessageService(ClientCommunicationServiceImpl* mailbox)
+    : EncodedMessageService([mailbox](std::string_view) {
+        // Not owned: the mailbox outlives the service
+        return std::shared_ptr<ClientCommunicationServiceImpl>(std::shared_ptr<void>(), mailbox);
+      }) {}
+
+EncodedMessageService::EncodedMessageService(MailboxResolver resolver) : resolver_(std::move(resolver)) {
+  AddCodec(std::make_shared<FlatMessageCodec>());
+}
+
+void EncodedMessageService::AddCodec(std::shared_ptr<const MessageCodec> codec) {
+  codecs_[codec->method()] = std::move(codec);
+}
+
+grpc::ServerGenericBidiReactor* EncodedMessageService::CreateReactor(grpc::GenericCallbackServerContext* context) {
+  auto it = codecs_.find(context->method());
+  return new EncodedMessageReactor(context, &resolver_, it == codecs_.end() ? nullptr : it->second.get());
+}
+
+DeliveryResult ClientCommunicationServiceImpl::DeliverMessage(const helloworld::ClientMessage& message) {
+  std::lock_guard<std::mutex> lock(message_mutex_);
+  return DeliverLocked(message);
+}
+
+void ClientCommunicationServiceImpl::SetCapacity(size_t capacity) {
+  std::lock_guard<std::mutex> lock(message_mutex_);
+  capacity_ = MailboxCapacity(capacity);
+}
+
+std::vector<MailboxLaneStats> ClientCommunicationServiceImpl::LaneStats() {
+  std::lock_guard<std::mutex> lock(message_mutex_);
+  
+  std::vector<MailboxLaneStats> stats(kMailboxLanes);
+  for (size_t i = 0; i < kMailboxLanes; ++i) {
+    const Lane& lane = lanes_[i];
+    stats[i].priority = kLanePriorities[i];
+    stats[i].depth = lane.messages.size();
+    stats[i].dequeued = lane.dequeued;
+    if (lane.dequeued > 0) {
+      stats[i].average_wait =
+          std::chrono::duration_cast<std::chrono::microseconds>(lane.total_wait / lane.dequeued);
+    }
+    stats[i].max_wait = std::chrono::duration_cast<std::chrono::microseconds>(lane.max_wait);
+  }
+  return stats;
+}
+
+size_t ClientCommunicationServiceImpl::LaneCapacityLocked(size_t lane) const {
+  return capacity_ / kMailboxLanes + (lane < capacity_ % kMailboxLanes ? 1 : 0);
+}
+
+int32_t ClientCommunicationServiceImpl::CreditsLocked(const helloworld::ClientMessage& message) const {
+  const size_t lane = LaneFor(message);
+  const size_t capacity = LaneCapacityLocked(lane);
+  return static_cast<int32_t>(capacity - std::min(capacity, lanes_[lane].messages.size()));
+}
+
+DeliveryResult ClientCommunicationServiceImpl::DeliverLocked(const helloworld::ClientMessage& message) {
+  const size_t lane = LaneFor(message);
+  std::deque<QueuedMessage>& queue = lanes_[lane].messages;
+  
+  // Checked before the dedup window so a refused message can be resent
+  if (queue.size() >= LaneCapacityLocked(lane)) {
+    std::cout << "Mailbox full, refused message from " << message.from_client_id() << std::endl;
+    return DeliveryResult::kMailboxFull;
+  }
+  
+  if (!AcceptLocked(message)) {
+    std::cout << "Dropped duplicate message " << message.sequence() << " from "
+              << message.from_client_id() << std::endl;
+    return DeliveryResult::kDuplicate;
+  }
+  
+  // Store the message in its lane. A late arrival goes ahead of any later
+  // message from the same sender still queued in that lane.
+  auto position = queue.end();
+  if (message.sequence() != 0 && message.sequence() < sender_windows_[message.from_client_id()].highest) {
+    position = std::find_if(queue.begin(), queue.end(),
+                            [&message](const QueuedMessage& queued) {
+                              return queued.message.from_client_id() == message.from_client_id() &&
+                                     queued.message.sender_epoch() == message.sender_epoch() &&
+                                     queued.message.sequence() > message.sequence();
+                            });
+  }
+  queue.insert(position, QueuedMessage{message, std::chrono::steady_clock::now()});
+  message_cv_.notify_one();
+  
+  std::cout << "Received message from " << message.from_client_id() 
+            << ": " << message.message_content() << std::endl;
+  return DeliveryResult::kQueued;
+}
+
+bool ClientCommunicationServiceImpl::AcceptLocked(const helloworld::ClientMessage& message) {
+  if (message.sequence() == 0) {
+    return true;
+  }
+  
+  SenderWindow& window = sender_windows_[message.from_client_id()];
+  if (message.sender_epoch() != window.epoch) {
+    // The sender restarted and its sequences start over. Epochs are random,
+    // so there is no telling an older one apart; any change starts afresh.
+    window = SenderWindow{message.sender_epoch(), message.sequence(), 1};
+    return true;
+  }
+  
+  if (message.sequence() > window.highest) {
+    const uint64_t shift = message.sequence() - window.highest;
+    window.seen = shift >= kDedupWindow ? 1 : (window.seen << shift) | 1;
+    window.highest = message.sequence();
+    return true;
+  }
+  
+  const uint64_t offset = window.highest - message.sequence();
+  if (offset >= kDedupWindow) {
+    return false;
+  }
+  const uint64_t bit = uint64_t{1} << offset;
+  if (window.seen & bit) {
+    return false;
+  }
+  window.seen |= bit;
+  return true;
+}
+
 grpc::Status ClientCommunicationServiceImpl::ReceiveMessage(grpc::ServerContext* context,
                                                            const helloworld::MessageRequest* request,
                                                            helloworld::ClientMessage* reply) {
-  std::lock_guard<std::mutex> lock(message_mutex_);
-  
-  if (message_queue_.empty()) {
+  // A long poll ends early when the caller gives up
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::min(std::chrono::milliseconds(request->wait_ms()), kMaxReceiveWait);
+  if (context->deadline() != std::chrono::system_clock::time_point::max()) {
+    deadline = std::min(deadline, std::chrono::steady_clock::now() +
+                                      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                          context->deadline() - std::chrono::system_clock::now()));
+  }
+  if (!WaitMessage(reply, deadline)) {
     // No messages available
     reply->set_from_client_id("");
     reply->set_to_client_id("");
     reply->set_message_content("");
     reply->set_timestamp("");
-    return grpc::Status::OK;
+  }
+  return grpc::Status::OK;
+}
+
+bool ClientCommunicationServiceImpl::TakeMessage(helloworld::ClientMessage* message) {
+  std::lock_guard<std::mutex> lock(message_mutex_);
+  return TakeLocked(message);
+}
+
+bool ClientCommunicationServiceImpl::WaitMessage(helloworld::ClientMessage* message,
+                                                 std::chrono::steady_clock::time_point deadline) {
+  std::unique_lock<std::mutex> lock(message_mutex_);
+  while (!TakeLocked(message)) {
+    if (message_cv_.wait_until(lock, deadline) == std::cv_status::timeout) {
+      return TakeLocked(message);
+    }
+  }
+  return true;
+}
+
+bool ClientCommunicationServiceImpl::TakeLocked(helloworld::ClientMessage* message) {
+  Lane* lane = NextLaneLocked();
+  if (lane == nullptr) {
+    return false;
+  }
+  
+  // Return the lane's first message and remove it from the lane
+  QueuedMessage& queued = lane->messages.front();
+  const auto wait = std::chrono::steady_clock::now() - queued.enqueued;
+  *message = std::move(queued.message);
+  lane->messages.pop_front();
+  
+  --lane->budget;
+  ++lane->dequeued;
+  lane->total_wait += wait;
+  lane->max_wait = std::max(lane->max_wait, wait);
+  
+  return true;
+}
+
+ClientCommunicationServiceImpl::Lane* ClientCommunicationServiceImpl::NextLaneLocked() {
+  // Highest-priority lane with messages and budget left. Once every busy
+  // lane has spent its budget, a new round starts with fresh budgets.
+  for (int round = 0; round < 2; ++round) {
+    for (Lane& lane : lanes_) {
+      if (!lane.messages.empty() && lane.budget > 0) {
+        return &lane;
+      }
+    }
+    for (size_t i = 0; i < kMailboxLanes; ++i) {
+      lanes_[i].budget = kMailboxLaneWeights[i];
+    }
+  }
+  return nullptr;
+}
+
+grpc::Status ClientCommunicationServiceImpl::SendMessageBatch(grpc::ServerContext* context,
+                                                             const helloworld::ClientMessageBatch* request,
+                                                             helloworld::MessageBatchResponse* reply) {
+  std::lock_guard<std::mutex> lock(message_mutex_);
+  
+  for (const helloworld::ClientMessage& message : request->messages()) {
+    helloworld::MessageResponse* response = reply->add_responses();
+    DeliveryResult result = DeliverLocked(message);
+    if (result == DeliveryResult::kMailboxFull) {
+      response->set_message("Mailbox is full");
+      reply->set_retry_after_ms(static_cast<uint32_t>(kMailboxFullRetryAfter.count()));
+      continue;
+    }
+    response->set_success(true);
+    response->set_duplicate(result == DeliveryResult::kDuplicate);
+    response->set_message(result == DeliveryResult::kDuplicate ? "Duplicate message ignored"
+                                                               : "Message received");
   }
   
-  // Return the first message and remove it from queue
-  *reply = message_queue_.front();
-  message_queue_.erase(message_queue_.begin());
+  // Every response carries its lane's credits after the whole batch
+  for (int i = 0; i < request->messages_size(); ++i) {
+    reply->mutable_responses(i)->set_credits(CreditsLocked(request->messages(i)));
+  }
   
   return grpc::Status::OK;
 }
 
+grpc::Status ClientCommunicationServiceImpl::TransferBlob(grpc::ServerContext* context,
+                                                         grpc::ServerReader<helloworld::BlobChunk>* reader,
+                                                         helloworld::BlobTransferResponse* reply) {
+  return blobs_.Receive(reader, reply);
+}
+
+grpc::Status ClientCommunicationServiceImpl::GetBlobOffset(grpc::ServerContext* context,
+                                                          const helloworld::BlobOffsetRequest* request,
+                                                          helloworld::BlobTransferResponse* reply) {
+  return blobs_.Progress(request->transfer_id(), reply);
+}
+
+std::shared_ptr<grpc::Channel> CreateRegistryChannel(const std::string& registry_server_address,
+                                                     const ChannelFactory& channels) {
+  grpc::ChannelArguments args;
+  args.SetInt(GRPC_ARG_ENABLE_RETRIES, 1);
+  args.SetServiceConfigJSON(kRegistryServiceConfig);
+  return channels.Create(registry_server_address, args);
+}
+
 // Client registry client implementation
 ClientRegistryClient::ClientRegistryClient(std::shared_ptr<grpc::Channel> channel)
-    : stub_(helloworld::ClientRegistry::NewStub(channel)) {}
+    : ClientRegistryClient(std::vector<std::shared_ptr<grpc::Channel>>{channel}) {}
+
+ClientRegistryClient::ClientRegistryClient(const std::vector<std::shared_ptr<grpc::Channel>>& channels)
+    : channels_(channels), latency_(std::make_shared<LatencyStats>()), epochs_(std::make_shared<EpochState>()) {
+  for (const auto& channel : channels) {
+    stubs_.push_back(helloworld::ClientRegistry::NewStub(channel));
+  }
+  latency_->average_us.resize(channels.size(), 0);
+  epochs_->epochs.resize(channels.size(), 0);
+}
+
+void ClientRegistryClient::SetReplicas(bool replicas) {
+  replicas_ = replicas;
+}
+
+void ClientRegistryClient::SetBalancing(RegistryBalancing balancing) {
+  balancing_ = balancing;
+}
+
+bool ClientRegistryClient::Healthy(size_t endpoint) const {
+  // Connects idle channels so their health is known for the next pick
+  grpc_connectivity_state state = channels_[endpoint]->GetState(true);
+  return state != GRPC_CHANNEL_TRANSIENT_FAILURE && state != GRPC_CHANNEL_SHUTDOWN;
+}
+
+std::vector<size_t> ClientRegistryClient::ReadOrder() const {
+  if (!replicas_) {
+    return {0};
+  }
+  std::vector<size_t> healthy;
+  std::vector<size_t> ejected;
+  for (size_t i = 0; i < stubs_.size(); ++i) {
+    (Healthy(i) ? healthy : ejected).push_back(i);
+  }
+  
+  if (healthy.size() > 1) {
+    std::lock_guard<std::mutex> lock(latency_->mutex);
+    const uint64_t read = latency_->reads++;
+    if (balancing_ == RegistryBalancing::kRoundRobin || read % kLatencyProbeInterval == 0) {
+      std::rotate(healthy.begin(), healthy.begin() + latency_->next_read++ % healthy.size(), healthy.end());
+    } else {
+      // Unmeasured endpoints (average 0) sort first and get measured
+      const std::vector<double>& average_us = latency_->average_us;
+      std::stable_sort(healthy.begin(), healthy.end(), [&average_us](size_t a, size_t b) {
+        return average_us[a] < average_us[b];
+      });
+    }
+  }
+  
+  // Ejected endpoints stay as a last resort in case the health view is stale
+  healthy.insert(healthy.end(), ejected.begin(), ejected.end());
+  return healthy;
+}
+
+size_t ClientRegistryClient::WriteEndpoint() const {
+  for (size_t i = 0; replicas_ && i < stubs_.size(); ++i) {
+    if (Healthy(i)) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+void ClientRegistryClient::RecordLatency(LatencyStats* stats, size_t endpoint,
+                                         std::chrono::steady_clock::time_point start,
+                                         const grpc::Status& status) {
+  // Cancelled calls are hedging losers, not a sign of a slow endpoint
+  if (status.error_code() == grpc::StatusCode::CANCELLED) {
+    return;
+  }
+  const double sample_us = status.ok()
+      ? std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count()
+      : static_cast<double>(kFailedReadLatency.count());
+  
+  std::lock_guard<std::mutex> lock(stats->mutex);
+  double& average_us = stats->average_us[endpoint];
+  average_us = average_us == 0 ? sample_us : (1 - kLatencySmoothing) * average_us + kLatencySmoothing * sample_us;
+}
+
+void ClientRegistryClient::ObserveEpoch(EpochState* state, size_t endpoint, const grpc::ClientContext& context) {
+  const auto& trailers = context.GetServerTrailingMetadata();
+  auto it = trailers.find(kRegistryEpochMetadataKey);
+  if (it == trailers.end()) {
+    return;
+  }
+  const uint64_t epoch = std::strtoull(std::string(it->second.data(), it->second.size()).c_str(), nullptr, 10);
+  
+  bool restarted = false;
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    uint64_t& seen = state->epochs[endpoint];
+    restarted = seen != 0 && seen != epoch;
+    seen = epoch;
+  }
+  if (!restarted) {
+    return;
+  }
+  
+  // An in-flight call can outlive its client; the callback is only run
+  // under the lock its owner takes to clear it
+  std::cout << "Registry endpoint " << endpoint << " restarted" << std::endl;
+  std::lock_guard<std::mutex> lock(state->callback_mutex);
+  if (state->on_restart) {
+    state->on_restart();
+  }
+}
+
+void ClientRegistryClient::SetRestartCallback(std::function<void()> callback) {
+  std::lock_guard<std::mutex> lock(epochs_->callback_mutex);
+  epochs_->on_restart = std::move(callback);
+}
 
 bool ClientRegistryClient::RegisterClient(const std::string& client_id,
                                           const std::string& client_address,
-                                          int32_t client_port) const {
+                                          int32_t client_port,
+                                          const ClientLabels& labels,
+                                          bool* retryable) const {
   helloworld::ClientRegistration request;
   request.set_client_id(client_id);
   request.set_client_address(client_address);
   request.set_client_port(client_port);
+  request.mutable_labels()->insert(labels.begin(), labels.end());
   
   helloworld::RegistrationResponse reply;
   grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() + timeouts_.register_client);
+  Identify(&context);
   
-  grpc::Status status = stub_->RegisterClient(&context, request, &reply);
+  const size_t endpoint = WriteEndpoint();
+  grpc::Status status = stubs_[endpoint]->RegisterClient(&context, request, &reply);
+  ObserveEpoch(epochs_.get(), endpoint, context);
   
   if (status.ok() && reply.success()) {
     std::cout << "Successfully registered with registry: " << reply.message() << std::endl;
     return true;
   } else {
-    std::cout << "Failed to register with registry: " << reply.message() << std::endl;
+    if (retryable != nullptr) {
+      *retryable = status.error_code() == grpc::StatusCode::UNAVAILABLE ||
+                   status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED ||
+                   status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED;
+    }
+    std::cout << "Failed to register with registry: "
+              << (status.ok() ? reply.message() : status.error_message()) << std::endl;
     return false;
   }
 }
@@ -82,9 +648,19 @@ bool ClientRegistryClient::GetClient(const std::string& client_id,
   request.set_client_id(client_id);
   
   helloworld::ClientInfo reply;
-  grpc::ClientContext context;
-  
-  grpc::Status status = stub_->GetClient(&context, request, &reply);
+  grpc::Status status;
+  if (replicas_ && stubs_.size() > 1 && hedge_delay_.count() > 0) {
+    status = HedgedGetClient(request, &reply);
+  } else {
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + timeouts_.get_client);
+    Identify(&context);
+    const size_t endpoint = ReadOrder().front();
+    const auto start = std::chrono::steady_clock::now();
+    status = stubs_[endpoint]->GetClient(&context, request, &reply);
+    RecordLatency(latency_.get(), endpoint, start, status);
+    ObserveEpoch(epochs_.get(), endpoint, context);
+  }
   
   if (status.ok()) {
     address = reply.client_address();
@@ -97,14 +673,108 @@ bool ClientRegistryClient::GetClient(const std::string& client_id,
   }
 }
 
-std::vector<std::tuple<std::string, std::string, int32_t, bool>> ClientRegistryClient::ListClients() const {
+bool ClientRegistryClient::IsRegistered(const std::string& client_id, bool* registered) const {
+  helloworld::ClientLookup request;
+  request.set_client_id(client_id);
+  
+  helloworld::ClientInfo reply;
+  grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() + timeouts_.get_client);
+  Identify(&context);
+  
+  const size_t endpoint = WriteEndpoint();
+  grpc::Status status = stubs_[endpoint]->GetClient(&context, request, &reply);
+  ObserveEpoch(epochs_.get(), endpoint, context);
+  if (!status.ok()) {
+    std::cout << "Failed to check registration: " << status.error_message() << std::endl;
+    return false;
+  }
+  *registered = !reply.client_address().empty();
+  return true;
+}
+
+std::vector<ClientLookupResult> ClientRegistryClient::GetClients(const std::vector<std::string>& client_ids) const {
+  helloworld::ClientLookupBatch request;
+  for (const auto& client_id : client_ids) {
+    request.add_client_ids(client_id);
+  }
+  
+  helloworld::ClientList reply;
+  grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() + timeouts_.get_clients);
+  Identify(&context);
+  
+  const size_t endpoint = ReadOrder().front();
+  const auto start = std::chrono::steady_clock::now();
+  grpc::Status status = stubs_[endpoint]->GetClients(&context, request, &reply);
+  RecordLatency(latency_.get(), endpoint, start, status);
+  ObserveEpoch(epochs_.get(), endpoint, context);
+  
+  std::vector<ClientLookupResult> results(client_ids.size());
+  if (!status.ok() || reply.clients_size() != static_cast<int>(client_ids.size())) {
+    std::cout << "Failed to get client info: " << status.error_message() << std::endl;
+    return results;
+  }
+  
+  for (size_t i = 0; i < results.size(); ++i) {
+    const helloworld::ClientInfo& client = reply.clients(static_cast<int>(i));
+    results[i].ok = true;
+    results[i].address = client.client_address();
+    results[i].port = client.client_port();
+    results[i].online = client.online();
+  }
+  return results;
+}
+
+grpc::Status ClientRegistryClient::FetchClientList(bool compact, helloworld::ClientList* reply) const {
   helloworld::ClientListRequest request;
+  request.set_compact(compact);
+  grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() + timeouts_.list_clients);
+  Identify(&context);
+  
+  const size_t endpoint = ReadOrder().front();
+  const auto start = std::chrono::steady_clock::now();
+  grpc::Status status = stubs_[endpoint]->ListClients(&context, request, reply);
+  RecordLatency(latency_.get(), endpoint, start, status);
+  ObserveEpoch(epochs_.get(), endpoint, context);
+  return status;
+}
+
+std::vector<ClientEntry> ClientRegistryClient::ListClients() const {
+  helloworld::ClientList reply;
+  const grpc::Status status = FetchClientList(compact_lists_, &reply);
+  return ToClientEntries(status, reply);
+}
+
+bool ClientRegistryClient::ForEachClient(const std::function<void(const ListedClient&)>& visit) const {
+  helloworld::ClientList reply;
+  const grpc::Status status = FetchClientList(true, &reply);
+  return VisitClientList(status, reply, visit);
+}
+
+std::vector<ClientEntry> ClientRegistryClient::QueryClients(const LabelSelectors& selectors) const {
+  helloworld::ClientQuery request;
+  for (const auto& [key, values] : selectors) {
+    helloworld::LabelSelector* selector = request.add_selectors();
+    selector->set_key(key);
+    for (const auto& value : values) {
+      selector->add_values(value);
+    }
+  }
+  
   helloworld::ClientList reply;
   grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() + timeouts_.query_clients);
+  Identify(&context);
   
-  grpc::Status status = stub_->ListClients(&context, request, &reply);
+  const size_t endpoint = ReadOrder().front();
+  const auto start = std::chrono::steady_clock::now();
+  grpc::Status status = stubs_[endpoint]->QueryClients(&context, request, &reply);
+  RecordLatency(latency_.get(), endpoint, start, status);
+  ObserveEpoch(epochs_.get(), endpoint, context);
   
-  std::vector<std::tuple<std::string, std::string, int32_t, bool>> clients;
+  std::vector<ClientEntry> clients;
   
   if (status.ok()) {
     for (const auto& client : reply.clients()) {
@@ -112,7 +782,7 @@ std::vector<std::tuple<std::string, std::string, int32_t, bool>> ClientRegistryC
                           client.client_port(), client.online());
     }
   } else {
-    std::cout << "Failed to list clients: " << status.error_message() << std::endl;
+    std::cout << "Failed to query clients: " << status.error_message() << std::endl;
   }
   
   return clients;
@@ -124,8 +794,12 @@ bool ClientRegistryClient::UnregisterClient(const std::string& client_id) const
   
   helloworld::UnregistrationResponse reply;
   grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() + timeouts_.unregister_client);
+  Identify(&context);
   
-  grpc::Status status = stub_->UnregisterClient(&context, request, &reply);
+  const size_t endpoint = WriteEndpoint();
+  grpc::Status status = stubs_[endpoint]->UnregisterClient(&context, request, &reply);
+  ObserveEpoch(epochs_.get(), endpoint, context);
   
   if (status.ok() && reply.success()) {
     std::cout << "Successfully unregistered: " << reply.message() << std::endl;
@@ -136,132 +810,1452 @@ bool ClientRegistryClient::UnregisterClient(const std::string& client_id) const
   }
 }
 
-// Client communication client implementation
-ClientCommunicationClient::ClientCommunicationClient(std::shared_ptr<grpc::Channel> channel)
-    : stub_(helloworld::ClientCommunication::NewStub(channel)) {}
-
-bool ClientCommunicationClient::SendMessage(const std::string& from_client_id,
-                                            const std::string& to_client_id,
-                                            const std::string& message_content) const {
-  helloworld::ClientMessage request;
+int32_t ClientRegistryClient::Publish(const std::string& from_client_id,
+                                      const std::string& topic,
+                                      const std::string& message_content) const {
+  helloworld::TopicMessage request;
+  request.set_topic(topic);
   request.set_from_client_id(from_client_id);
-  request.set_to_client_id(to_client_id);
   request.set_message_content(message_content);
+  request.set_timestamp(CurrentTimestamp());
   
-  // Set timestamp
-  auto now = std::chrono::system_clock::now();
-  auto time_t = std::chrono::system_clock::to_time_t(now);
-  request.set_timestamp(std::to_string(time_t));
-  
-  helloworld::MessageResponse reply;
+  helloworld::PublishResponse reply;
   grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() + timeouts_.publish);
+  Identify(&context);
   
-  grpc::Status status = stub_->SendMessage(&context, request, &reply);
+  const size_t endpoint = WriteEndpoint();
+  grpc::Status status = stubs_[endpoint]->Publish(&context, request, &reply);
+  ObserveEpoch(epochs_.get(), endpoint, context);
   
   if (status.ok() && reply.success()) {
-    std::cout << "Message sent successfully: " << reply.message() << std::endl;
-    return true;
+    return reply.subscriber_count();
   } else {
-    std::cout << "Failed to send message: " << reply.message() << std::endl;
-    return false;
+    std::cout << "Failed to publish to topic " << topic << ": " << status.error_message() << std::endl;
+    return -1;
   }
 }
 
-// Main client implementation
-Client::Client(const std::string& registry_server_address,
-               const std::string& client_id,
-               const std::string& client_address,
-               int32_t client_port)
-    : client_id_(client_id), client_address_(client_address), client_port_(client_port), running_(false) {
-  
-  // Create registry client
-  auto registry_channel = grpc::CreateChannel(registry_server_address, grpc::InsecureChannelCredentials());
-  registry_client_ = std::make_unique<ClientRegistryClient>(registry_channel);
+std::unique_ptr<grpc::ClientReader<helloworld::TopicMessage>> ClientRegistryClient::Subscribe(
+    grpc::ClientContext* context,
+    const std::string& client_id,
+    const std::string& topic) const {
+  helloworld::SubscribeRequest request;
+  request.set_client_id(client_id);
+  request.set_topic(topic);
   
-  // Create communication service
-  communication_service_ = std::make_unique<ClientCommunicationServiceImpl>();
+  Identify(context);
+  return stubs_[WriteEndpoint()]->Subscribe(context, request);
 }
 
-bool Client::Start() {
-  std::lock_guard<std::mutex> lock(running_mutex_);
-  
-  if (running_) {
-    std::cout << "Client is already running" << std::endl;
+void ClientRegistryClient::WarmUp() const {
+  for (const auto& channel : channels_) {
+    channel->GetState(true);
+  }
+}
+
+void ClientRegistryClient::SetCallerId(const std::string& client_id) {
+  caller_id_ = client_id;
+}
+
+void ClientRegistryClient::Identify(grpc::ClientContext* context) const {
+  if (!caller_id_.empty()) {
+    context->AddMetadata(kClientIdMetadataKey, caller_id_);
+  }
+}
+
+void ClientRegistryClient::SetCallTimeout(std::chrono::milliseconds timeout) {
+  timeouts_ = RegistryCallTimeouts{timeout, timeout, timeout, timeout, timeout, timeout, timeout};
+}
+
+void ClientRegistryClient::SetCallTimeouts(const RegistryCallTimeouts& timeouts) {
+  timeouts_ = timeouts;
+}
+
+void ClientRegistryClient::EnableHedgedLookups(std::chrono::milliseconds delay) {
+  hedge_delay_ = delay;
+}
+
+void ClientRegistryClient::UseCompactClientLists(bool enabled) {
+  compact_lists_ = enabled;
+}
+
+std::future<bool> ClientRegistryClient::RegisterClientAsync(const std::string& client_id,
+                                                            const std::string& client_address,
+                                                            int32_t client_port,
+                                                            const ClientLabels& labels) const {
+  return MakeFuture<bool>([&](std::function<void(bool)> done) {
+    RegisterClientAsync(client_id, client_address, client_port, std::move(done), labels);
+  });
+}
+
+void ClientRegistryClient::RegisterClientAsync(const std::string& client_id,
+                                               const std::string& client_address,
+                                               int32_t client_port,
+                                               std::function<void(bool)> callback,
+                                               const ClientLabels& labels) const {
+  auto* call = new AsyncCall<helloworld::ClientRegistration, helloworld::RegistrationResponse>(timeouts_.register_client);
+  Identify(&call->context);
+  call->request.set_client_id(client_id);
+  call->request.set_client_address(client_address);
+  call->request.set_client_port(client_port);
+  call->request.mutable_labels()->insert(labels.begin(), labels.end());
+  
+  const size_t endpoint = WriteEndpoint();
+  stubs_[endpoint]->async()->RegisterClient(&call->context, &call->request, &call->reply,
+                                 [call, callback = std::move(callback), epochs = epochs_, endpoint](grpc::Status status) {
+    ObserveEpoch(epochs.get(), endpoint, call->context);
+    const bool success = status.ok() && call->reply.success();
+    if (!success) {
+      std::cout << "Failed to register with registry: "
+                << (status.ok() ? call->reply.message() : status.error_message()) << std::endl;
+    }
+    callback(success);
+    delete call;
+  });
+}
+
+std::future<ClientLookupResult> ClientRegistryClient::GetClientAsync(const std::string& client_id) const {
+  return MakeFuture<ClientLookupResult>([&](std::function<void(ClientLookupResult)> done) {
+    GetClientAsync(client_id, [done](const ClientLookupResult& result) { done(result); });
+  });
+}
+
+void ClientRegistryClient::GetClientAsync(const std::string& client_id,
+                                          std::function<void(const ClientLookupResult&)> callback) const {
+  auto* call = new AsyncCall<helloworld::ClientLookup, helloworld::ClientInfo>(timeouts_.get_client);
+  Identify(&call->context);
+  call->request.set_client_id(client_id);
+  
+  const size_t endpoint = ReadOrder().front();
+  const auto start = std::chrono::steady_clock::now();
+  stubs_[endpoint]->async()->GetClient(&call->context, &call->request, &call->reply,
+                                       [call, callback = std::move(callback), latency = latency_, epochs = epochs_, endpoint, start](grpc::Status status) {
+    RecordLatency(latency.get(), endpoint, start, status);
+    ObserveEpoch(epochs.get(), endpoint, call->context);
+    ClientLookupResult result;
+    result.ok = status.ok();
+    if (status.ok()) {
+      result.address = call->reply.client_address();
+      result.port = call->reply.client_port();
+      result.online = call->reply.online();
+    } else {
+      std::cout << "Failed to get client info: " << status.error_message() << std::endl;
+    }
+    callback(result);
+    delete call;
+  });
+}
+
+std::future<std::vector<ClientEntry>> ClientRegistryClient::ListClientsAsync() const {
+  return MakeFuture<std::vector<ClientEntry>>([&](std::function<void(std::vector<ClientEntry>)> done) {
+    ListClientsAsync(std::move(done));
+  });
+}
+
+void ClientRegistryClient::ListClientsAsync(std::function<void(std::vector<ClientEntry>)> callback) const {
+  auto* call = new AsyncCall<helloworld::ClientListRequest, helloworld::ClientList>(timeouts_.list_clients);
+  Identify(&call->context);
+  call->request.set_compact(compact_lists_);
+  
+  const size_t endpoint = ReadOrder().front();
+  const auto start = std::chrono::steady_clock::now();
+  stubs_[endpoint]->async()->ListClients(&call->context, &call->request, &call->reply,
+                                         [call, callback = std::move(callback), latency = latency_, epochs = epochs_, endpoint, start](grpc::Status status) {
+    RecordLatency(latency.get(), endpoint, start, status);
+    ObserveEpoch(epochs.get(), endpoint, call->context);
+    callback(ToClientEntries(status, call->reply));
+    delete call;
+  });
+}
+
+std::future<bool> ClientRegistryClient::UnregisterClientAsync(const std::string& client_id) const {
+  return MakeFuture<bool>([&](std::function<void(bool)> done) {
+    UnregisterClientAsync(client_id, std::move(done));
+  });
+}
+
+void ClientRegistryClient::UnregisterClientAsync(const std::string& client_id,
+                                                 std::function<void(bool)> callback) const {
+  auto* call = new AsyncCall<helloworld::ClientUnregistration, helloworld::UnregistrationResponse>(timeouts_.unregister_client);
+  Identify(&call->context);
+  call->request.set_client_id(client_id);
+  
+  const size_t endpoint = WriteEndpoint();
+  stubs_[endpoint]->async()->UnregisterClient(&call->context, &call->request, &call->reply,
+                                 [call, callback = std::move(callback), epochs = epochs_, endpoint](grpc::Status status) {
+    ObserveEpoch(epochs.get(), endpoint, call->context);
+    const bool success = status.ok() && call->reply.success();
+    if (!success) {
+      std::cout << "Failed to unregister: "
+                << (status.ok() ? call->reply.message() : status.error_message()) << std::endl;
+    }
+    callback(success);
+    delete call;
+  });
+}
+
+grpc::Status ClientRegistryClient::HedgedGetClient(const helloworld::ClientLookup& request,
+                                                   helloworld::ClientInfo* reply) const {
+  auto lookup = std::make_shared<HedgedLookup>();
+  lookup->request = request;
+  const auto deadline = std::chrono::system_clock::now() + timeouts_.get_client;
+  
+  const std::vector<size_t> order = ReadOrder();
+  std::unique_lock<std::mutex> lock(lookup->mutex);
+  for (size_t i = 0; i < order.size() && !lookup->done; ++i) {
+    lookup->attempts.push_back(std::make_unique<HedgedLookup::Attempt>());
+    HedgedLookup::Attempt* attempt = lookup->attempts.back().get();
+    attempt->context.set_deadline(deadline);
+    Identify(&attempt->context);
+    
+    // Start the attempt unlocked in case its callback runs inline
+    lock.unlock();
+    const size_t endpoint = order[i];
+    const auto start = std::chrono::steady_clock::now();
+    stubs_[endpoint]->async()->GetClient(&attempt->context, &lookup->request, &attempt->reply,
+                                         [lookup, attempt, latency = latency_, epochs = epochs_, endpoint, start](grpc::Status status) {
+      RecordLatency(latency.get(), endpoint, start, status);
+      ObserveEpoch(epochs.get(), endpoint, attempt->context);
+      std::lock_guard<std::mutex> lock(lookup->mutex);
+      if (lookup->done) {
+        return;
+      }
+      if (status.ok()) {
+        lookup->done = true;
+        lookup->reply = attempt->reply;
+      } else {
+        ++lookup->failed;
+      }
+      lookup->status = status;
+      lookup->cv.notify_all();
+    });
+    lock.lock();
+    
+    // Hedge after the delay, or at once if every attempt so far has failed
+    const size_t launched = i + 1;
+    auto settled = [&lookup, launched] { return lookup->done || lookup->failed == launched; };
+    if (launched < order.size()) {
+      lookup->cv.wait_for(lock, hedge_delay_, settled);
+    } else {
+      lookup->cv.wait_until(lock, deadline, settled);
+    }
+  }
+  
+  const bool done = lookup->done;
+  const grpc::Status status = lookup->status;
+  if (done) {
+    *reply = lookup->reply;
+  }
+  lock.unlock();
+  
+  // The losers are no longer needed
+  for (const auto& attempt : lookup->attempts) {
+    attempt->context.TryCancel();
+  }
+  return done ? grpc::Status::OK : status;
+}
+
+// Client communication client implementation
+ClientCommunicationClient::ClientCommunicationClient(std::shared_ptr<grpc::Channel> channel)
+    : channel_(channel), stub_(helloworld::ClientCommunication::NewStub(channel)) {}
+
+bool ClientCommunicationClient::SendMessage(const std::string& from_client_id,
+                                            const std::string& to_client_id,
+                                            const std::string& message_content) const {
+  helloworld::ClientMessage request;
+  request.set_from_client_id(from_client_id);
+  request.set_to_client_id(to_client_id);
+  request.set_message_content(message_content);
+  
+  // Set timestamp
+  request.set_timestamp(CurrentTimestamp());
+  
+  helloworld::MessageResponse reply;
+  grpc::Status status = Send(request, &reply);
+  
+  if (status.ok() && reply.success()) {
+    std::cout << "Message sent successfully: " << reply.message() << std::endl;
+    return true;
+  } else {
+    std::cout << "Failed to send message: " << reply.message() << std::endl;
     return false;
   }
+}
+
+grpc::Status ClientCommunicationClient::Send(const helloworld::ClientMessage& message,
+                                             helloworld::MessageResponse* reply,
+                                             std::chrono::system_clock::time_point deadline,
+                                             std::chrono::milliseconds* retry_after,
+                                             const TraceContext& trace) const {
+  grpc::ClientContext context;
+  if (deadline != std::chrono::system_clock::time_point::max()) {
+    context.set_deadline(deadline);
+  }
+  Tracer::Inject(trace, &context);
+  grpc::Status status = stub_->SendMessage(&context, message, reply);
   
-  // Register with registry
-  if (!registry_client_->RegisterClient(client_id_, client_address_, client_port_)) {
-    std::cout << "Failed to register with registry" << std::endl;
+  if (retry_after != nullptr && status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED) {
+    *retry_after = RetryAfterHint(context);
+  }
+  return status;
+}
+
+grpc::Status ClientCommunicationClient::SendEncoded(const MessageCodec& codec,
+                                                    const helloworld::ClientMessage& message,
+                                                    helloworld::MessageResponse* reply,
+                                                    std::chrono::system_clock::time_point deadline,
+                                                    std::chrono::milliseconds* retry_after,
+                                                    const TraceContext& trace) const {
+  grpc::ClientContext context;
+  if (deadline != std::chrono::system_clock::time_point::max()) {
+    context.set_deadline(deadline);
+  }
+  Tracer::Inject(trace, &context);
+  
+  std::call_once(generic_stub_once_, [this] { generic_stub_ = std::make_unique<grpc::GenericStub>(channel_); });
+  grpc::ByteBuffer request = codec.Encode(message);
+  grpc::ByteBuffer response;
+  std::promise<grpc::Status> done;
+  generic_stub_->UnaryCall(&context, codec.method(), grpc::StubOptions(), &request, &response,
+                           [&done](grpc::Status status) { done.set_value(std::move(status)); });
+  grpc::Status status = done.get_future().get();
+  if (status.ok()) {
+    status = grpc::SerializationTraits<helloworld::MessageResponse>::Deserialize(&response, reply);
+  }
+  
+  if (retry_after != nullptr && status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED) {
+    *retry_after = RetryAfterHint(context);
+  }
+  return status;
+}
+
+grpc::Status ClientCommunicationClient::TransferBlob(const std::string& transfer_id,
+                                                     const std::string& from_client_id,
+                                                     const char* data,
+                                                     size_t size,
+                                                     size_t chunk_size) const {
+  chunk_size = std::max<size_t>(chunk_size, 1);
+  if (!ValidTransferId(transfer_id) || size > kMaxBlobSize) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Invalid transfer id or blob too large");
+  }
+  grpc::Status status(grpc::StatusCode::UNAVAILABLE, "Transfer did not start");
+  
+  for (int attempt = 0; attempt < kMaxBlobTransferAttempts; ++attempt) {
+    if (attempt > 0) {
+      std::this_thread::sleep_for(kBlobResumeBackoff * attempt);
+    }
+    
+    // Start where the receiver's verified data ends
+    helloworld::BlobOffsetRequest offset_request;
+    offset_request.set_transfer_id(transfer_id);
+    helloworld::BlobTransferResponse progress;
+    grpc::ClientContext offset_context;
+    offset_context.set_deadline(std::chrono::system_clock::now() + kBlobOffsetTimeout);
+    status = stub_->GetBlobOffset(&offset_context, offset_request, &progress);
+    if (status.error_code() == grpc::StatusCode::INVALID_ARGUMENT) {
+      return status;
+    }
+    if (!status.ok()) {
+      continue;
+    }
+    if (progress.complete()) {
+      return grpc::Status::OK;
+    }
+    uint64_t offset = std::min<uint64_t>(progress.committed_offset(), size);
+    
+    // One chunk is serialized at a time, so memory use does not grow with
+    // the blob; a file's pages are only read as their chunk goes out
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + kBlobStreamTimeout +
+                         std::chrono::milliseconds((size - offset) * 1000 / kMinBlobBytesPerSecond));
+    helloworld::BlobTransferResponse reply;
+    std::unique_ptr<grpc::ClientWriter<helloworld::BlobChunk>> writer = stub_->TransferBlob(&context, &reply);
+    helloworld::BlobChunk chunk;
+    chunk.set_transfer_id(transfer_id);
+    chunk.set_from_client_id(from_client_id);
+    chunk.set_total_size(size);
+    do {
+      const size_t length = std::min<size_t>(chunk_size, size - offset);
+      chunk.set_offset(offset);
+      chunk.set_data(data + offset, length);
+      chunk.set_crc32c(Crc32c(data + offset, length));
+      if (!writer->Write(chunk)) {
+        break;
+      }
+      offset += length;
+      // Later chunks only need the id, offset and data
+      chunk.clear_from_client_id();
+      chunk.clear_total_size();
+    } while (offset < size);
+    writer->WritesDone();
+    status = writer->Finish();
+    
+    if (status.ok() && reply.complete()) {
+      return status;
+    }
+    if (status.error_code() == grpc::StatusCode::INVALID_ARGUMENT) {
+      return status;
+    }
+    std::cout << "Blob transfer " << transfer_id << " interrupted at offset " << reply.committed_offset()
+              << (status.ok() ? "" : ": " + status.error_message()) << std::endl;
+  }
+  
+  return status.ok() ? grpc::Status(grpc::StatusCode::ABORTED, "Blob transfer did not complete") : status;
+}
+
+grpc::Status ClientCommunicationClient::TransferFile(const std::string& transfer_id,
+                                                     const std::string& from_client_id,
+                                                     const std::string& file_path,
+                                                     size_t chunk_size) const {
+  MappedFile file(file_path);
+  if (!file.ok()) {
+    return grpc::Status(grpc::StatusCode::NOT_FOUND, "Cannot map " + file_path);
+  }
+  return TransferBlob(transfer_id, from_client_id, file.data(), file.size(), chunk_size);
+}
+
+ClientCommunicationClient::~ClientCommunicationClient() {
+  {
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    stopping_ = true;
+  }
+  batch_cv_.notify_all();
+  if (flush_thread_.joinable()) {
+    flush_thread_.join();
+  }
+}
+
+void ClientCommunicationClient::EnableBatching(const BatchingOptions& options) {
+  std::lock_guard<std::mutex> lock(batch_mutex_);
+  batching_options_ = options;
+  if (!flush_thread_.joinable()) {
+    flush_thread_ = std::thread([this]() { FlushLoop(); });
+  }
+}
+
+std::future<BatchedSendResult> ClientCommunicationClient::SendBatched(helloworld::ClientMessage message) {
+  std::unique_lock<std::mutex> lock(batch_mutex_);
+  
+  if (!flush_thread_.joinable() || stopping_) {
+    const auto deadline = SendDeadline();
+    lock.unlock();
+    std::promise<BatchedSendResult> result;
+    BatchedSendResult sent;
+    sent.status = Send(message, &sent.reply, deadline, &sent.retry_after);
+    result.set_value(std::move(sent));
+    return result.get_future();
+  }
+  
+  if (batch_.empty()) {
+    batch_started_ = std::chrono::steady_clock::now();
+  }
+  batch_bytes_ += message.ByteSizeLong();
+  batch_.push_back(QueuedMessage{std::move(message), {}});
+  std::future<BatchedSendResult> result = batch_.back().result.get_future();
+  
+  if (batch_bytes_ >= batching_options_.max_batch_bytes || batch_.size() == 1) {
+    batch_cv_.notify_all();
+  }
+  return result;
+}
+
+void ClientCommunicationClient::FlushLoop() {
+  std::unique_lock<std::mutex> lock(batch_mutex_);
+  
+  while (true) {
+    batch_cv_.wait(lock, [this] { return stopping_ || !batch_.empty(); });
+    if (batch_.empty()) {
+      return;
+    }
+    
+    // Hold the batch until its linger ends or it is full; on shutdown,
+    // send what is queued right away
+    batch_cv_.wait_until(lock, batch_started_ + batching_options_.linger, [this] {
+      return stopping_ || batch_bytes_ >= batching_options_.max_batch_bytes;
+    });
+    
+    std::vector<QueuedMessage> batch;
+    batch.swap(batch_);
+    batch_bytes_ = 0;
+    
+    lock.unlock();
+    FlushBatch(&batch);
+    lock.lock();
+  }
+}
+
+void ClientCommunicationClient::FlushBatch(std::vector<QueuedMessage>* batch) {
+  helloworld::ClientMessageBatch request;
+  request.mutable_messages()->Reserve(static_cast<int>(batch->size()));
+  for (QueuedMessage& queued : *batch) {
+    *request.add_messages() = std::move(queued.message);
+  }
+  
+  grpc::ClientContext context;
+  {
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    context.set_deadline(SendDeadline());
+  }
+  helloworld::MessageBatchResponse reply;
+  grpc::Status status = stub_->SendMessageBatch(&context, request, &reply);
+  if (status.ok() && reply.responses_size() != request.messages_size()) {
+    status = grpc::Status(grpc::StatusCode::INTERNAL, "Batch response does not match the request");
+  }
+  
+  for (size_t i = 0; i < batch->size(); ++i) {
+    BatchedSendResult result;
+    if (!status.ok()) {
+      result.status = status;
+    } else {
+      result.reply = std::move(*reply.mutable_responses(static_cast<int>(i)));
+      if (!result.reply.success()) {
+        result.status = grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, result.reply.message());
+        result.retry_after = std::chrono::milliseconds(reply.retry_after_ms());
+      }
+    }
+    (*batch)[i].result.set_value(std::move(result));
+  }
+}
+
+std::chrono::system_clock::time_point ClientCommunicationClient::SendDeadline() const {
+  const std::chrono::milliseconds timeout =
+      batching_options_.timeout.count() > 0 ? batching_options_.timeout : kDirectSendTimeout;
+  return std::chrono::system_clock::now() + timeout;
+}
+
+// Main client implementation
+Client::Client(const std::string& registry_server_address,
+               const std::string& client_id,
+               const std::string& client_address,
+               int32_t client_port,
+               const TlsOptions& tls)
+    : Client(std::vector<std::string>{registry_server_address}, client_id, client_address, client_port, tls) {}
+
+Client::Client(const std::vector<std::string>& registry_server_addresses,
+               const std::string& client_id,
+               const std::string& client_address,
+               int32_t client_port,
+               const TlsOptions& tls)
+    : client_id_(client_id), client_address_(client_address), requested_port_(client_port),
+      client_port_(client_port), tls_(tls), channels_(tls),
+      sender_epoch_(NewSenderEpoch()),
+      registration_([this] {
+        bool registered = true;
+        return registry_client_->IsRegistered(client_id_, &registered) && !registered;
+      }, [this] {
+        std::cout << "Registering again with the registry" << std::endl;
+        RegisterWithBackoff(kReregistrationAttempts);
+      }),
+      running_(false) {
+  
+  // Create registry client
+  std::vector<std::shared_ptr<grpc::Channel>> registry_channels;
+  for (const auto& registry_server_address : registry_server_addresses) {
+    registry_channels.push_back(CreateRegistryChannel(registry_server_address, channels_));
+  }
+  registry_client_ = std::make_unique<ClientRegistryClient>(registry_channels);
+  registry_client_->SetCallerId(client_id_);
+  
+  // A restarted registry has lost this client; register again, lazily
+  registry_client_->SetRestartCallback([this] { registration_.RequestReregistration(); });
+  
+  // Create communication service
+  communication_service_ = std::make_unique<ClientCommunicationServiceImpl>();
+  encoded_service_ = std::make_unique<EncodedMessageService>(communication_service_.get());
+}
+
+Client::~Client() {
+  // In-flight registry calls keep the epoch state, and its callback, alive
+  registry_client_->SetRestartCallback(nullptr);
+  StopSendWorkers();
+}
+
+void Client::EnableRelay(const std::string& relay_address) {
+  relay_address_ = relay_address;
+}
+
+void Client::SetLabels(const ClientLabels& labels) {
+  labels_ = labels;
+}
+
+void Client::SetRegistryCallTimeouts(const RegistryCallTimeouts& timeouts) {
+  registry_client_->SetCallTimeouts(timeouts);
+}
+
+std::vector<MailboxLaneStats> Client::GetMailboxStats() {
+  return communication_service_->LaneStats();
+}
+
+void Client::SetMailboxCapacity(size_t capacity) {
+  communication_service_->SetCapacity(capacity);
+}
+
+void Client::SetBackpressureMode(BackpressureMode mode) {
+  backpressure_mode_ = mode;
+}
+
+void Client::SetSendLogging(bool enabled) {
+  log_sends_ = enabled;
+}
+
+bool Client::EnableTracing(const std::string& trace_file, double sample_rate) {
+  auto tracer = std::make_shared<Tracer>(trace_file, sample_rate, client_id_);
+  if (!tracer->ok()) {
+    return false;
+  }
+  tracer_ = tracer;
+  communication_service_->SetTracer(tracer);
+  return true;
+}
+
+void Client::SetBlobDirectory(const std::string& directory) {
+  communication_service_->blobs().SetDirectory(directory);
+}
+
+bool Client::SendFileToClient(const std::string& target_client_id, const std::string& file_path) {
+  std::string target_address;
+  int32_t target_port;
+  bool target_online;
+  
+  if (!registry_client_->GetClient(target_client_id, target_address, target_port, target_online)) {
+    std::cout << "Failed to get target client info" << std::endl;
     return false;
   }
   
-  // Start communication server
-  const std::string full_address = client_address_ + ":" + std::to_string(client_port_);
+  if (!target_online) {
+    std::cout << "Target client is not online" << std::endl;
+    return false;
+  }
   
+  MappedFile file(file_path);
+  if (!file.ok()) {
+    std::cout << "Cannot read " << file_path << std::endl;
+    return false;
+  }
+  if (file.size() > kMaxBlobSize) {
+    std::cout << file_path << " is larger than the " << kMaxBlobSize << "-byte limit" << std::endl;
+    return false;
+  }
+  
+  // The same file sent again gets the same id, so it resumes rather than restarts
+  std::error_code error;
+  const std::filesystem::path absolute_path = std::filesystem::absolute(file_path, error);
+  const std::string transfer_id =
+      BlobTransferId(error ? file_path : absolute_path.string(), file.size(), file.modified_ns());
+  std::string target_full_address = target_address + ":" + std::to_string(target_port);
+  ClientCommunicationClient target_client(peer_channels_.Get(target_full_address));
+  grpc::Status status = target_client.TransferBlob(transfer_id, client_id_, file.data(), file.size());
+  
+  if (status.ok()) {
+    std::cout << "Sent " << file_path << " (" << file.size() << " bytes) to " << target_client_id << " as "
+              << transfer_id << std::endl;
+    return true;
+  }
+  std::cout << "Failed to send file: " << status.error_message() << std::endl;
+  return false;
+}
+
+void Client::SetMessageCodec(std::shared_ptr<const MessageCodec> codec) {
+  codec_ = std::move(codec);
+}
+
+void Client::EnableMessageBatching(const BatchingOptions& options) {
+  std::lock_guard<std::mutex> lock(batching_mutex_);
+  batching_enabled_ = true;
+  batching_options_ = options;
+}
+
+std::shared_ptr<ClientCommunicationClient> Client::BatchingClient(const std::string& target_full_address) {
+  std::lock_guard<std::mutex> lock(batching_mutex_);
+  if (!batching_enabled_) {
+    return nullptr;
+  }
+  
+  std::shared_ptr<ClientCommunicationClient>& client = batching_clients_[target_full_address];
+  if (!client) {
+    client = std::make_shared<ClientCommunicationClient>(peer_channels_.Get(target_full_address));
+    BatchingOptions options = batching_options_;
+    // With a relay available, bound each batch so its messages can fall back
+    if (relay_client_ && (options.timeout.count() == 0 || options.timeout > kDirectSendTimeoutWithRelay)) {
+      options.timeout = kDirectSendTimeoutWithRelay;
+    }
+    client->EnableBatching(options);
+  }
+  return client;
+}
+
+void Client::SetRegistryReplicas(bool replicas) {
+  registry_client_->SetReplicas(replicas);
+}
+
+void Client::SetRegistryBalancing(RegistryBalancing balancing) {
+  registry_client_->SetBalancing(balancing);
+}
+
+void Client::EnableHedgedRegistryLookups(std::chrono::milliseconds delay) {
+  registry_client_->EnableHedgedLookups(delay);
+}
+
+void Client::UseCompactClientLists(bool enabled) {
+  registry_client_->UseCompactClientLists(enabled);
+}
+
+bool Client::Start() {
+  // Before taking running_mutex_, which a worker still in Stop() waits for
+  ResumeSendWorkers();
+  
+  std::lock_guard<std::mutex> lock(running_mutex_);
+  
+  if (running_) {
+    std::cout << "Client is already running" << std::endl;
+    return false;
+  }
+  
+  const auto start = std::chrono::steady_clock::now();
+  
+  // The registry handshake proceeds while the server binds
+  registry_client_->WarmUp();
+  
+  // Peers dial this server with the same TLS settings it serves with
+  std::shared_ptr<grpc::ServerCredentials> credentials = MakeServerCredentials(tls_);
+  if (!credentials || !channels_.ok()) {
+    std::cout << "Failed to load TLS credentials" << std::endl;
+    return false;
+  }
+  
+  // Bind first, so the port registered is the one actually bound (port 0
+  // picks a free one)
+  const std::string listen_address = client_address_ + ":" + std::to_string(requested_port_);
+  int bound_port = 0;
   grpc::ServerBuilder builder;
-  builder.AddListeningPort(full_address, grpc::InsecureServerCredentials());
+  builder.AddListeningPort(listen_address, credentials, &bound_port);
   builder.RegisterService(communication_service_.get());
+  builder.RegisterCallbackGenericService(encoded_service_.get());
   
   communication_server_ = builder.BuildAndStart();
   
-  if (!communication_server_) {
+  if (!communication_server_ || bound_port == 0) {
     std::cout << "Failed to start communication server" << std::endl;
+    communication_server_.reset();
     return false;
   }
+  client_port_ = bound_port;
   
-  std::cout << "Client communication server listening on " << full_address << std::endl;
+  std::cout << "Client communication server listening on " << client_address_ << ":" << client_port_
+            << std::endl;
   
   // Start server in a separate thread
   server_thread_ = std::thread([this]() {
     communication_server_->Wait();
   });
   
+  // Keep a stream open to the relay so unreachable peers can still be
+  // messaged. Its channel connects while the client registers; the relay
+  // only takes the stream's hello from a registered client.
+  std::future<bool> relay_ready;
+  if (!relay_address_.empty()) {
+    auto relay_channel = channels_.Create(relay_address_);
+    relay_client_ = std::make_unique<RelayClient>(
+        relay_channel, client_id_,
+        [this](const helloworld::ClientMessage& message) {
+          // The relay has already acked, so a full mailbox drops the message
+          if (communication_service_->DeliverMessage(message) == DeliveryResult::kMailboxFull) {
+            std::cout << "Mailbox full, dropped relayed message from " << message.from_client_id()
+                      << std::endl;
+          }
+        });
+    relay_ready = std::async(std::launch::async, [relay_channel] {
+      return relay_channel->WaitForConnected(std::chrono::system_clock::now() + kRelayConnectTimeout);
+    });
+  }
+  
+  // Register with registry, riding out a registry that is still starting
+  const bool registered = RegisterWithBackoff(kStartRegistrationAttempts);
+  
+  if (relay_ready.valid() && registered &&
+      !(relay_ready.get() && relay_client_->Connect(kRelayConnectTimeout))) {
+    std::cout << "Relay unavailable, sending direct only" << std::endl;
+    relay_client_.reset();
+  }
+  
+  if (!registered) {
+    std::cout << "Failed to register with registry" << std::endl;
+    if (relay_client_) {
+      relay_client_->Close();
+      relay_client_.reset();
+    }
+    communication_server_->Shutdown();
+    server_thread_.join();
+    communication_server_.reset();
+    return false;
+  }
+  
+  startup_time_ = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+  
+  registration_.Start();
+  
   running_ = true;
-  std::cout << "Client started successfully" << std::endl;
+  std::cout << "Client started successfully in " << startup_time_.count() / 1000.0 << " ms" << std::endl;
   
   return true;
 }
 
-bool Client::SendMessageToClient(const std::string& target_client_id, const std::string& message) {
+bool Client::RegisterWithBackoff(int attempts) {
+  std::chrono::milliseconds backoff = kRegistrationInitialBackoff;
+  for (int attempt = 1;; ++attempt) {
+    bool retryable = false;
+    if (registry_client_->RegisterClient(client_id_, client_address_, client_port_, labels_, &retryable)) {
+      return true;
+    }
+    if (!retryable || attempt >= attempts) {
+      return false;
+    }
+    
+    if (registration_.WaitUnlessStopping(RandomDelay(backoff))) {
+      return false;
+    }
+    backoff = std::min(backoff * 2, kRegistrationMaxBackoff);
+  }
+}
+
+bool Client::SendMessageToClient(const std::string& target_client_id,
+                                 const std::string& message,
+                                 helloworld::MessagePriority priority) {
+  return SendMessagesToClient(target_client_id, {OutgoingMessage{message, priority}}).front();
+}
+
+std::vector<bool> Client::SendMessagesToClient(const std::string& target_client_id,
+                                               const std::vector<OutgoingMessage>& messages) {
+  std::vector<bool> delivered(messages.size(), false);
+  const bool log = log_sends_;
+  Span send_span(tracer_.get(), "SendMessageToClient", tracer_ ? tracer_->StartTrace() : TraceContext());
+  send_span.SetAttribute("target", target_client_id);
+  if (messages.size() > 1) {
+    send_span.SetAttribute("messages", std::to_string(messages.size()));
+  }
+  
   // Get target client info from registry
   std::string target_address;
   int32_t target_port;
   bool target_online;
   
-  if (!registry_client_->GetClient(target_client_id, target_address, target_port, target_online)) {
-    std::cout << "Failed to get target client info" << std::endl;
-    return false;
+  Span lookup_span(tracer_.get(), "registry.GetClient", send_span.context());
+  const bool found = registry_client_->GetClient(target_client_id, target_address, target_port, target_online);
+  lookup_span.End();
+  if (!found) {
+    if (log) {
+      std::cout << "Failed to get target client info" << std::endl;
+    }
+    return delivered;
   }
   
   if (!target_online) {
-    std::cout << "Target client is not online" << std::endl;
-    return false;
+    if (log) {
+      std::cout << "Target client is not online" << std::endl;
+    }
+    return delivered;
   }
   
-  // Create connection to target client
+  // Reuse the channel to the target, or its batching client. A new channel
+  // connects lazily, so dialing shows up in the first peer send.
   std::string target_full_address = target_address + ":" + std::to_string(target_port);
-  auto target_channel = grpc::CreateChannel(target_full_address, grpc::InsecureChannelCredentials());
-  auto target_client = std::make_unique<ClientCommunicationClient>(target_channel);
+  Span channel_span(tracer_.get(), "channel.Create", send_span.context());
+  std::shared_ptr<ClientCommunicationClient> target_client = BatchingClient(target_full_address);
+  const bool batched = target_client != nullptr;
+  if (!batched) {
+    target_client = std::make_shared<ClientCommunicationClient>(peer_channels_.Get(target_full_address));
+  }
+  channel_span.SetAttribute("address", target_full_address);
+  channel_span.SetAttribute("batched", batched ? "true" : "false");
+  channel_span.End();
+  
+  // The direct attempts and any relay fallback carry the same message id, so
+  // a send that timed out after arriving is not delivered twice
+  struct Attempt {
+    helloworld::ClientMessage request;
+    helloworld::MessageResponse reply;
+    grpc::Status status;
+    bool no_credit = false;
+    std::future<BatchedSendResult> batch_result;
+    std::unique_ptr<Span> span;
+  };
+  std::vector<Attempt> attempts(messages.size());
+  std::vector<size_t> pending;
+  for (size_t i = 0; i < messages.size(); ++i) {
+    helloworld::ClientMessage& request = attempts[i].request;
+    request.set_from_client_id(client_id_);
+    request.set_to_client_id(target_client_id);
+    request.set_message_content(messages[i].content);
+    request.set_timestamp(CurrentTimestamp());
+    request.set_sequence(next_sequence_++);
+    request.set_sender_epoch(sender_epoch_);
+    request.set_priority(messages[i].priority);
+    pending.push_back(i);
+  }
+  
+  // Spend one of the peer's mailbox credits per attempt. While it has none,
+  // fail fast or (in blocking mode) wait out its retry-after hint and resend.
+  // Batched attempts all start before any is awaited, so they share batches.
+  const auto give_up = std::chrono::steady_clock::now() + kMaxBackpressureWait;
+  while (!pending.empty()) {
+    for (size_t i : pending) {
+      Attempt& attempt = attempts[i];
+      attempt.reply.Clear();
+      if (!AcquireCredit(attempt.request, give_up)) {
+        attempt.no_credit = true;
+        continue;
+      }
+      attempt.span = std::make_unique<Span>(tracer_.get(), "peer.SendMessage", send_span.context());
+      if (batched) {
+        attempt.batch_result = target_client->SendBatched(attempt.request);
+        continue;
+      }
+      
+      // With a relay available, bound the direct attempt tighter so it can fall back
+      auto deadline = std::chrono::system_clock::now() +
+                      (relay_client_ ? kDirectSendTimeoutWithRelay : kDirectSendTimeout);
+      std::chrono::milliseconds retry_after(0);
+      bool encoded = codec_ != nullptr;
+      if (encoded) {
+        std::lock_guard<std::mutex> lock(protobuf_only_peers_mutex_);
+        encoded = protobuf_only_peers_.count(target_full_address) == 0;
+      }
+      if (encoded) {
+        attempt.status = target_client->SendEncoded(*codec_, attempt.request, &attempt.reply, deadline,
+                                                    &retry_after, attempt.span->context());
+        // An older peer without the codec's method never ran the handler
+        if (attempt.status.error_code() == grpc::StatusCode::UNIMPLEMENTED) {
+          if (log) {
+            std::cout << "Peer " << target_full_address << " does not accept " << codec_->name()
+                      << " messages, falling back to protobuf" << std::endl;
+          }
+          {
+            std::lock_guard<std::mutex> lock(protobuf_only_peers_mutex_);
+            protobuf_only_peers_.insert(target_full_address);
+          }
+          attempt.status = target_client->Send(attempt.request, &attempt.reply, deadline, &retry_after,
+                                               attempt.span->context());
+        }
+      } else {
+        attempt.status = target_client->Send(attempt.request, &attempt.reply, deadline, &retry_after,
+                                             attempt.span->context());
+      }
+      attempt.span->SetAttribute("status", std::to_string(attempt.status.error_code()));
+      attempt.span.reset();
+      UpdateCredits(attempt.request, attempt.status, attempt.reply, retry_after);
+    }
+    
+    std::vector<size_t> refused;
+    for (size_t i : pending) {
+      Attempt& attempt = attempts[i];
+      if (attempt.batch_result.valid()) {
+        BatchedSendResult result = attempt.batch_result.get();
+        attempt.status = result.status;
+        attempt.reply = std::move(result.reply);
+        attempt.span->SetAttribute("status", std::to_string(attempt.status.error_code()));
+        attempt.span.reset();
+        UpdateCredits(attempt.request, attempt.status, attempt.reply, result.retry_after);
+      }
+      if (!attempt.no_credit && attempt.status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED &&
+          backpressure_mode_ == BackpressureMode::kBlock) {
+        refused.push_back(i);
+      }
+    }
+    pending.swap(refused);
+  }
+  
+  for (size_t i = 0; i < attempts.size(); ++i) {
+    const Attempt& attempt = attempts[i];
+    const grpc::Status& status = attempt.status;
+    if (attempt.no_credit) {
+      if (log) {
+        std::cout << "Mailbox of " << target_client_id << " is full, try again later" << std::endl;
+      }
+    } else if (relay_client_ && (status.error_code() == grpc::StatusCode::UNAVAILABLE ||
+                                 status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED)) {
+      if (log) {
+        std::cout << "Cannot reach " << target_full_address << ", sending through relay" << std::endl;
+      }
+      Span relay_span(tracer_.get(), "relay.Send", send_span.context());
+      delivered[i] = relay_client_->Send(attempt.request, kRelaySendTimeout);
+      if (log) {
+        std::cout << (delivered[i] ? "Message relayed successfully" : "Failed to relay message") << std::endl;
+      }
+    } else if (status.ok() && attempt.reply.success()) {
+      if (log) {
+        std::cout << "Message sent successfully: " << attempt.reply.message() << std::endl;
+      }
+      delivered[i] = true;
+    } else if (log) {
+      std::cout << "Failed to send message: "
+                << (status.ok() ? attempt.reply.message() : status.error_message()) << std::endl;
+    }
+  }
+  return delivered;
+}
+
+bool Client::AcquireCredit(const helloworld::ClientMessage& message,
+                           std::chrono::steady_clock::time_point give_up) {
+  std::unique_lock<std::mutex> lock(credits_mutex_);
+  PeerCredits& peer = peer_credits_[{message.to_client_id(), message.priority()}];
   
-  // Send message
-  return target_client->SendMessage(client_id_, target_client_id, message);
+  // Once the retry-after hint has passed, one send may probe the mailbox
+  while (peer.credits == 0 && std::chrono::steady_clock::now() < peer.retry_at) {
+    if (backpressure_mode_ == BackpressureMode::kFailFast || std::chrono::steady_clock::now() >= give_up) {
+      return false;
+    }
+    credits_cv_.wait_until(lock, std::min(peer.retry_at, give_up));
+  }
+  
+  if (peer.credits > 0) {
+    --peer.credits;
+  }
+  return true;
+}
+
+void Client::UpdateCredits(const helloworld::ClientMessage& message, const grpc::Status& status,
+                           const helloworld::MessageResponse& reply, std::chrono::milliseconds retry_after) {
+  std::lock_guard<std::mutex> lock(credits_mutex_);
+  PeerCredits& peer = peer_credits_[{message.to_client_id(), message.priority()}];
+  
+  if (status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED) {
+    peer.credits = 0;
+    peer.retry_at = std::chrono::steady_clock::now() + retry_after;
+  } else if (status.ok()) {
+    // The reply reflects every send before it, so it replaces our count
+    peer.credits = reply.credits();
+    if (peer.credits == 0) {
+      peer.retry_at = std::chrono::steady_clock::now() + kMailboxFullRetryAfter;
+    }
+    credits_cv_.notify_all();
+  }
 }
 
-std::vector<std::tuple<std::string, std::string, int32_t, bool>> Client::GetAvailableClients() {
+std::future<DeliveryReceipt> Client::SendMessageToClientAsync(const std::string& target_client_id,
+                                                             const std::string& message,
+                                                             helloworld::MessagePriority priority) {
+  return MakeFuture<DeliveryReceipt>([&](std::function<void(DeliveryReceipt)> done) {
+    SendMessageToClientAsync(target_client_id, message,
+                             [done](const DeliveryReceipt& receipt) { done(receipt); }, priority);
+  });
+}
+
+void Client::SendMessageToClientAsync(const std::string& target_client_id,
+                                      const std::string& message,
+                                      DeliveryCallback callback,
+                                      helloworld::MessagePriority priority) {
+  const auto queued = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(send_queues_mutex_);
+    if (outstanding_sends_ < max_outstanding_sends_ && !send_workers_stopping_) {
+      ++outstanding_sends_;
+      PeerSendQueue& queue = send_queues_[target_client_id];
+      queue.sends.push_back(AsyncSend{OutgoingMessage{message, priority}, queued, std::move(callback)});
+      if (!queue.scheduled) {
+        queue.scheduled = true;
+        ready_peers_.push_back(target_client_id);
+        send_queues_cv_.notify_one();
+      }
+      while (send_workers_.size() < kAsyncSendWorkers) {
+        send_workers_.emplace_back(&Client::SendWorkerLoop, this);
+      }
+      return;
+    }
+  }
+  
+  if (log_sends_) {
+    std::cout << "Too many sends outstanding or client stopping, not sending to " << target_client_id
+              << std::endl;
+  }
+  DeliveryReceipt receipt;
+  receipt.target_client_id = target_client_id;
+  callback(receipt);
+}
+
+void Client::SetMaxOutstandingSends(size_t max_outstanding) {
+  std::lock_guard<std::mutex> lock(send_queues_mutex_);
+  max_outstanding_sends_ = std::max<size_t>(max_outstanding, 1);
+}
+
+void Client::SendWorkerLoop() {
+  std::unique_lock<std::mutex> lock(send_queues_mutex_);
+  while (true) {
+    send_queues_cv_.wait(lock, [this] { return send_workers_stopping_ || !ready_peers_.empty(); });
+    if (ready_peers_.empty()) {
+      return;
+    }
+    const std::string target_client_id = std::move(ready_peers_.front());
+    ready_peers_.pop_front();
+    lock.unlock();
+    DrainSendQueue(target_client_id);
+    lock.lock();
+  }
+}
+
+void Client::DrainSendQueue(const std::string& target_client_id) {
+  bool batching = false;
+  {
+    std::lock_guard<std::mutex> lock(batching_mutex_);
+    batching = batching_enabled_;
+  }
+  
+  std::unique_lock<std::mutex> lock(send_queues_mutex_);
+  std::vector<AsyncSend> sends;
+  {
+    PeerSendQueue& queue = send_queues_[target_client_id];
+    do {
+      sends.push_back(std::move(queue.sends.front()));
+      queue.sends.pop_front();
+    } while (batching && !queue.sends.empty());
+  }
+  lock.unlock();
+  
+  std::vector<OutgoingMessage> messages;
+  for (const AsyncSend& send : sends) {
+    messages.push_back(send.message);
+  }
+  const std::vector<bool> delivered = SendMessagesToClient(target_client_id, messages);
+  const auto done = std::chrono::steady_clock::now();
+  
+  // Free the slots first, so the callbacks may send again
+  lock.lock();
+  outstanding_sends_ -= sends.size();
+  lock.unlock();
+  for (size_t i = 0; i < sends.size(); ++i) {
+    DeliveryReceipt receipt;
+    receipt.target_client_id = target_client_id;
+    receipt.delivered = delivered[i];
+    receipt.latency = std::chrono::duration_cast<std::chrono::microseconds>(done - sends[i].queued);
+    sends[i].callback(receipt);
+  }
+  
+  // The peer is released only after its receipts, so they stay in order;
+  // it goes to the back of the line so busy peers take turns
+  lock.lock();
+  auto it = send_queues_.find(target_client_id);
+  if (it->second.sends.empty()) {
+    send_queues_.erase(it);
+  } else {
+    ready_peers_.push_back(target_client_id);
+    send_queues_cv_.notify_one();
+  }
+}
+
+void Client::StopSendWorkers() {
+  std::vector<std::thread> workers;
+  {
+    std::lock_guard<std::mutex> lock(send_queues_mutex_);
+    send_workers_stopping_ = true;
+    workers = TakeOtherSendWorkersLocked();
+  }
+  // Workers only exit once no peer has sends left
+  send_queues_cv_.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+void Client::ResumeSendWorkers() {
+  std::vector<std::thread> workers;
+  {
+    std::lock_guard<std::mutex> lock(send_queues_mutex_);
+    if (!send_workers_stopping_) {
+      return;
+    }
+    workers = TakeOtherSendWorkersLocked();
+  }
+  send_queues_cv_.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  std::lock_guard<std::mutex> lock(send_queues_mutex_);
+  send_workers_stopping_ = false;
+}
+
+std::vector<std::thread> Client::TakeOtherSendWorkersLocked() {
+  std::vector<std::thread> others;
+  std::vector<std::thread> kept;
+  for (std::thread& worker : send_workers_) {
+    (worker.get_id() == std::this_thread::get_id() ? kept : others).push_back(std::move(worker));
+  }
+  send_workers_ = std::move(kept);
+  return others;
+}
+
+std::vector<SendResult> Client::SendToMany(const std::vector<std::string>& target_client_ids,
+                                           const std::string& message,
+                                           size_t max_in_flight) {
+  std::vector<SendResult> results(target_client_ids.size());
+  for (size_t i = 0; i < results.size(); ++i) {
+    results[i].target_client_id = target_client_ids[i];
+  }
+  if (target_client_ids.empty()) {
+    return results;
+  }
+  max_in_flight = std::max<size_t>(max_in_flight, 1);
+  
+  // Resolve every target in one registry round trip
+  std::vector<ClientLookupResult> targets = registry_client_->GetClients(target_client_ids);
+  
+  // Serialize everything but the recipient once. Each send references the
+  // same slice and appends its own to_client_id field, which protobuf
+  // parsing merges regardless of field order.
+  helloworld::ClientMessage shared_message;
+  shared_message.set_from_client_id(client_id_);
+  shared_message.set_message_content(message);
+  shared_message.set_timestamp(CurrentTimestamp());
+  shared_message.set_sequence(next_sequence_++);
+  shared_message.set_sender_epoch(sender_epoch_);
+  const grpc::Slice shared_payload(shared_message.SerializeAsString());
+  
+  // recipient holds just to_client_id: appended to the shared payload, it
+  // also keys the target's mailbox credits
+  struct PendingSend {
+    helloworld::ClientMessage recipient;
+    grpc::ClientContext context;
+    grpc::ByteBuffer request;
+    grpc::ByteBuffer reply;
+  };
+  std::vector<std::unique_ptr<PendingSend>> sends(target_client_ids.size());
+  std::map<std::string, std::unique_ptr<grpc::GenericStub>> stubs;
+  
+  std::mutex in_flight_mutex;
+  std::condition_variable in_flight_cv;
+  size_t in_flight = 0;
+  const auto give_up = std::chrono::steady_clock::now() + kMaxBackpressureWait;
+  
+  for (size_t i = 0; i < target_client_ids.size(); ++i) {
+    const ClientLookupResult& target = targets[i];
+    if (!target.ok) {
+      results[i].error = "Failed to get target client info";
+      continue;
+    }
+    if (!target.online) {
+      results[i].error = "Target client is not online";
+      continue;
+    }
+    
+    // One channel per distinct peer address for the whole fan-out
+    const std::string target_full_address = target.address + ":" + std::to_string(target.port);
+    std::unique_ptr<grpc::GenericStub>& stub = stubs[target_full_address];
+    if (!stub) {
+      stub = std::make_unique<grpc::GenericStub>(peer_channels_.Get(target_full_address));
+    }
+    
+    sends[i] = std::make_unique<PendingSend>();
+    PendingSend* send = sends[i].get();
+    send->recipient.set_to_client_id(target_client_ids[i]);
+    grpc::Slice slices[] = {shared_payload, grpc::Slice(send->recipient.SerializeAsString())};
+    send->request = grpc::ByteBuffer(slices, 2);
+    
+    if (!AcquireCredit(send->recipient, give_up)) {
+      results[i].error = "Mailbox of " + target_client_ids[i] + " is full, try again later";
+      continue;
+    }
+    
+    {
+      std::unique_lock<std::mutex> lock(in_flight_mutex);
+      in_flight_cv.wait(lock, [&] { return in_flight < max_in_flight; });
+      ++in_flight;
+    }
+    
+    send->context.set_deadline(std::chrono::system_clock::now() + kDirectSendTimeout);
+    stub->UnaryCall(&send->context, kSendMessageMethod, grpc::StubOptions(),
+                    &send->request, &send->reply, [&, send, i](grpc::Status status) {
+      helloworld::MessageResponse reply;
+      if (status.ok()) {
+        status = grpc::SerializationTraits<helloworld::MessageResponse>::Deserialize(&send->reply, &reply);
+      }
+      const std::chrono::milliseconds retry_after =
+          status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED ? RetryAfterHint(send->context)
+                                                                       : std::chrono::milliseconds(0);
+      UpdateCredits(send->recipient, status, reply, retry_after);
+      results[i].success = status.ok() && reply.success();
+      if (!results[i].success) {
+        results[i].error = status.ok() ? reply.message() : status.error_message();
+      }
+      
+      // Notify under the lock: the waiting thread owns in_flight_cv
+      std::lock_guard<std::mutex> lock(in_flight_mutex);
+      --in_flight;
+      in_flight_cv.notify_all();
+    });
+  }
+  
+  std::unique_lock<std::mutex> lock(in_flight_mutex);
+  in_flight_cv.wait(lock, [&] { return in_flight == 0; });
+  
+  return results;
+}
+
+std::vector<ClientEntry> Client::GetAvailableClients() {
   return registry_client_->ListClients();
 }
 
+std::vector<ClientEntry> Client::FindClients(const LabelSelectors& selectors) {
+  return registry_client_->QueryClients(selectors);
+}
+
+int32_t Client::PublishToTopic(const std::string& topic, const std::string& message) {
+  return registry_client_->Publish(client_id_, topic, message);
+}
+
+bool Client::SubscribeToTopic(const std::string& topic, TopicCallback callback) {
+  auto state = std::make_shared<SubscriptionState>();
+  std::promise<bool> confirmed;
+  std::future<bool> subscribed = confirmed.get_future();
+  {
+    std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+    if (subscriptions_.count(topic) != 0) {
+      std::cout << "Already subscribed to topic " << topic << std::endl;
+      return false;
+    }
+    TopicSubscription& subscription = subscriptions_[topic];
+    subscription.state = state;
+    subscription.reader_thread = std::thread(&Client::SubscriptionLoop, this, topic, state,
+                                             std::move(callback), std::move(confirmed));
+  }
+  
+  // The registry acknowledges in its initial metadata only after adding the
+  // subscriber, so every publish from this point on is delivered
+  if (subscribed.wait_for(kSubscribeTimeout) == std::future_status::ready && subscribed.get()) {
+    return true;
+  }
+  std::cout << "Failed to subscribe to topic " << topic << std::endl;
+  
+  // Unless an unsubscribe already took it down
+  TopicSubscription subscription;
+  {
+    std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+    auto it = subscriptions_.find(topic);
+    if (it == subscriptions_.end() || it->second.state != state) {
+      return false;
+    }
+    subscription = std::move(it->second);
+    subscriptions_.erase(it);
+  }
+  CancelSubscription(state.get());
+  subscription.reader_thread.join();
+  return false;
+}
+
+void Client::SubscriptionLoop(const std::string& topic, std::shared_ptr<SubscriptionState> state,
+                              TopicCallback callback, std::promise<bool> subscribed) {
+  bool first = true;
+  std::chrono::milliseconds backoff = kResubscribeBackoff;
+  while (true) {
+    grpc::ClientContext context;
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (state->cancelled) {
+        break;
+      }
+      state->context = &context;
+    }
+    
+    std::unique_ptr<grpc::ClientReader<helloworld::TopicMessage>> reader =
+        registry_client_->Subscribe(&context, client_id_, topic);
+    reader->WaitForInitialMetadata();
+    auto confirmation = context.GetServerInitialMetadata().find(kSubscribedTopicMetadataKey);
+    const bool confirmed = confirmation != context.GetServerInitialMetadata().end() &&
+                           std::string(confirmation->second.data(), confirmation->second.size()) == topic;
+    const bool initial = first;
+    if (first) {
+      first = false;
+      subscribed.set_value(confirmed);
+    }
+    
+    helloworld::TopicMessage message;
+    while (confirmed && reader->Read(&message)) {
+      callback(message);
+    }
+    if (confirmed) {
+      backoff = kResubscribeBackoff;
+    }
+    grpc::Status status = reader->Finish();
+    
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->context = nullptr;
+    // A subscription the registry refused to begin with is not retried
+    if (state->cancelled || (initial && !confirmed)) {
+      break;
+    }
+    std::cout << "Subscription to topic " << topic << " ended: " << status.error_message()
+              << ", subscribing again" << std::endl;
+    if (state->cv.wait_for(lock, backoff / 2 + RandomDelay(backoff), [&state] { return state->cancelled; })) {
+      break;
+    }
+    backoff = std::min(backoff * 2, kMaxResubscribeBackoff);
+  }
+}
+
+void Client::CancelSubscription(SubscriptionState* state) {
+  std::lock_guard<std::mutex> lock(state->mutex);
+  state->cancelled = true;
+  if (state->context != nullptr) {
+    state->context->TryCancel();
+  }
+  state->cv.notify_all();
+}
+
+void Client::UnsubscribeFromTopic(const std::string& topic) {
+  TopicSubscription subscription;
+  {
+    std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+    auto it = subscriptions_.find(topic);
+    if (it == subscriptions_.end()) {
+      return;
+    }
+    subscription = std::move(it->second);
+    subscriptions_.erase(it);
+  }
+  
+  CancelSubscription(subscription.state.get());
+  if (subscription.reader_thread.joinable()) {
+    subscription.reader_thread.join();
+  }
+}
+
 void Client::Stop() {
+  std::vector<std::string> topics;
+  {
+    std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+    for (const auto& [topic, subscription] : subscriptions_) {
+      topics.push_back(topic);
+    }
+  }
+  for (const auto& topic : topics) {
+    UnsubscribeFromTopic(topic);
+  }
+  
+  // Let queued asynchronous sends finish while the client is still registered
+  StopSendWorkers();
+  
   std::lock_guard<std::mutex> lock(running_mutex_);
   
   if (!running_) {
     return;
   }
   
+  // Stop re-registering before unregistering
+  registration_.Stop();
+  
   // Unregister from registry
   registry_client_->UnregisterClient(client_id_);
   
+  if (relay_client_) {
+    relay_client_->Close();
+    relay_client_.reset();
+  }
+  
+  // Flush anything still lingering in a batch
+  {
+    std::lock_guard<std::mutex> lock(batching_mutex_);
+    batching_clients_.clear();
+  }
+  peer_channels_.Clear();
+  
   // Stop communication server
   if (communication_server_) {
     communication_server_->Shutdown();
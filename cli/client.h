@@ -1,21 +1,77 @@
 #ifndef HELLOWORLD_CLIENT_H
 #define HELLOWORLD_CLIENT_H
 
+#include <grpcpp/generic/async_generic_service.h>
+#include <grpcpp/generic/generic_stub.h>
 #include <grpcpp/grpcpp.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <memory>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <vector>
 #include <map>
 #include <mutex>
+#include <set>
 
 #include "proto/helloworld.grpc.pb.h"
+#include "common/metadata.h"
+#include "common/tls.h"
+#include "blob_transfer.h"
+#include "client_list.h"
+#include "client_support.h"
+#include "message_codec.h"
+#include "relay_client.h"
+#include "tracing.h"
 
 namespace helloworld {
 
-// Client communication service implementation
+// Messages a mailbox holds before senders are pushed back
+constexpr size_t kDefaultMailboxCapacity = 1024;
+
+// Retry-after hint sent with RESOURCE_EXHAUSTED when a mailbox is full
+constexpr std::chrono::milliseconds kMailboxFullRetryAfter(100);
+
+// Longest a ReceiveMessage call waits for a message to arrive
+constexpr std::chrono::milliseconds kMaxReceiveWait(1000);
+
+// Mailbox lanes in dequeue order: high, normal and bulk priority
+constexpr size_t kMailboxLanes = 3;
+
+// Messages each lane may dequeue per weighted round while it has any
+constexpr int kMailboxLaneWeights[kMailboxLanes] = {8, 4, 1};
+
+// Depth and queueing delay of one mailbox lane
+struct MailboxLaneStats {
+  helloworld::MessagePriority priority;
+  size_t depth = 0;
+  uint64_t dequeued = 0;
+  std::chrono::microseconds average_wait{0};
+  std::chrono::microseconds max_wait{0};
+};
+
+// Outcome of handing a message to a mailbox
+enum class DeliveryResult {
+  kQueued,
+  kDuplicate,
+  kMailboxFull,
+};
+
+// Client communication service implementation. The mailbox has one lane
+// per priority, drained by weighted round robin. The capacity is split
+// evenly across the lanes and each lane is bounded separately, so bulk
+// traffic filling its lane never refuses control messages: a full lane
+// refuses messages with RESOURCE_EXHAUSTED and every reply advertises the
+// lane's remaining capacity as credits for the sender.
 class ClientCommunicationServiceImpl final : public helloworld::ClientCommunication::Service {
  public:
+  explicit ClientCommunicationServiceImpl(size_t capacity = kDefaultMailboxCapacity);
+
   grpc::Status SendMessage(grpc::ServerContext* context,
                           const helloworld::ClientMessage* request,
                           helloworld::MessageResponse* reply) override;
@@ -24,9 +80,191 @@ class ClientCommunicationServiceImpl final : public helloworld::ClientCommunicat
                              const helloworld::MessageRequest* request,
                              helloworld::ClientMessage* reply) override;
 
+  // Queue a whole batch under one lock
+  grpc::Status SendMessageBatch(grpc::ServerContext* context,
+                                const helloworld::ClientMessageBatch* request,
+                                helloworld::MessageBatchResponse* reply) override;
+
+  grpc::Status TransferBlob(grpc::ServerContext* context,
+                            grpc::ServerReader<helloworld::BlobChunk>* reader,
+                            helloworld::BlobTransferResponse* reply) override;
+
+  grpc::Status GetBlobOffset(grpc::ServerContext* context,
+                             const helloworld::BlobOffsetRequest* request,
+                             helloworld::BlobTransferResponse* reply) override;
+
+  // Handle a message decoded by a codec as SendMessage does
+  grpc::Status SendMessageView(grpc::ServerContextBase* context,
+                               const ClientMessageView& message,
+                               helloworld::MessageResponse* reply);
+
+  // Dequeue the next message by lane weight; false if the mailbox is empty
+  bool TakeMessage(helloworld::ClientMessage* message);
+
+  // As TakeMessage, but wait until deadline for a message to arrive
+  bool WaitMessage(helloworld::ClientMessage* message, std::chrono::steady_clock::time_point deadline);
+
+  // Queue a message that arrived by another path (e.g. the relay)
+  DeliveryResult DeliverMessage(const helloworld::ClientMessage& message);
+
+  void SetCapacity(size_t capacity);
+
+  // Per-lane depth and wait times, in lane order
+  std::vector<MailboxLaneStats> LaneStats();
+
+  // Received blobs are stored here
+  BlobReceiver& blobs() { return blobs_; }
+
+  // Record a span for each traced message handled. Call before serving.
+  void SetTracer(std::shared_ptr<Tracer> tracer) { tracer_ = std::move(tracer); }
+
  private:
-  std::vector<helloworld::ClientMessage> message_queue_;
+  // Replay window per sender: the highest sequence seen in the sender's
+  // current epoch and a bitmap of the kDedupWindow sequences up to it
+  struct SenderWindow {
+    uint64_t epoch = 0;
+    uint64_t highest = 0;
+    uint64_t seen = 0;
+  };
+
+  struct QueuedMessage {
+    helloworld::ClientMessage message;
+    std::chrono::steady_clock::time_point enqueued;
+  };
+
+  struct Lane {
+    std::deque<QueuedMessage> messages;
+    // Dequeues left in the current weighted round
+    int budget = 0;
+    uint64_t dequeued = 0;
+    std::chrono::steady_clock::duration total_wait{0};
+    std::chrono::steady_clock::duration max_wait{0};
+  };
+
+  grpc::Status HandleMessage(grpc::ServerContextBase* context,
+                             const helloworld::ClientMessage& message,
+                             helloworld::MessageResponse* reply);
+  DeliveryResult DeliverLocked(const helloworld::ClientMessage& message);
+  int32_t CreditsLocked(const helloworld::ClientMessage& message) const;
+
+  // Share of the capacity held by a lane; the shares sum to capacity_
+  size_t LaneCapacityLocked(size_t lane) const;
+
+  // Lane to dequeue from next; nullptr when every lane is empty
+  Lane* NextLaneLocked();
+  bool TakeLocked(helloworld::ClientMessage* message);
+
+  // Record a sequenced message; false if it was seen before or is too old
+  bool AcceptLocked(const helloworld::ClientMessage& message);
+
+  Lane lanes_[kMailboxLanes];
+  size_t capacity_;
+  std::map<std::string, SenderWindow> sender_windows_;
   std::mutex message_mutex_;
+  // Signalled whenever a message is queued
+  std::condition_variable message_cv_;
+  BlobReceiver blobs_{DefaultBlobDirectory()};
+  std::shared_ptr<Tracer> tracer_;
+};
+
+// Mailbox of the client a message is addressed to; nullptr if there is none
+using MailboxResolver =
+    std::function<std::shared_ptr<ClientCommunicationServiceImpl>(std::string_view to_client_id)>;
+
+// Serves direct messages in non-protobuf encodings, picking the codec by
+// method name. Flat messages are accepted by default; protobuf ones go to
+// the generated SendMessage handler.
+class EncodedMessageService final : public grpc::CallbackGenericService {
+ public:
+  // Every message goes to mailbox
+  explicit EncodedMessageService(ClientCommunicationServiceImpl* mailbox);
+
+  // Each message goes to the mailbox of its to_client_id, read in place
+  explicit EncodedMessageService(MailboxResolver resolver);
+
+  // Accept another encoding. Call before serving.
+  void AddCodec(std::shared_ptr<const MessageCodec> codec);
+
+  grpc::ServerGenericBidiReactor* CreateReactor(grpc::GenericCallbackServerContext* context) override;
+
+ private:
+  MailboxResolver resolver_;
+  std::map<std::string, std::shared_ptr<const MessageCodec>> codecs_;
+};
+
+// Sequences a mailbox remembers per sender; older resends are dropped
+constexpr uint64_t kDedupWindow = 64;
+
+// Registered client as (client_id, address, port, online)
+using ClientEntry = std::tuple<std::string, std::string, int32_t, bool>;
+
+// Labels a client registers with, e.g. {"role", "worker"}
+using ClientLabels = std::map<std::string, std::string>;
+
+// Label query: each key must carry one of the listed values
+using LabelSelectors = std::map<std::string, std::vector<std::string>>;
+
+// Result of a client lookup; ok is false when the RPC itself failed
+struct ClientLookupResult {
+  bool ok = false;
+  std::string address;
+  int32_t port = 0;
+  bool online = false;
+};
+
+// Outcome of one send in a fan-out
+struct SendResult {
+  std::string target_client_id;
+  bool success = false;
+  std::string error;
+};
+
+// Default bound on concurrent sends in a fan-out
+constexpr size_t kDefaultFanOutConcurrency = 32;
+
+// Outcome of one asynchronous send
+struct DeliveryReceipt {
+  std::string target_client_id;
+  bool delivered = false;
+  // From the call until the peer (or the relay) acknowledged the message
+  std::chrono::microseconds latency{0};
+};
+
+// Called with the receipt of an asynchronous send
+using DeliveryCallback = std::function<void(const DeliveryReceipt&)>;
+
+// Default bound on asynchronous sends queued or in flight per client
+constexpr size_t kDefaultMaxOutstandingSends = 1024;
+
+// Threads a client sends asynchronous messages on, shared by all peers
+constexpr size_t kAsyncSendWorkers = 8;
+
+// Default deadline for registry calls
+constexpr std::chrono::milliseconds kDefaultRegistryCallTimeout(5000);
+
+// Deadline applied to each registry RPC, sync or async
+struct RegistryCallTimeouts {
+  std::chrono::milliseconds register_client = kDefaultRegistryCallTimeout;
+  std::chrono::milliseconds get_client = kDefaultRegistryCallTimeout;
+  std::chrono::milliseconds get_clients = kDefaultRegistryCallTimeout;
+  std::chrono::milliseconds list_clients = kDefaultRegistryCallTimeout;
+  std::chrono::milliseconds query_clients = kDefaultRegistryCallTimeout;
+  std::chrono::milliseconds unregister_client = kDefaultRegistryCallTimeout;
+  std::chrono::milliseconds publish = kDefaultRegistryCallTimeout;
+};
+
+// Channel to a registry with the client's retry policy: read-only lookups
+// are retried on UNAVAILABLE with exponential backoff. The channel also
+// watches the registry's health service and reports TRANSIENT_FAILURE while
+// it is NOT_SERVING (e.g. draining).
+std::shared_ptr<grpc::Channel> CreateRegistryChannel(const std::string& registry_server_address,
+                                                     const ChannelFactory& channels = ChannelFactory());
+
+// How ClientRegistryClient spreads reads over several endpoints
+enum class RegistryBalancing {
+  kRoundRobin,
+  // Prefer the endpoint with the lowest recent read latency
+  kLowestLatency,
 };
 
 // Client registry client
@@ -34,10 +272,54 @@ class ClientRegistryClient {
  public:
   explicit ClientRegistryClient(std::shared_ptr<grpc::Channel> channel);
 
-  // Register this client with the registry
+  // Several registry endpoints. Every call goes to the first one unless
+  // they are declared replicas.
+  explicit ClientRegistryClient(const std::vector<std::shared_ptr<grpc::Channel>>& channels);
+
+  // Declare the endpoints replicas serving the same registry state: reads
+  // are balanced across healthy endpoints and hedged, and writes go to the
+  // first healthy one
+  void SetReplicas(bool replicas);
+
+  // Policy for picking the endpoint of each read
+  void SetBalancing(RegistryBalancing balancing);
+
+  // Identify this client on every call, so the registry can rate limit it
+  // by client id rather than by host
+  void SetCallerId(const std::string& client_id);
+
+  // Apply one deadline to every call
+  void SetCallTimeout(std::chrono::milliseconds timeout);
+
+  // Per-method deadlines
+  void SetCallTimeouts(const RegistryCallTimeouts& timeouts);
+
+  // Start connecting to every endpoint without waiting, so the first call
+  // does not pay for the handshake
+  void WarmUp() const;
+
+  // With several endpoints, send GetClient to the next endpoint whenever no
+  // answer has arrived after delay; the first answer wins. Zero disables.
+  void EnableHedgedLookups(std::chrono::milliseconds delay);
+
+  // Have ListClients and ListClientsAsync fetch the compact columnar list,
+  // which is smaller and cheaper to parse for large registries
+  void UseCompactClientLists(bool enabled);
+
+  // Called when an endpoint replies with a different registry epoch than it
+  // did before, i.e. it restarted without its state. Runs on the calling
+  // thread or a gRPC thread and must not block. Once this returns, the
+  // previous callback is no longer running and will not run again.
+  void SetRestartCallback(std::function<void()> callback);
+
+  // Register this client with the registry. On failure, retryable tells
+  // whether the registry could not be reached (or was busy) rather than
+  // refusing the registration.
   bool RegisterClient(const std::string& client_id,
                       const std::string& client_address,
-                      int32_t client_port) const;
+                      int32_t client_port,
+                      const ClientLabels& labels = {},
+                      bool* retryable = nullptr) const;
   
   // Get client information by ID
   bool GetClient(const std::string& client_id,
@@ -45,46 +327,390 @@ class ClientRegistryClient {
                  int32_t& port,
                  bool& online) const;
   
+  // Look a client up on the endpoint it registers with, never a balanced
+  // read, so a lagging replica is not taken for a lost registration. False
+  // if the call failed.
+  bool IsRegistered(const std::string& client_id, bool* registered) const;
+  
+  // Look up several clients in one round trip; results are in request order
+  std::vector<ClientLookupResult> GetClients(const std::vector<std::string>& client_ids) const;
+  
   // List all registered clients
-  std::vector<std::tuple<std::string, std::string, int32_t, bool>> ListClients() const;
+  std::vector<ClientEntry> ListClients() const;
+  
+  // Visit every registered client, read in place from a compact list, so
+  // that no entry is copied or allocated. False if the call failed.
+  bool ForEachClient(const std::function<void(const ListedClient&)>& visit) const;
+  
+  // Find clients matching every label selector, evaluated by the registry
+  std::vector<ClientEntry> QueryClients(const LabelSelectors& selectors) const;
   
   // Unregister this client
   bool UnregisterClient(const std::string& client_id) const;
+  
+  // Publish to a topic; returns the number of subscribers reached, or -1 on failure
+  int32_t Publish(const std::string& from_client_id,
+                  const std::string& topic,
+                  const std::string& message_content) const;
+  
+  // Open a topic subscription stream; it ends when context is cancelled
+  std::unique_ptr<grpc::ClientReader<helloworld::TopicMessage>> Subscribe(
+      grpc::ClientContext* context,
+      const std::string& client_id,
+      const std::string& topic) const;
+
+  // Asynchronous variants. They return immediately; any number of calls can
+  // be in flight on the registry channel at once. Callbacks run on a gRPC
+  // thread and must not block.
+  std::future<bool> RegisterClientAsync(const std::string& client_id,
+                                        const std::string& client_address,
+                                        int32_t client_port,
+                                        const ClientLabels& labels = {}) const;
+  void RegisterClientAsync(const std::string& client_id,
+                           const std::string& client_address,
+                           int32_t client_port,
+                           std::function<void(bool)> callback,
+                           const ClientLabels& labels = {}) const;
+
+  std::future<ClientLookupResult> GetClientAsync(const std::string& client_id) const;
+  void GetClientAsync(const std::string& client_id,
+                      std::function<void(const ClientLookupResult&)> callback) const;
+
+  std::future<std::vector<ClientEntry>> ListClientsAsync() const;
+  void ListClientsAsync(std::function<void(std::vector<ClientEntry>)> callback) const;
+
+  std::future<bool> UnregisterClientAsync(const std::string& client_id) const;
+  void UnregisterClientAsync(const std::string& client_id,
+                             std::function<void(bool)> callback) const;
 
  private:
-  std::unique_ptr<helloworld::ClientRegistry::Stub> stub_;
+  // Read latency per endpoint, shared with in-flight async calls
+  struct LatencyStats {
+    std::mutex mutex;
+    // Moving average in microseconds; 0 until the first sample
+    std::vector<double> average_us;
+    size_t next_read = 0;
+    uint64_t reads = 0;
+  };
+
+  // Registry epoch last seen per endpoint, shared with in-flight async calls
+  struct EpochState {
+    std::mutex mutex;
+    // 0 until the endpoint first replies
+    std::vector<uint64_t> epochs;
+    // Held while on_restart runs, so replacing it waits out a running call
+    std::mutex callback_mutex;
+    std::function<void()> on_restart;
+  };
+
+  // Endpoints in the order a read should try them: healthy ones first,
+  // ranked by the balancing policy. Only the first endpoint unless replicas.
+  std::vector<size_t> ReadOrder() const;
+
+  // First healthy endpoint, for writes and streams; the first endpoint
+  // unless replicas
+  size_t WriteEndpoint() const;
+
+  bool Healthy(size_t endpoint) const;
+
+  static void RecordLatency(LatencyStats* stats, size_t endpoint,
+                            std::chrono::steady_clock::time_point start,
+                            const grpc::Status& status);
+
+  static void ObserveEpoch(EpochState* state, size_t endpoint, const grpc::ClientContext& context);
+
+  // One ListClients call to the first read endpoint, in either form
+  grpc::Status FetchClientList(bool compact, helloworld::ClientList* reply) const;
+
+  grpc::Status HedgedGetClient(const helloworld::ClientLookup& request,
+                               helloworld::ClientInfo* reply) const;
+
+  std::vector<std::shared_ptr<grpc::Channel>> channels_;
+  std::vector<std::unique_ptr<helloworld::ClientRegistry::Stub>> stubs_;
+  std::shared_ptr<LatencyStats> latency_;
+  std::shared_ptr<EpochState> epochs_;
+  RegistryBalancing balancing_ = RegistryBalancing::kRoundRobin;
+  bool replicas_ = false;
+  void Identify(grpc::ClientContext* context) const;
+
+  RegistryCallTimeouts timeouts_;
+  std::chrono::milliseconds hedge_delay_{0};
+  bool compact_lists_ = false;
+  std::string caller_id_;
+};
+
+// How long a direct send may take; shorter with a relay to fall back to
+constexpr std::chrono::milliseconds kDirectSendTimeout(10000);
+constexpr std::chrono::milliseconds kDirectSendTimeoutWithRelay(2000);
+
+// Sender-side coalescing of messages to one peer
+struct BatchingOptions {
+  // How long the first queued message waits for others to join its batch
+  std::chrono::milliseconds linger{5};
+  // A batch is sent as soon as this many bytes are queued
+  size_t max_batch_bytes = 64 * 1024;
+  // Deadline for each batch call, and for a message sent on its own when
+  // batching is off; zero means kDirectSendTimeout
+  std::chrono::milliseconds timeout{kDirectSendTimeout};
+};
+
+// Outcome of one message sent as part of a batch
+struct BatchedSendResult {
+  grpc::Status status;
+  helloworld::MessageResponse reply;
+  // The receiver's hint when status is RESOURCE_EXHAUSTED
+  std::chrono::milliseconds retry_after{0};
 };
 
 // Direct client-to-client communication
 class ClientCommunicationClient {
  public:
   explicit ClientCommunicationClient(std::shared_ptr<grpc::Channel> channel);
+  ~ClientCommunicationClient();
 
   // Send message to another client
   bool SendMessage(const std::string& from_client_id,
                    const std::string& to_client_id,
                    const std::string& message_content) const;
 
+  // Send a prepared message without logging; deadline bounds the dial as
+  // well. On RESOURCE_EXHAUSTED, retry_after receives the peer's hint. A
+  // valid trace context is passed on to the peer's handler.
+  grpc::Status Send(const helloworld::ClientMessage& message,
+                    helloworld::MessageResponse* reply,
+                    std::chrono::system_clock::time_point deadline =
+                        std::chrono::system_clock::time_point::max(),
+                    std::chrono::milliseconds* retry_after = nullptr,
+                    const TraceContext& trace = TraceContext()) const;
+
+  // As Send, but in the codec's encoding through the generic stub, made on
+  // first use. Peers serve the flat encoding with EncodedMessageService;
+  // one that does not answers UNIMPLEMENTED.
+  grpc::Status SendEncoded(const MessageCodec& codec,
+                           const helloworld::ClientMessage& message,
+                           helloworld::MessageResponse* reply,
+                           std::chrono::system_clock::time_point deadline =
+                               std::chrono::system_clock::time_point::max(),
+                           std::chrono::milliseconds* retry_after = nullptr,
+                           const TraceContext& trace = TraceContext()) const;
+
+  // Stream a buffer to the peer in chunks. After a broken stream the
+  // transfer resumes from the receiver's committed offset, up to
+  // kMaxBlobTransferAttempts streams in all.
+  grpc::Status TransferBlob(const std::string& transfer_id,
+                            const std::string& from_client_id,
+                            const char* data,
+                            size_t size,
+                            size_t chunk_size = kDefaultBlobChunkSize) const;
+
+  // Stream a file, memory-mapped rather than read into memory
+  grpc::Status TransferFile(const std::string& transfer_id,
+                            const std::string& from_client_id,
+                            const std::string& file_path,
+                            size_t chunk_size = kDefaultBlobChunkSize) const;
+
+  // Opt in to coalescing: SendBatched messages are held per the options and
+  // sent together as one ClientMessageBatch by a background flusher
+  void EnableBatching(const BatchingOptions& options);
+
+  // Queue a message for the next batch; without batching it is sent at once.
+  // The future resolves with this message's own outcome.
+  std::future<BatchedSendResult> SendBatched(helloworld::ClientMessage message);
+
  private:
+  struct QueuedMessage {
+    helloworld::ClientMessage message;
+    std::promise<BatchedSendResult> result;
+  };
+
+  void FlushLoop();
+  void FlushBatch(std::vector<QueuedMessage>* batch);
+  // Now plus batching_options_.timeout; batch_mutex_ must be held
+  std::chrono::system_clock::time_point SendDeadline() const;
+
+  std::shared_ptr<grpc::Channel> channel_;
   std::unique_ptr<helloworld::ClientCommunication::Stub> stub_;
+  mutable std::once_flag generic_stub_once_;
+  mutable std::unique_ptr<grpc::GenericStub> generic_stub_;
+
+  BatchingOptions batching_options_;
+  std::thread flush_thread_;
+  std::mutex batch_mutex_;
+  std::condition_variable batch_cv_;
+  std::vector<QueuedMessage> batch_;
+  size_t batch_bytes_ = 0;
+  std::chrono::steady_clock::time_point batch_started_;
+  bool stopping_ = false;
 };
 
-// Main client class that combines registry and communication
+// Streams a blob transfer may take, counting resumes
+constexpr int kMaxBlobTransferAttempts = 5;
+constexpr std::chrono::milliseconds kBlobResumeBackoff(100);
+
+// Per-attempt deadlines: the offset query, and a stream's base allowance
+// plus time for its bytes at the slowest throughput still worth waiting for
+constexpr std::chrono::milliseconds kBlobOffsetTimeout(5000);
+constexpr std::chrono::milliseconds kBlobStreamTimeout(10000);
+constexpr uint64_t kMinBlobBytesPerSecond = 1 << 20;
+
+// Deadlines for connecting to the relay and for a relayed message's ack
+constexpr std::chrono::milliseconds kRelayConnectTimeout(5000);
+constexpr std::chrono::milliseconds kRelaySendTimeout(5000);
+
+// What a send does while the peer has no mailbox credits left
+enum class BackpressureMode {
+  kFailFast,
+  // Wait out the peer's retry-after hint, at most kMaxBackpressureWait
+  kBlock,
+};
+
+constexpr std::chrono::milliseconds kMaxBackpressureWait(5000);
+
+// How long SubscribeToTopic waits for the registry to confirm
+constexpr std::chrono::milliseconds kSubscribeTimeout(5000);
+
+// Bounds on the jittered wait before resubscribing after a stream ends
+constexpr std::chrono::milliseconds kResubscribeBackoff(100);
+constexpr std::chrono::milliseconds kMaxResubscribeBackoff(5000);
+
+// Called for every message published to a subscribed topic
+using TopicCallback = std::function<void(const helloworld::TopicMessage&)>;
+
+// Main client class that combines registry and communication. A client_port
+// of 0 listens on any free port; the bound port is the one registered. With
+// TLS enabled, the client serves and dials the registry, relay and peers
+// over TLS.
 class Client {
  public:
   Client(const std::string& registry_server_address,
          const std::string& client_id,
          const std::string& client_address,
-         int32_t client_port);
+         int32_t client_port,
+         const TlsOptions& tls = TlsOptions());
+
+  // Use several registry endpoints that serve the same registry state
+  Client(const std::vector<std::string>& registry_server_addresses,
+         const std::string& client_id,
+         const std::string& client_address,
+         int32_t client_port,
+         const TlsOptions& tls = TlsOptions());
+
+  ~Client();
+
+  // Fall back to the relay at relay_address when a peer cannot be dialed
+  // directly. Call before Start().
+  void EnableRelay(const std::string& relay_address);
+
+  // Labels to register with. Call before Start().
+  void SetLabels(const ClientLabels& labels);
+
+  // Deadlines for registry calls made by this client
+  void SetRegistryCallTimeouts(const RegistryCallTimeouts& timeouts);
+
+  // Bound on this client's own mailbox
+  void SetMailboxCapacity(size_t capacity);
+
+  // How sends behave when a peer's mailbox is full
+  void SetBackpressureMode(BackpressureMode mode);
+
+  // Print a line for each send's outcome (the default). Received messages
+  // are printed either way.
+  void SetSendLogging(bool enabled);
+
+  // Coalesce messages to the same peer before sending them
+  void EnableMessageBatching(const BatchingOptions& options);
+
+  // Encode direct sends with codec instead of the generated protobuf stub.
+  // Batched and relayed messages stay protobuf, as do sends to a peer that
+  // once answered UNIMPLEMENTED to the codec's method. Call before Start().
+  void SetMessageCodec(std::shared_ptr<const MessageCodec> codec);
+
+  // Trace sends to trace_file: a sample_rate fraction of SendMessageToClient
+  // calls record the registry lookup, channel setup and peer send, and the
+  // receiving client records its handler if it traces too. Call before Start().
+  bool EnableTracing(const std::string& trace_file, double sample_rate);
 
-  // Start the client (register and start listening)
+  // Directory blobs sent to this client are stored in
+  void SetBlobDirectory(const std::string& directory);
+
+  // Send a file to another client as a resumable chunked transfer. Sending
+  // the same file again resumes an interrupted transfer.
+  bool SendFileToClient(const std::string& target_client_id, const std::string& file_path);
+
+  // Read balancing and hedged lookups across several registry endpoints,
+  // once they are declared replicas
+  void SetRegistryReplicas(bool replicas);
+  void SetRegistryBalancing(RegistryBalancing balancing);
+  void EnableHedgedRegistryLookups(std::chrono::milliseconds delay);
+
+  // Fetch client lists in the compact columnar format
+  void UseCompactClientLists(bool enabled);
+
+  // Start the client: listen, then register. The registry connection and
+  // the relay stream are set up while the server binds and registers.
   bool Start();
+
+  // Port the client listens on; the bound port once started
+  int32_t port() const { return client_port_; }
+
+  // How long the last successful Start() took to be serving and registered
+  std::chrono::microseconds startup_time() const { return startup_time_; }
   
-  // Send message to another client
-  bool SendMessageToClient(const std::string& target_client_id, const std::string& message);
+  // Send message to another client, queued in the receiver's lane for
+  // priority. With batching on, it waits out the linger alone; the
+  // asynchronous sends below let messages to one peer share a batch.
+  bool SendMessageToClient(const std::string& target_client_id,
+                           const std::string& message,
+                           helloworld::MessagePriority priority = helloworld::MESSAGE_PRIORITY_NORMAL);
+  
+  // Queue a send and return at once. Each peer has its own send queue,
+  // drained in call order by one of a fixed pool of send threads at a time.
+  // The receipt resolves once the peer acknowledges, or at once when the
+  // client already has the maximum number of sends outstanding or has been
+  // stopped and not started again.
+  std::future<DeliveryReceipt> SendMessageToClientAsync(
+      const std::string& target_client_id,
+      const std::string& message,
+      helloworld::MessagePriority priority = helloworld::MESSAGE_PRIORITY_NORMAL);
+  
+  // As above; the callback runs on a send thread, or on the calling thread
+  // for a send refused at once. It may stop the client.
+  void SendMessageToClientAsync(const std::string& target_client_id,
+                                const std::string& message,
+                                DeliveryCallback callback,
+                                helloworld::MessagePriority priority = helloworld::MESSAGE_PRIORITY_NORMAL);
+  
+  // Bound on asynchronous sends queued or in flight at once
+  void SetMaxOutstandingSends(size_t max_outstanding);
+  
+  // Depth and wait times of this client's mailbox lanes
+  std::vector<MailboxLaneStats> GetMailboxStats();
+  
+  // Send one message to many clients: targets are resolved in a single
+  // registry call, the message is serialized once and sent with at most
+  // max_in_flight RPCs outstanding. Each send spends a mailbox credit of its
+  // target like SendMessageToClient does. Results are in target order.
+  std::vector<SendResult> SendToMany(const std::vector<std::string>& target_client_ids,
+                                     const std::string& message,
+                                     size_t max_in_flight = kDefaultFanOutConcurrency);
   
   // Get list of available clients
-  std::vector<std::tuple<std::string, std::string, int32_t, bool>> GetAvailableClients();
+  std::vector<ClientEntry> GetAvailableClients();
+  
+  // Get clients whose labels match every selector
+  std::vector<ClientEntry> FindClients(const LabelSelectors& selectors);
+  
+  // Publish to a topic through the registry; returns subscribers reached or -1
+  int32_t PublishToTopic(const std::string& topic, const std::string& message);
+  
+  // Receive messages published to a topic; the callback runs on a
+  // per-subscription thread. Returns once the registry has the subscription,
+  // or false if it does not confirm within kSubscribeTimeout. A stream that
+  // ends later is opened again with backoff until unsubscribed.
+  bool SubscribeToTopic(const std::string& topic, TopicCallback callback);
+  
+  // Stop receiving messages for a topic
+  void UnsubscribeFromTopic(const std::string& topic);
   
   // Stop the client
   void Stop();
@@ -92,15 +718,147 @@ class Client {
  private:
   std::string client_id_;
   std::string client_address_;
+  const int32_t requested_port_;
   int32_t client_port_;
+  std::chrono::microseconds startup_time_{0};
+  ClientLabels labels_;
+  
+  const TlsOptions tls_;
+  const ChannelFactory channels_;
+  
+  PeerChannelCache peer_channels_{&channels_};
+  
+  // Message ids: sequences restart in a new, random epoch each time the client is created
+  const uint64_t sender_epoch_;
+  std::atomic<uint64_t> next_sequence_{1};
   
   std::unique_ptr<ClientRegistryClient> registry_client_;
   std::unique_ptr<ClientCommunicationServiceImpl> communication_service_;
+  std::unique_ptr<EncodedMessageService> encoded_service_;
+  std::shared_ptr<const MessageCodec> codec_;
+  // Peer addresses that do not serve codec_'s method
+  std::set<std::string> protobuf_only_peers_;
+  std::mutex protobuf_only_peers_mutex_;
   std::unique_ptr<grpc::Server> communication_server_;
   std::thread server_thread_;
   
+  std::string relay_address_;
+  std::unique_ptr<RelayClient> relay_client_;
+  
+  // Register, retrying unreachable-registry failures up to attempts times
+  // with jittered backoff; stops early (returning false) if asked to stop
+  bool RegisterWithBackoff(int attempts);
+  
+  // Re-registers after a registry restart and periodically checks the
+  // registration, from Start() until Stop()
+  RegistrationKeeper registration_;
+  
+  std::shared_ptr<Tracer> tracer_;
+  
+  // Credits each peer lane last advertised; -1 until its first reply
+  struct PeerCredits {
+    int32_t credits = -1;
+    std::chrono::steady_clock::time_point retry_at;
+  };
+  
+  // Take a credit for the message's target and lane, waiting or failing per
+  // backpressure_mode_
+  bool AcquireCredit(const helloworld::ClientMessage& message,
+                     std::chrono::steady_clock::time_point give_up);
+  void UpdateCredits(const helloworld::ClientMessage& message, const grpc::Status& status,
+                     const helloworld::MessageResponse& reply, std::chrono::milliseconds retry_after);
+  
+  std::atomic<BackpressureMode> backpressure_mode_{BackpressureMode::kFailFast};
+  std::atomic<bool> log_sends_{true};
+  std::map<std::pair<std::string, helloworld::MessagePriority>, PeerCredits> peer_credits_;
+  std::mutex credits_mutex_;
+  std::condition_variable credits_cv_;
+  
+  // With batching enabled, one long-lived batching client per peer address
+  std::shared_ptr<ClientCommunicationClient> BatchingClient(const std::string& target_full_address);
+  
+  bool batching_enabled_ = false;
+  BatchingOptions batching_options_;
+  std::map<std::string, std::shared_ptr<ClientCommunicationClient>> batching_clients_;
+  std::mutex batching_mutex_;
+  
+  struct OutgoingMessage {
+    std::string content;
+    helloworld::MessagePriority priority;
+  };
+  
+  // Send messages to one peer after a single lookup; results are in order.
+  // With batching on, every attempt starts before any is awaited, so the
+  // messages share batches.
+  std::vector<bool> SendMessagesToClient(const std::string& target_client_id,
+                                         const std::vector<OutgoingMessage>& messages);
+  
+  struct AsyncSend {
+    OutgoingMessage message;
+    std::chrono::steady_clock::time_point queued;
+    DeliveryCallback callback;
+  };
+  
+  // Asynchronous sends to one peer, erased once drained. While scheduled,
+  // the peer is waiting in ready_peers_ or being sent to by one worker.
+  struct PeerSendQueue {
+    std::deque<AsyncSend> sends;
+    bool scheduled = false;
+  };
+  
+  // Take ready peers in turn until stopping and none is left
+  void SendWorkerLoop();
+  
+  // Send the target's next message, or with batching on everything queued
+  // so far at once, then put the peer back in line if more are queued
+  void DrainSendQueue(const std::string& target_client_id);
+  
+  // Let every queued send finish, refuse new ones until ResumeSendWorkers,
+  // and join the send workers. On a send worker, as when a delivery callback
+  // stops the client, that worker is left to exit by itself and is joined
+  // later.
+  void StopSendWorkers();
+
+  // After a stop: join any worker it left behind, then accept sends again
+  void ResumeSendWorkers();
+
+  // The send workers other than the calling thread; send_queues_mutex_ held
+  std::vector<std::thread> TakeOtherSendWorkersLocked();
+  
+  std::map<std::string, PeerSendQueue> send_queues_;
+  std::deque<std::string> ready_peers_;
+  std::vector<std::thread> send_workers_;
+  bool send_workers_stopping_ = false;
+  size_t outstanding_sends_ = 0;
+  size_t max_outstanding_sends_ = kDefaultMaxOutstandingSends;
+  std::mutex send_queues_mutex_;
+  std::condition_variable send_queues_cv_;
+  
   bool running_;
   std::mutex running_mutex_;
+  
+  // Shared by a subscription's reader thread and whoever cancels it
+  struct SubscriptionState {
+    std::mutex mutex;
+    std::condition_variable cv;
+    // Context of the open stream, if any
+    grpc::ClientContext* context = nullptr;
+    bool cancelled = false;
+  };
+  struct TopicSubscription {
+    std::shared_ptr<SubscriptionState> state;
+    std::thread reader_thread;
+  };
+
+  // Reads a topic's stream, opening it again whenever it ends, until the
+  // state is cancelled. subscribed gets whether the first stream was
+  // confirmed; the loop exits if it was not.
+  void SubscriptionLoop(const std::string& topic, std::shared_ptr<SubscriptionState> state,
+                        TopicCallback callback, std::promise<bool> subscribed);
+
+  static void CancelSubscription(SubscriptionState* state);
+  std::map<std::string, TopicSubscription> subscriptions_;
+  std::mutex subscriptions_mutex_;
 };
 
 // Client server functions
@@ -0,0 +1,415 @@
+#include "client_host.h"
+
+#include <algorithm>
+#include <future>
+#include <iostream>
+#include <utility>
+
+namespace helloworld {
+
+namespace {
+
+// ClientCommunication for every id on a host: each call goes to the mailbox
+// of the id it is addressed to. Blob transfers are not hosted.
+class HostedCommunicationService final : public helloworld::ClientCommunication::Service {
+ public:
+  explicit HostedCommunicationService(MailboxResolver resolver) : resolver_(std::move(resolver)) {}
+
+  grpc::Status SendMessage(grpc::ServerContext* context,
+                           const helloworld::ClientMessage* request,
+                           helloworld::MessageResponse* reply) override {
+    std::shared_ptr<ClientCommunicationServiceImpl> mailbox = resolver_(request->to_client_id());
+    if (!mailbox) {
+      return NotHosted(request->to_client_id());
+    }
+    return mailbox->SendMessage(context, request, reply);
+  }
+
+  grpc::Status ReceiveMessage(grpc::ServerContext* context,
+                              const helloworld::MessageRequest* request,
+                              helloworld::ClientMessage* reply) override {
+    std::shared_ptr<ClientCommunicationServiceImpl> mailbox = resolver_(request->client_id());
+    if (!mailbox) {
+      return NotHosted(request->client_id());
+    }
+    return mailbox->ReceiveMessage(context, request, reply);
+  }
+
+  // A batch to one address may be for several ids: each id's messages are
+  // queued as one batch, and responses keep the request order
+  grpc::Status SendMessageBatch(grpc::ServerContext* context,
+                                const helloworld::ClientMessageBatch* request,
+                                helloworld::MessageBatchResponse* reply) override {
+    std::map<std::string_view, std::pair<helloworld::ClientMessageBatch, std::vector<int>>> by_client;
+    for (int i = 0; i < request->messages_size(); ++i) {
+      auto& [batch, positions] = by_client[request->messages(i).to_client_id()];
+      *batch.add_messages() = request->messages(i);
+      positions.push_back(i);
+    }
+
+    reply->mutable_responses()->Reserve(request->messages_size());
+    for (int i = 0; i < request->messages_size(); ++i) {
+      reply->add_responses();
+    }
+    for (const auto& [client_id, part] : by_client) {
+      const auto& [batch, positions] = part;
+      std::shared_ptr<ClientCommunicationServiceImpl> mailbox = resolver_(client_id);
+      if (!mailbox) {
+        for (int position : positions) {
+          reply->mutable_responses(position)->set_message("No client " + std::string(client_id) + " here");
+        }
+        continue;
+      }
+      helloworld::MessageBatchResponse part_reply;
+      grpc::Status status = mailbox->SendMessageBatch(context, &batch, &part_reply);
+      if (!status.ok()) {
+        return status;
+      }
+      for (size_t j = 0; j < positions.size(); ++j) {
+        *reply->mutable_responses(positions[j]) = std::move(*part_reply.mutable_responses(static_cast<int>(j)));
+      }
+      reply->set_retry_after_ms(std::max(reply->retry_after_ms(), part_reply.retry_after_ms()));
+    }
+    return grpc::Status::OK;
+  }
+
+ private:
+  static grpc::Status NotHosted(const std::string& client_id) {
+    return grpc::Status(grpc::StatusCode::NOT_FOUND, "No client " + client_id + " here");
+  }
+
+  MailboxResolver resolver_;
+};
+
+}  // namespace
+
+ClientHost::ClientHost(const std::string& registry_server_address,
+                       const std::string& host_address,
+                       int32_t port,
+                       const TlsOptions& tls)
+    : host_address_(host_address), requested_port_(port), port_(port), tls_(tls), channels_(tls),
+      sender_epoch_(NewSenderEpoch()) {
+  registry_client_ = std::make_unique<ClientRegistryClient>(
+      CreateRegistryChannel(registry_server_address, channels_));
+
+  // A restarted registry has lost every hosted id; register them again
+  registry_client_->SetRestartCallback([this] {
+    {
+      std::lock_guard<std::mutex> lock(registration_mutex_);
+      reregister_all_ = true;
+    }
+    registration_.RequestReregistration();
+  });
+
+  auto resolver = [this](std::string_view client_id) { return Mailbox(client_id); };
+  dispatch_service_ = std::make_unique<HostedCommunicationService>(resolver);
+  encoded_service_ = std::make_unique<EncodedMessageService>(resolver);
+}
+
+ClientHost::~ClientHost() {
+  // In-flight registry calls keep the epoch state, and its callback, alive
+  registry_client_->SetRestartCallback(nullptr);
+  Stop();
+}
+
+void ClientHost::SetMailboxCapacity(size_t capacity) {
+  mailbox_capacity_ = capacity;
+}
+
+bool ClientHost::Start() {
+  std::lock_guard<std::mutex> lock(running_mutex_);
+  if (running_) {
+    std::cout << "Client host is already running" << std::endl;
+    return false;
+  }
+
+  registry_client_->WarmUp();
+
+  std::shared_ptr<grpc::ServerCredentials> credentials = MakeServerCredentials(tls_);
+  if (!credentials || !channels_.ok()) {
+    std::cout << "Failed to load TLS credentials" << std::endl;
+    return false;
+  }
+
+  int bound_port = 0;
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort(host_address_ + ":" + std::to_string(requested_port_), credentials, &bound_port);
+  builder.RegisterService(dispatch_service_.get());
+  builder.RegisterCallbackGenericService(encoded_service_.get());
+  server_ = builder.BuildAndStart();
+  if (!server_ || bound_port == 0) {
+    std::cout << "Failed to start client host server" << std::endl;
+    server_.reset();
+    return false;
+  }
+  port_ = bound_port;
+
+  registration_.Start();
+
+  running_ = true;
+  std::cout << "Client host listening on " << host_address_ << ":" << port_ << std::endl;
+  return true;
+}
+
+std::shared_ptr<ClientHost::HostedClient> ClientHost::Find(std::string_view client_id) const {
+  std::shared_lock<std::shared_mutex> lock(clients_mutex_);
+  auto it = clients_.find(client_id);
+  return it == clients_.end() ? nullptr : it->second;
+}
+
+std::shared_ptr<ClientCommunicationServiceImpl> ClientHost::Mailbox(std::string_view client_id) const {
+  std::shared_ptr<HostedClient> client = Find(client_id);
+  return client ? client->mailbox : nullptr;
+}
+
+std::vector<std::string> ClientHost::Register(
+    const std::vector<std::pair<std::string, ClientLabels>>& clients) const {
+  std::vector<std::string> refused;
+  for (size_t start = 0; start < clients.size(); start += kHostRegistrationWindow) {
+    const size_t end = std::min(clients.size(), start + kHostRegistrationWindow);
+    std::vector<std::future<bool>> registered;
+    registered.reserve(end - start);
+    for (size_t i = start; i < end; ++i) {
+      registered.push_back(
+          registry_client_->RegisterClientAsync(clients[i].first, host_address_, port_, clients[i].second));
+    }
+    for (size_t i = start; i < end; ++i) {
+      if (!registered[i - start].get()) {
+        refused.push_back(clients[i].first);
+      }
+    }
+  }
+  return refused;
+}
+
+size_t ClientHost::AddClients(const std::vector<std::string>& client_ids, const ClientLabels& labels) {
+  {
+    std::lock_guard<std::mutex> lock(running_mutex_);
+    if (!running_) {
+      std::cout << "Client host is not running" << std::endl;
+      return 0;
+    }
+  }
+
+  // Mailboxes exist before the registry hands out their address
+  std::vector<std::pair<std::string, ClientLabels>> clients;
+  clients.reserve(client_ids.size());
+  {
+    std::unique_lock<std::shared_mutex> lock(clients_mutex_);
+    for (const auto& client_id : client_ids) {
+      std::shared_ptr<HostedClient>& client = clients_[client_id];
+      if (client) {
+        continue;
+      }
+      client = std::make_shared<HostedClient>();
+      client->mailbox = std::make_shared<ClientCommunicationServiceImpl>(mailbox_capacity_);
+      client->labels = labels;
+      clients.emplace_back(client_id, labels);
+    }
+  }
+
+  const std::vector<std::string> refused = Register(clients);
+  if (!refused.empty()) {
+    std::unique_lock<std::shared_mutex> lock(clients_mutex_);
+    for (const auto& client_id : refused) {
+      clients_.erase(client_id);
+    }
+  }
+  return clients.size() - refused.size();
+}
+
+bool ClientHost::AddClient(const std::string& client_id, const ClientLabels& labels) {
+  return AddClients({client_id}, labels) == 1;
+}
+
+bool ClientHost::RemoveClient(const std::string& client_id) {
+  {
+    std::unique_lock<std::shared_mutex> lock(clients_mutex_);
+    if (clients_.erase(client_id) == 0) {
+      return false;
+    }
+  }
+  return registry_client_->UnregisterClient(client_id);
+}
+
+size_t ClientHost::client_count() const {
+  std::shared_lock<std::shared_mutex> lock(clients_mutex_);
+  return clients_.size();
+}
+
+bool ClientHost::SendMessage(const std::string& from_client_id,
+                             const std::string& to_client_id,
+                             const std::string& message,
+                             helloworld::MessagePriority priority) {
+  std::shared_ptr<HostedClient> sender = Find(from_client_id);
+  if (!sender) {
+    std::cout << "Client " << from_client_id << " is not hosted here" << std::endl;
+    return false;
+  }
+
+  helloworld::ClientMessage request;
+  request.set_from_client_id(from_client_id);
+  request.set_to_client_id(to_client_id);
+  request.set_message_content(message);
+  request.set_timestamp(CurrentTimestamp());
+  request.set_sequence(sender->next_sequence++);
+  request.set_sender_epoch(sender_epoch_);
+  request.set_priority(priority);
+
+  if (std::shared_ptr<ClientCommunicationServiceImpl> local = Mailbox(to_client_id)) {
+    if (local->DeliverMessage(request) == DeliveryResult::kMailboxFull) {
+      std::cout << "Mailbox of " << to_client_id << " is full, try again later" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  std::string target_address;
+  int32_t target_port;
+  bool target_online;
+  if (!registry_client_->GetClient(to_client_id, target_address, target_port, target_online)) {
+    std::cout << "Failed to get target client info" << std::endl;
+    return false;
+  }
+  if (!target_online) {
+    std::cout << "Target client is not online" << std::endl;
+    return false;
+  }
+
+  ClientCommunicationClient target(peer_channels_.Get(target_address + ":" + std::to_string(target_port)));
+  helloworld::MessageResponse reply;
+  grpc::Status status = target.Send(request, &reply, std::chrono::system_clock::now() + kDirectSendTimeout);
+  if (status.ok() && reply.success()) {
+    return true;
+  }
+  std::cout << "Failed to send message: " << (status.ok() ? reply.message() : status.error_message())
+            << std::endl;
+  return false;
+}
+
+bool ClientHost::ReceiveMessage(const std::string& client_id, helloworld::ClientMessage* message) {
+  std::shared_ptr<ClientCommunicationServiceImpl> mailbox = Mailbox(client_id);
+  return mailbox && mailbox->TakeMessage(message);
+}
+
+bool ClientHost::RegistrationsMissing() {
+  std::string cursor;
+  {
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    if (!refused_ids_.empty()) {
+      return true;
+    }
+    cursor = probe_cursor_;
+  }
+
+  std::vector<std::string> probes;
+  {
+    std::shared_lock<std::shared_mutex> clients_lock(clients_mutex_);
+    auto it = clients_.upper_bound(cursor);
+    while (probes.size() < std::min(kHostRegistrationProbes, clients_.size())) {
+      if (it == clients_.end()) {
+        it = clients_.begin();
+      }
+      probes.push_back(it->first);
+      ++it;
+    }
+  }
+  if (probes.empty()) {
+    return false;
+  }
+
+  bool missing = false;
+  for (const std::string& probe : probes) {
+    bool registered = true;
+    if (registry_client_->IsRegistered(probe, &registered) && !registered) {
+      missing = true;
+      break;
+    }
+  }
+  std::lock_guard<std::mutex> lock(registration_mutex_);
+  probe_cursor_ = probes.back();
+  reregister_all_ = reregister_all_ || missing;
+  return missing;
+}
+
+void ClientHost::RegisterAll() {
+  bool all;
+  std::set<std::string> refused_before;
+  {
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    all = reregister_all_;
+    reregister_all_ = false;
+    refused_before.swap(refused_ids_);
+  }
+
+  std::vector<std::pair<std::string, ClientLabels>> clients;
+  {
+    std::shared_lock<std::shared_mutex> clients_lock(clients_mutex_);
+    for (const auto& [client_id, client] : clients_) {
+      if (all || refused_before.count(client_id) > 0) {
+        clients.emplace_back(client_id, client->labels);
+      }
+    }
+  }
+  std::cout << "Registering " << clients.size() << " hosted clients again with the registry" << std::endl;
+
+  std::chrono::milliseconds backoff = kRegistrationInitialBackoff;
+  for (int attempt = 1; !clients.empty(); ++attempt) {
+    const std::vector<std::string> refused = Register(clients);
+    const std::set<std::string> refused_set(refused.begin(), refused.end());
+    clients.erase(std::remove_if(clients.begin(), clients.end(),
+                                 [&refused_set](const auto& client) { return refused_set.count(client.first) == 0; }),
+                  clients.end());
+    if (clients.empty() || attempt >= kReregistrationAttempts ||
+        registration_.WaitUnlessStopping(RandomDelay(backoff))) {
+      break;
+    }
+    backoff = std::min(backoff * 2, kRegistrationMaxBackoff);
+  }
+
+  if (!clients.empty()) {
+    std::cout << clients.size() << " hosted clients could not be registered again; retrying on the next check"
+              << std::endl;
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    for (const auto& client : clients) {
+      refused_ids_.insert(client.first);
+    }
+  }
+}
+
+void ClientHost::Stop() {
+  std::lock_guard<std::mutex> lock(running_mutex_);
+  if (!running_) {
+    return;
+  }
+
+  registration_.Stop();
+
+  std::vector<std::string> client_ids;
+  {
+    std::unique_lock<std::shared_mutex> clients_lock(clients_mutex_);
+    for (const auto& [client_id, client] : clients_) {
+      client_ids.push_back(client_id);
+    }
+    clients_.clear();
+  }
+  for (size_t start = 0; start < client_ids.size(); start += kHostRegistrationWindow) {
+    const size_t end = std::min(client_ids.size(), start + kHostRegistrationWindow);
+    std::vector<std::future<bool>> unregistered;
+    for (size_t i = start; i < end; ++i) {
+      unregistered.push_back(registry_client_->UnregisterClientAsync(client_ids[i]));
+    }
+    for (auto& done : unregistered) {
+      done.wait();
+    }
+  }
+
+  peer_channels_.Clear();
+  server_->Shutdown();
+  server_.reset();
+
+  running_ = false;
+  std::cout << "Client host stopped" << std::endl;
+}
+
+}  // namespace helloworld
@@ -0,0 +1,140 @@
+#ifndef HELLOWORLD_CLIENT_HOST_H
+#define HELLOWORLD_CLIENT_HOST_H
+
+#include <grpcpp/grpcpp.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "client.h"
+#include "client_support.h"
+#include "common/tls.h"
+#include "proto/helloworld.grpc.pb.h"
+
+namespace helloworld {
+
+// Registrations in flight at once while adding or re-registering clients
+constexpr size_t kHostRegistrationWindow = 256;
+
+// Hosted ids checked with the registry on each periodic check, taken in
+// turn so every id is checked over time
+constexpr size_t kHostRegistrationProbes = 4;
+
+// Many client ids served by one process: one listener, one registry
+// connection and one sender epoch shared by all of them. Incoming messages
+// are dispatched to each id's own mailbox by to_client_id, and messages
+// between ids on the same host never leave the process.
+class ClientHost {
+ public:
+  ClientHost(const std::string& registry_server_address,
+             const std::string& host_address,
+             int32_t port,
+             const TlsOptions& tls = TlsOptions());
+  ~ClientHost();
+
+  // Bound on each mailbox created afterwards
+  void SetMailboxCapacity(size_t capacity);
+
+  // Listen; port 0 picks a free one. Clients are added once started.
+  bool Start();
+
+  // Port the host listens on; the bound port once started
+  int32_t port() const { return port_; }
+
+  // Host and register the ids, with up to kHostRegistrationWindow
+  // registrations in flight on the registry connection. Ids already hosted
+  // are skipped and ids the registry refuses are dropped again. Returns how
+  // many were added.
+  size_t AddClients(const std::vector<std::string>& client_ids, const ClientLabels& labels = {});
+  bool AddClient(const std::string& client_id, const ClientLabels& labels = {});
+
+  // Unregister an id and drop its mailbox
+  bool RemoveClient(const std::string& client_id);
+
+  size_t client_count() const;
+
+  // Send as from_client_id. A hosted target gets the message straight in
+  // its mailbox; any other is looked up and sent to over a cached channel.
+  bool SendMessage(const std::string& from_client_id,
+                   const std::string& to_client_id,
+                   const std::string& message,
+                   helloworld::MessagePriority priority = helloworld::MESSAGE_PRIORITY_NORMAL);
+
+  // Next message for a hosted id by lane weight; false if there is none
+  bool ReceiveMessage(const std::string& client_id, helloworld::ClientMessage* message);
+
+  // Unregister every id and stop listening
+  void Stop();
+
+ private:
+  struct HostedClient {
+    std::shared_ptr<ClientCommunicationServiceImpl> mailbox;
+    ClientLabels labels;
+    std::atomic<uint64_t> next_sequence{1};
+  };
+
+  // nullptr if the id is not hosted here
+  std::shared_ptr<HostedClient> Find(std::string_view client_id) const;
+  std::shared_ptr<ClientCommunicationServiceImpl> Mailbox(std::string_view client_id) const;
+
+  // Register each id with its labels; returns the ids the registry refused
+  std::vector<std::string> Register(const std::vector<std::pair<std::string, ClientLabels>>& clients) const;
+
+  // True while ids the registry refused wait to be retried, or if one of
+  // the next kHostRegistrationProbes ids is missing from the registry, which
+  // means it lost all of them
+  bool RegistrationsMissing();
+
+  // Register every hosted id again after a registry restart, or else only
+  // the ids refused before. Refused ids are retried with full-jitter
+  // backoff, up to kReregistrationAttempts passes; any still refused are
+  // kept for the next check.
+  void RegisterAll();
+
+  const std::string host_address_;
+  const int32_t requested_port_;
+  int32_t port_;
+  const TlsOptions tls_;
+  const ChannelFactory channels_;
+  const uint64_t sender_epoch_;
+  size_t mailbox_capacity_ = kDefaultMailboxCapacity;
+
+  std::unique_ptr<ClientRegistryClient> registry_client_;
+  std::unique_ptr<helloworld::ClientCommunication::Service> dispatch_service_;
+  std::unique_ptr<EncodedMessageService> encoded_service_;
+  std::unique_ptr<grpc::Server> server_;
+
+  // Looked up on every incoming message; changed only to add or remove ids
+  std::map<std::string, std::shared_ptr<HostedClient>, std::less<>> clients_;
+  mutable std::shared_mutex clients_mutex_;
+
+  PeerChannelCache peer_channels_{&channels_};
+
+  // Registers every id again after a registry restart, and periodically
+  // checks that the registry still has them, until Stop()
+  RegistrationKeeper registration_{[this] { return RegistrationsMissing(); }, [this] { RegisterAll(); }};
+
+  // The registry lost the hosted ids, so all of them register again
+  bool reregister_all_ = false;
+  // Hosted ids the registry refused on the last pass
+  std::set<std::string> refused_ids_;
+  // Last id probed; the next probes follow it
+  std::string probe_cursor_;
+  std::mutex registration_mutex_;
+
+  bool running_ = false;
+  std::mutex running_mutex_;
+};
+
+}  // namespace helloworld
+
+#endif  // HELLOWORLD_CLIENT_HOST_H
@@ -0,0 +1,22 @@
+#include "client_list.h"
+
+namespace helloworld {
+
+CompactClientListReader::CompactClientListReader(const helloworld::CompactClientList& list) : list_(list) {
+  const int count = list.id_lengths_size();
+  if (list.address_refs_size() != count || list.port_deltas_size() != count ||
+      list.online().size() != (static_cast<size_t>(count) + 7) / 8) {
+    return;
+  }
+
+  uint64_t id_bytes = 0;
+  for (int i = 0; i < count; ++i) {
+    id_bytes += list.id_lengths(i);
+    if (list.address_refs(i) >= static_cast<uint32_t>(list.addresses_size())) {
+      return;
+    }
+  }
+  ok_ = id_bytes == list.client_ids().size();
+}
+
+}  // namespace helloworld
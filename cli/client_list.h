@@ -0,0 +1,76 @@
+#ifndef HELLOWORLD_CLIENT_LIST_H
+#define HELLOWORLD_CLIENT_LIST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "proto/helloworld.pb.h"
+
+namespace helloworld {
+
+// A client listed by the registry, read in place from the reply; valid as
+// long as the reply is
+struct ListedClient {
+  std::string_view client_id;
+  std::string_view address;
+  int32_t port = 0;
+  bool online = false;
+};
+
+// Reads a CompactClientList without copying it: ids and addresses are
+// views into the message and ports are summed from their deltas while the
+// entries are visited, so no entry allocates.
+class CompactClientListReader {
+ public:
+  // Checks every column against the others once, up front
+  explicit CompactClientListReader(const helloworld::CompactClientList& list);
+
+  // False if the columns disagree in length or refer outside the list
+  bool ok() const { return ok_; }
+
+  size_t size() const { return ok_ ? static_cast<size_t>(list_.id_lengths_size()) : 0; }
+
+  // Visit every client in list order; nothing if !ok()
+  template <typename Visitor>
+  void ForEach(Visitor visit) const {
+    const std::string& client_ids = list_.client_ids();
+    const std::string& online = list_.online();
+    size_t id_offset = 0;
+    uint32_t port = 0;
+    for (size_t i = 0; i < size(); ++i) {
+      const int index = static_cast<int>(i);
+      ListedClient client;
+      client.client_id = std::string_view(client_ids.data() + id_offset, list_.id_lengths(index));
+      id_offset += list_.id_lengths(index);
+      client.address = list_.addresses(static_cast<int>(list_.address_refs(index)));
+      port += static_cast<uint32_t>(list_.port_deltas(index));
+      client.port = static_cast<int32_t>(port);
+      client.online = (static_cast<uint8_t>(online[i / 8]) >> (i % 8)) & 1;
+      visit(client);
+    }
+  }
+
+ private:
+  const helloworld::CompactClientList& list_;
+  bool ok_ = false;
+};
+
+// Visit every client of a ListClients reply in whichever form it came.
+// False, visiting nothing, if a compact list is malformed.
+template <typename Visitor>
+bool ForEachListedClient(const helloworld::ClientList& list, Visitor visit) {
+  if (!list.has_compact()) {
+    for (const auto& info : list.clients()) {
+      visit(ListedClient{info.client_id(), info.client_address(), info.client_port(), info.online()});
+    }
+    return true;
+  }
+  CompactClientListReader reader(list.compact());
+  reader.ForEach(visit);
+  return reader.ok();
+}
+
+}  // namespace helloworld
+
+#endif  // HELLOWORLD_CLIENT_LIST_H
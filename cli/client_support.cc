@@ -0,0 +1,113 @@
+#include "client_support.h"
+
+#include <random>
+
+namespace helloworld {
+
+std::string CurrentTimestamp() {
+  auto now = std::chrono::system_clock::now();
+  return std::to_string(std::chrono::system_clock::to_time_t(now));
+}
+
+std::chrono::milliseconds RandomDelay(std::chrono::milliseconds bound) {
+  thread_local std::mt19937_64 generator(std::random_device{}());
+  return std::chrono::milliseconds(std::uniform_int_distribution<int64_t>(0, bound.count())(generator));
+}
+
+uint64_t NewSenderEpoch() {
+  std::mt19937_64 generator(std::random_device{}());
+  return std::uniform_int_distribution<uint64_t>(1)(generator);
+}
+
+std::shared_ptr<grpc::Channel> PeerChannelCache::Get(const std::string& target_full_address) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = peer_channels_.find(target_full_address);
+  if (it != peer_channels_.end()) {
+    recency_.splice(recency_.begin(), recency_, it->second);
+    return it->second->second;
+  }
+  if (peer_channels_.size() >= kMaxPeerChannels) {
+    peer_channels_.erase(recency_.back().first);
+    recency_.pop_back();
+  }
+  std::shared_ptr<grpc::Channel> channel = channels_->Create(target_full_address);
+  recency_.emplace_front(target_full_address, channel);
+  peer_channels_.emplace(target_full_address, recency_.begin());
+  return channel;
+}
+
+void PeerChannelCache::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  peer_channels_.clear();
+  recency_.clear();
+}
+
+RegistrationKeeper::RegistrationKeeper(std::function<bool()> missing, std::function<void()> reregister)
+    : missing_(std::move(missing)), reregister_(std::move(reregister)) {}
+
+RegistrationKeeper::~RegistrationKeeper() {
+  Stop();
+}
+
+void RegistrationKeeper::Start() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    reregister_requested_ = false;
+  }
+  thread_ = std::thread(&RegistrationKeeper::Loop, this);
+}
+
+void RegistrationKeeper::RequestReregistration() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  reregister_requested_ = true;
+  cv_.notify_all();
+}
+
+bool RegistrationKeeper::WaitUnlessStopping(std::chrono::milliseconds delay) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return cv_.wait_for(lock, delay, [this] { return stopping_; });
+}
+
+void RegistrationKeeper::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  stopping_ = false;
+}
+
+void RegistrationKeeper::Loop() {
+  auto wake = [this] { return stopping_ || reregister_requested_; };
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopping_) {
+    // Replies from the registry reveal a restart; an idle client finds out
+    // from this periodic check of its own registration instead
+    const auto check_at = std::chrono::steady_clock::now() + kRegistrationCheckInterval / 2 +
+                          RandomDelay(kRegistrationCheckInterval);
+    if (!cv_.wait_until(lock, check_at, wake)) {
+      lock.unlock();
+      const bool missing = missing_();
+      lock.lock();
+      reregister_requested_ = reregister_requested_ || missing;
+    }
+    if (stopping_ || !reregister_requested_) {
+      continue;
+    }
+
+    // Clients that saw the same restart spread their registrations out
+    reregister_requested_ = false;
+    if (cv_.wait_for(lock, RandomDelay(kReregistrationSpread), [this] { return stopping_; })) {
+      break;
+    }
+    lock.unlock();
+    reregister_();
+    lock.lock();
+  }
+}
+
+}  // namespace helloworld
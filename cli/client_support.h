@@ -0,0 +1,105 @@
+#ifndef HELLOWORLD_CLIENT_SUPPORT_H
+#define HELLOWORLD_CLIENT_SUPPORT_H
+
+#include <grpcpp/grpcpp.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include "common/tls.h"
+
+namespace helloworld {
+
+// Peer channels a client keeps open for reuse
+constexpr size_t kMaxPeerChannels = 256;
+
+// Registration attempts made by Start() and after a registry restart, with
+// full-jitter exponential backoff between them
+constexpr int kStartRegistrationAttempts = 5;
+constexpr int kReregistrationAttempts = 8;
+constexpr std::chrono::milliseconds kRegistrationInitialBackoff(200);
+constexpr std::chrono::milliseconds kRegistrationMaxBackoff(30000);
+
+// Once a registry restart is seen, each client re-registers after a random
+// delay up to this long, so they do not all arrive at the same moment
+constexpr std::chrono::milliseconds kReregistrationSpread(5000);
+
+// How often a client checks it is still registered, jittered by half
+constexpr std::chrono::milliseconds kRegistrationCheckInterval(30000);
+
+// Seconds since the epoch, as stored in ClientMessage.timestamp
+std::string CurrentTimestamp();
+
+// Uniformly random delay up to bound; full jitter spreads out clients that
+// would otherwise retry in step
+std::chrono::milliseconds RandomDelay(std::chrono::milliseconds bound);
+
+// Random, nonzero epoch for a new sender. Not derived from the clock, so a
+// clock stepped back cannot make a restarted sender look like an old one.
+uint64_t NewSenderEpoch();
+
+// One channel per peer address, reused across sends so connections (and
+// TLS sessions) are set up once. Beyond kMaxPeerChannels the least recently
+// used one is dropped; sends using it keep their reference.
+class PeerChannelCache {
+ public:
+  // channels must outlive the cache
+  explicit PeerChannelCache(const ChannelFactory* channels) : channels_(channels) {}
+
+  std::shared_ptr<grpc::Channel> Get(const std::string& target_full_address);
+
+  void Clear();
+
+ private:
+  using Entry = std::pair<std::string, std::shared_ptr<grpc::Channel>>;
+
+  const ChannelFactory* channels_;
+  // Most recently used first
+  std::list<Entry> recency_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> peer_channels_;
+  std::mutex mutex_;
+};
+
+// Keeps registrations alive after a registry restart. Once one is reported,
+// or the periodic check finds the registration missing, it waits a random
+// spread and registers again, until Stop().
+class RegistrationKeeper {
+ public:
+  // missing asks the registry whether the registration is gone; register
+  // registers again. Both run on the keeper's thread.
+  RegistrationKeeper(std::function<bool()> missing, std::function<void()> reregister);
+  ~RegistrationKeeper();
+
+  void Start();
+
+  // From the registry client's restart callback
+  void RequestReregistration();
+
+  // Sleep for delay; true, at once, if the keeper is stopping
+  bool WaitUnlessStopping(std::chrono::milliseconds delay);
+
+  // Interrupt any wait and join the thread; Start() may be called again
+  void Stop();
+
+ private:
+  void Loop();
+
+  const std::function<bool()> missing_;
+  const std::function<void()> reregister_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool reregister_requested_ = false;
+  bool stopping_ = false;
+};
+
+}  // namespace helloworld
+
+#endif  // HELLOWORLD_CLIENT_SUPPORT_H
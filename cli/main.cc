@@ -1,25 +1,75 @@
+#include "batch_runner.h"
 #include "client.h"
 
 #include <grpcpp/grpcpp.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 #include <iostream>
 #include <string>
-#include <thread>
 #include <vector>
 #include <sstream>
 
 void print_usage(const char* program_name) {
   std::cout << "Usage: " << program_name << " [options]\n";
   std::cout << "Options:\n";
-  std::cout << "  -s <server_address>    Registry server address (default: localhost:50051)\n";
+  std::cout << "  -s <server_address>    Registry server address, or a comma-separated list of\n";
+  std::cout << "                         endpoints; only the first is used without -e (default: localhost:50051)\n";
+  std::cout << "  -e                     The -s endpoints are replicas of one registry: balance reads\n";
+  std::cout << "                         and fail over across them\n";
   std::cout << "  -i <client_id>          Client ID (required)\n";
   std::cout << "  -a <client_address>    Client listening address (default: localhost)\n";
-  std::cout << "  -p <client_port>        Client listening port (default: 50052)\n";
+  std::cout << "  -p <client_port>        Client listening port, 0 for any free port (default: 50052)\n";
   std::cout << "  -u <target_client_id>   Target client ID for message\n";
   std::cout << "  -m <message>            Message to send to target client\n";
   std::cout << "  -l                     List available clients\n";
+  std::cout << "  -z                     Fetch client lists in the compact columnar format\n";
+  std::cout << "  -r <relay_address>     Relay for peers that cannot be dialed directly\n";
+  std::cout << "  -L <key=value>         Register with a label (repeatable)\n";
+  std::cout << "  -t <timeout_ms>        Deadline for registry calls (default: 5000)\n";
+  std::cout << "  -b <policy>            Registry read balancing: round_robin or latency (default: round_robin)\n";
+  std::cout << "  -H <delay_ms>          Hedge lookups to the next registry endpoint after this delay\n";
+  std::cout << "  -q <capacity>          Messages this client's mailbox holds across its lanes (default: 1024)\n";
+  std::cout << "  -B                     Wait for a full peer mailbox instead of failing the send\n";
+  std::cout << "  -C <linger_ms>         Coalesce messages to the same peer for up to this long\n";
+  std::cout << "  -D <blob_dir>          Directory files sent to this client are stored in\n";
+  std::cout << "  -P <priority>          Priority of sent messages: high, normal or bulk (default: normal)\n";
+  std::cout << "  -w <codec>             Wire encoding of direct messages: protobuf or flat (default: protobuf)\n";
+  std::cout << "  -T <trace_file>        Record send traces to this file (Chrome trace event JSON)\n";
+  std::cout << "  -R <sample_rate>       Fraction of sends traced, 0 to 1 (default: 1)\n";
+  std::cout << "  -x <command_file>      Run the send commands in this file (- for stdin) and print\n";
+  std::cout << "                         throughput, latency and failure statistics\n";
+  std::cout << "  -j <in_flight>         Sends in flight at once with -x (default: 16)\n";
+  std::cout << "  -A <ca_file>           Use TLS, trusting certificates signed by this CA (PEM)\n";
+  std::cout << "  -c <cert_file>         TLS certificate chain to serve with and present (PEM)\n";
+  std::cout << "  -k <key_file>          Private key of the TLS certificate (PEM)\n";
+  std::cout << "  -M                     Require peers to present a certificate (mTLS)\n";
+  std::cout << "  -O <name>              Name expected in server certificates instead of the host\n";
   std::cout << "  -h                     Show this help message\n";
 }
 
+// Runs the send commands read from input with up to in_flight sends
+// outstanding, then prints throughput, latency and failure statistics.
+// Blank lines and lines starting with # are ignored; other commands are
+// counted as skipped.
+void RunBatch(helloworld::Client& client, std::istream& input, size_t in_flight,
+              helloworld::MessagePriority priority) {
+  // A line per send would swamp the summary; received messages still show
+  client.SetSendLogging(false);
+  const helloworld::BatchStats stats =
+      helloworld::RunBatch(input, in_flight, [&](const std::string& destination, const std::string& message) {
+        return client.SendMessageToClient(destination, message, priority);
+      });
+  client.SetSendLogging(true);
+  
+  std::cout << "Batch: " << stats.sent << " sends in " << stats.seconds << " s, "
+            << (stats.sent - stats.failed) / stats.seconds << " msgs/s delivered, " << stats.failed
+            << " failed, " << stats.skipped << " skipped" << std::endl;
+  std::cout << "Latency: p50 " << stats.Percentile(0.50) << " ms, p90 " << stats.Percentile(0.90)
+            << " ms, p99 " << stats.Percentile(0.99) << " ms, max " << stats.Percentile(1.0) << " ms"
+            << std::endl;
+}
+
 int main(const int argc, const char* const argv[]) {
   std::string registry_server_address = "localhost:50051";
   std::string client_address = "localhost";
@@ -28,6 +78,24 @@ int main(const int argc, const char* const argv[]) {
   std::string target_client_id = "";
   std::string message = "";
   bool list_clients = false;
+  bool compact_lists = false;
+  std::string relay_address = "";
+  helloworld::ClientLabels labels;
+  helloworld::RegistryCallTimeouts registry_timeouts;
+  helloworld::RegistryBalancing registry_balancing = helloworld::RegistryBalancing::kRoundRobin;
+  bool registry_replicas = false;
+  std::chrono::milliseconds hedge_delay(0);
+  size_t mailbox_capacity = helloworld::kDefaultMailboxCapacity;
+  helloworld::BackpressureMode backpressure_mode = helloworld::BackpressureMode::kFailFast;
+  std::chrono::milliseconds batch_linger(0);
+  std::string blob_directory = "";
+  helloworld::MessagePriority priority = helloworld::MESSAGE_PRIORITY_NORMAL;
+  std::shared_ptr<const helloworld::MessageCodec> codec;
+  std::string trace_file = "";
+  double trace_sample_rate = 1.0;
+  std::string batch_file = "";
+  size_t batch_in_flight = 16;
+  helloworld::TlsOptions tls;
   
   // Parse command line arguments
   for (int i = 1; i < argc; i++) {
@@ -47,6 +115,82 @@ int main(const int argc, const char* const argv[]) {
       message = argv[++i];
     } else if (arg == "-l") {
       list_clients = true;
+    } else if (arg == "-z") {
+      compact_lists = true;
+    } else if (arg == "-r" && i + 1 < argc) {
+      relay_address = argv[++i];
+    } else if (arg == "-L" && i + 1 < argc) {
+      std::string label = argv[++i];
+      size_t separator = label.find('=');
+      if (separator == std::string::npos || separator == 0) {
+        std::cout << "Labels must be key=value: " << label << std::endl;
+        return 1;
+      }
+      labels[label.substr(0, separator)] = label.substr(separator + 1);
+    } else if (arg == "-b" && i + 1 < argc) {
+      std::string policy = argv[++i];
+      if (policy == "latency") {
+        registry_balancing = helloworld::RegistryBalancing::kLowestLatency;
+      } else if (policy != "round_robin") {
+        std::cout << "Unknown balancing policy: " << policy << std::endl;
+        return 1;
+      }
+    } else if (arg == "-e") {
+      registry_replicas = true;
+    } else if (arg == "-H" && i + 1 < argc) {
+      hedge_delay = std::chrono::milliseconds(std::stoi(argv[++i]));
+    } else if (arg == "-t" && i + 1 < argc) {
+      const std::chrono::milliseconds timeout(std::stoi(argv[++i]));
+      registry_timeouts.register_client = timeout;
+      registry_timeouts.get_client = timeout;
+      registry_timeouts.get_clients = timeout;
+      registry_timeouts.list_clients = timeout;
+      registry_timeouts.query_clients = timeout;
+      registry_timeouts.unregister_client = timeout;
+      registry_timeouts.publish = timeout;
+    } else if (arg == "-q" && i + 1 < argc) {
+      mailbox_capacity = std::stoul(argv[++i]);
+    } else if (arg == "-B") {
+      backpressure_mode = helloworld::BackpressureMode::kBlock;
+    } else if (arg == "-C" && i + 1 < argc) {
+      batch_linger = std::chrono::milliseconds(std::stoi(argv[++i]));
+    } else if (arg == "-D" && i + 1 < argc) {
+      blob_directory = argv[++i];
+    } else if (arg == "-P" && i + 1 < argc) {
+      std::string name = argv[++i];
+      if (name == "high") {
+        priority = helloworld::MESSAGE_PRIORITY_HIGH;
+      } else if (name == "bulk") {
+        priority = helloworld::MESSAGE_PRIORITY_BULK;
+      } else if (name != "normal") {
+        std::cout << "Unknown priority: " << name << std::endl;
+        return 1;
+      }
+    } else if (arg == "-w" && i + 1 < argc) {
+      std::string name = argv[++i];
+      codec = helloworld::MakeMessageCodec(name);
+      if (!codec) {
+        std::cout << "Unknown codec: " << name << std::endl;
+        return 1;
+      }
+    } else if (arg == "-T" && i + 1 < argc) {
+      trace_file = argv[++i];
+    } else if (arg == "-R" && i + 1 < argc) {
+      trace_sample_rate = std::stod(argv[++i]);
+    } else if (arg == "-x" && i + 1 < argc) {
+      batch_file = argv[++i];
+    } else if (arg == "-j" && i + 1 < argc) {
+      batch_in_flight = std::max<size_t>(std::stoul(argv[++i]), 1);
+    } else if (arg == "-A" && i + 1 < argc) {
+      tls.ca_file = argv[++i];
+    } else if (arg == "-c" && i + 1 < argc) {
+      tls.cert_file = argv[++i];
+    } else if (arg == "-k" && i + 1 < argc) {
+      tls.key_file = argv[++i];
+    } else if (arg == "-M") {
+      tls.require_client_cert = true;
+    } else if (arg == "-O" && i + 1 < argc) {
+      tls.server_name_override = argv[++i];
     } else if (arg == "-h") {
       print_usage(argv[0]);
       return 0;
@@ -69,8 +213,46 @@ int main(const int argc, const char* const argv[]) {
   std::cout << "Client ID: " << client_id << std::endl;
   std::cout << "Client Address: " << client_address << ":" << client_port << std::endl;
   
+  std::vector<std::string> registry_server_addresses;
+  std::istringstream address_stream(registry_server_address);
+  std::string address;
+  while (std::getline(address_stream, address, ',')) {
+    if (!address.empty()) {
+      registry_server_addresses.push_back(address);
+    }
+  }
+  if (registry_server_addresses.empty()) {
+    std::cout << "Error: Registry server address is required (-s)" << std::endl;
+    return 1;
+  }
+  
   // Create and start client
-  helloworld::Client client(registry_server_address, client_id, client_address, client_port);
+  helloworld::Client client(registry_server_addresses, client_id, client_address, client_port, tls);
+  if (!relay_address.empty()) {
+    client.EnableRelay(relay_address);
+  }
+  client.SetLabels(labels);
+  client.SetRegistryCallTimeouts(registry_timeouts);
+  client.SetRegistryReplicas(registry_replicas);
+  client.SetRegistryBalancing(registry_balancing);
+  client.EnableHedgedRegistryLookups(hedge_delay);
+  client.UseCompactClientLists(compact_lists);
+  client.SetMailboxCapacity(mailbox_capacity);
+  client.SetBackpressureMode(backpressure_mode);
+  if (codec) {
+    client.SetMessageCodec(codec);
+  }
+  if (!blob_directory.empty()) {
+    client.SetBlobDirectory(blob_directory);
+  }
+  if (batch_linger.count() > 0) {
+    helloworld::BatchingOptions batching;
+    batching.linger = batch_linger;
+    client.EnableMessageBatching(batching);
+  }
+  if (!trace_file.empty() && !client.EnableTracing(trace_file, trace_sample_rate)) {
+    return 1;
+  }
   
   if (!client.Start()) {
     std::cout << "Failed to start client!" << std::endl;
@@ -89,18 +271,37 @@ int main(const int argc, const char* const argv[]) {
   
   if (!target_client_id.empty() && !message.empty()) {
     std::cout << "\nSending message to " << target_client_id << ": " << message << std::endl;
-    if (client.SendMessageToClient(target_client_id, message)) {
+    if (client.SendMessageToClient(target_client_id, message, priority)) {
       std::cout << "Message sent successfully!" << std::endl;
     } else {
       std::cout << "Failed to send message!" << std::endl;
     }
   }
   
-  if (!list_clients && target_client_id.empty()) {
+  if (!batch_file.empty()) {
+    if (batch_file == "-") {
+      RunBatch(client, std::cin, batch_in_flight, priority);
+    } else {
+      std::ifstream commands(batch_file);
+      if (!commands) {
+        std::cout << "Cannot open " << batch_file << std::endl;
+        client.Stop();
+        return 1;
+      }
+      RunBatch(client, commands, batch_in_flight, priority);
+    }
+  } else if (!list_clients && target_client_id.empty()) {
     std::cout << "\nClient is running and listening for messages..." << std::endl;
     std::cout << "Available commands:" << std::endl;
     std::cout << "  send <destination> <message>  - Send message to another client" << std::endl;
+    std::cout << "  sendmany <d1,d2,...> <message> - Send message to several clients" << std::endl;
+    std::cout << "  sendfile <destination> <path> - Send a file as a resumable transfer" << std::endl;
     std::cout << "  list                         - List available clients" << std::endl;
+    std::cout << "  find <key=v1,v2> ...         - List clients matching every label" << std::endl;
+    std::cout << "  publish <topic> <message>    - Publish message to a topic" << std::endl;
+    std::cout << "  subscribe <topic>            - Print messages published to a topic" << std::endl;
+    std::cout << "  unsubscribe <topic>          - Stop printing messages for a topic" << std::endl;
+    std::cout << "  stats                        - Show mailbox lane depths and wait times" << std::endl;
     std::cout << "  help                         - Show this help" << std::endl;
     std::cout << "  quit                         - Exit client" << std::endl;
     std::cout << "Type commands and press Enter:" << std::endl;
@@ -136,11 +337,104 @@ int main(const int argc, const char* const argv[]) {
           continue;
         }
         
+        // Report the receipt when it arrives instead of blocking the prompt
         std::cout << "Sending message to " << destination << ": " << message << std::endl;
-        if (client.SendMessageToClient(destination, message)) {
-          std::cout << "Message sent successfully!" << std::endl;
+        client.SendMessageToClientAsync(destination, message, [](const helloworld::DeliveryReceipt& receipt) {
+          if (receipt.delivered) {
+            std::cout << "Message to " << receipt.target_client_id << " delivered in "
+                      << receipt.latency.count() / 1000.0 << " ms" << std::endl;
+          } else {
+            std::cout << "Failed to send message to " << receipt.target_client_id << "!" << std::endl;
+          }
+        }, priority);
+        
+      } else if (command == "sendfile") {
+        std::string destination, path;
+        iss >> destination >> path;
+        
+        if (destination.empty() || path.empty()) {
+          std::cout << "Usage: sendfile <destination> <path>" << std::endl;
+          continue;
+        }
+        
+        if (!client.SendFileToClient(destination, path)) {
+          std::cout << "Failed to send file!" << std::endl;
+        }
+        
+      } else if (command == "sendmany") {
+        std::string destinations, message;
+        iss >> destinations;
+        
+        std::string remaining;
+        std::getline(iss, remaining);
+        if (!remaining.empty() && remaining[0] == ' ') {
+          message = remaining.substr(1);
+        }
+        
+        std::vector<std::string> targets;
+        std::istringstream destination_stream(destinations);
+        std::string target;
+        while (std::getline(destination_stream, target, ',')) {
+          if (!target.empty()) {
+            targets.push_back(target);
+          }
+        }
+        
+        if (targets.empty() || message.empty()) {
+          std::cout << "Usage: sendmany <d1,d2,...> <message>" << std::endl;
+          continue;
+        }
+        
+        std::cout << "Sending message to " << targets.size() << " clients: " << message << std::endl;
+        size_t delivered = 0;
+        for (const auto& result : client.SendToMany(targets, message)) {
+          if (result.success) {
+            ++delivered;
+          } else {
+            std::cout << "  " << result.target_client_id << ": " << result.error << std::endl;
+          }
+        }
+        std::cout << "Delivered to " << delivered << "/" << targets.size() << " clients" << std::endl;
+        
+      } else if (command == "publish") {
+        std::string topic, message;
+        iss >> topic;
+        
+        std::string remaining;
+        std::getline(iss, remaining);
+        if (!remaining.empty() && remaining[0] == ' ') {
+          message = remaining.substr(1);
+        }
+        
+        if (topic.empty() || message.empty()) {
+          std::cout << "Usage: publish <topic> <message>" << std::endl;
+          continue;
+        }
+        
+        int32_t subscribers = client.PublishToTopic(topic, message);
+        if (subscribers >= 0) {
+          std::cout << "Published to " << subscribers << " subscribers" << std::endl;
         } else {
-          std::cout << "Failed to send message!" << std::endl;
+          std::cout << "Failed to publish message!" << std::endl;
+        }
+        
+      } else if (command == "subscribe" || command == "unsubscribe") {
+        std::string topic;
+        iss >> topic;
+        
+        if (topic.empty()) {
+          std::cout << "Usage: " << command << " <topic>" << std::endl;
+          continue;
+        }
+        
+        if (command == "unsubscribe") {
+          client.UnsubscribeFromTopic(topic);
+          std::cout << "Unsubscribed from " << topic << std::endl;
+        } else if (client.SubscribeToTopic(topic, [](const helloworld::TopicMessage& message) {
+                     std::cout << "\n[" << message.topic() << "] " << message.from_client_id()
+                               << ": " << message.message_content() << std::endl;
+                   })) {
+          std::cout << "Subscribed to " << topic << std::endl;
         }
         
       } else if (command == "list") {
@@ -155,10 +449,57 @@ int main(const int argc, const char* const argv[]) {
           }
         }
         
+      } else if (command == "stats") {
+        for (const auto& lane : client.GetMailboxStats()) {
+          std::cout << "  " << helloworld::MessagePriority_Name(lane.priority) << ": " << lane.depth
+                    << " queued, " << lane.dequeued << " received, wait avg "
+                    << lane.average_wait.count() << " us, max " << lane.max_wait.count() << " us"
+                    << std::endl;
+        }
+        
+      } else if (command == "find") {
+        helloworld::LabelSelectors selectors;
+        std::string predicate;
+        bool valid = true;
+        while (iss >> predicate) {
+          size_t separator = predicate.find('=');
+          if (separator == std::string::npos || separator == 0) {
+            valid = false;
+            break;
+          }
+          std::vector<std::string>& values = selectors[predicate.substr(0, separator)];
+          std::istringstream value_stream(predicate.substr(separator + 1));
+          std::string value;
+          while (std::getline(value_stream, value, ',')) {
+            values.push_back(value);
+          }
+        }
+        
+        if (!valid || selectors.empty()) {
+          std::cout << "Usage: find <key=v1,v2> ..." << std::endl;
+          continue;
+        }
+        
+        auto clients = client.FindClients(selectors);
+        if (clients.empty()) {
+          std::cout << "  No matching clients" << std::endl;
+        }
+        for (const auto& [id, address, port, online] : clients) {
+          std::cout << "  " << id << " at " << address << ":" << port 
+                    << " (online: " << (online ? "yes" : "no") << ")" << std::endl;
+        }
+        
       } else if (command == "help") {
         std::cout << "\nAvailable commands:" << std::endl;
         std::cout << "  send <destination> <message>  - Send message to another client" << std::endl;
+        std::cout << "  sendmany <d1,d2,...> <message> - Send message to several clients" << std::endl;
+        std::cout << "  sendfile <destination> <path> - Send a file as a resumable transfer" << std::endl;
         std::cout << "  list                         - List available clients" << std::endl;
+        std::cout << "  find <key=v1,v2> ...         - List clients matching every label" << std::endl;
+        std::cout << "  publish <topic> <message>    - Publish message to a topic" << std::endl;
+        std::cout << "  subscribe <topic>            - Print messages published to a topic" << std::endl;
+        std::cout << "  unsubscribe <topic>          - Stop printing messages for a topic" << std::endl;
+        std::cout << "  stats                        - Show mailbox lane depths and wait times" << std::endl;
         std::cout << "  help                         - Show this help" << std::endl;
         std::cout << "  quit                         - Exit client" << std::endl;
         
@@ -0,0 +1,213 @@
+#include "message_codec.h"
+
+#include <grpc/slice.h>
+
+#include <cstring>
+
+namespace helloworld {
+
+namespace {
+
+// "HWF1" read as a little-endian u32
+constexpr uint32_t kFlatMagic = 0x31465748;
+
+// magic, sequence, sender_epoch, priority and the four string lengths
+constexpr size_t kFlatHeaderBytes = 4 + 8 + 8 + 4 + 4 * 4;
+
+void Store32(uint8_t* out, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    out[i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
+
+void Store64(uint8_t* out, uint64_t value) {
+  for (int i = 0; i < 8; ++i) {
+    out[i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
+
+uint32_t Load32(const uint8_t* in) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i) {
+    value |= static_cast<uint32_t>(in[i]) << (8 * i);
+  }
+  return value;
+}
+
+uint64_t Load64(const uint8_t* in) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; ++i) {
+    value |= static_cast<uint64_t>(in[i]) << (8 * i);
+  }
+  return value;
+}
+
+// Whether text is well-formed UTF-8, as protobuf requires of string fields:
+// no overlong forms, surrogates or code points past U+10FFFF
+bool ValidUtf8(std::string_view text) {
+  size_t i = 0;
+  while (i < text.size()) {
+    // Skip ASCII eight bytes at a time
+    if (text.size() - i >= 8) {
+      uint64_t word = 0;
+      std::memcpy(&word, text.data() + i, 8);
+      if ((word & 0x8080808080808080ull) == 0) {
+        i += 8;
+        continue;
+      }
+    }
+    const uint8_t lead = static_cast<uint8_t>(text[i]);
+    if (lead < 0x80) {
+      ++i;
+      continue;
+    }
+    size_t length = 0;
+    uint8_t low = 0x80;
+    uint8_t high = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+      length = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+      length = 3;
+      low = lead == 0xE0 ? 0xA0 : 0x80;
+      high = lead == 0xED ? 0x9F : 0xBF;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+      length = 4;
+      low = lead == 0xF0 ? 0x90 : 0x80;
+      high = lead == 0xF4 ? 0x8F : 0xBF;
+    } else {
+      return false;
+    }
+    if (text.size() - i < length) {
+      return false;
+    }
+    // Only the first continuation byte has a narrower range
+    for (size_t j = 1; j < length; ++j) {
+      const uint8_t next = static_cast<uint8_t>(text[i + j]);
+      if (next < (j == 1 ? low : 0x80) || next > (j == 1 ? high : 0xBF)) {
+        return false;
+      }
+    }
+    i += length;
+  }
+  return true;
+}
+
+grpc::Status Malformed(const char* what) {
+  return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, what);
+}
+
+}  // namespace
+
+helloworld::ClientMessage ToMessage(const ClientMessageView& view) {
+  helloworld::ClientMessage message;
+  message.set_from_client_id(view.from_client_id.data(), view.from_client_id.size());
+  message.set_to_client_id(view.to_client_id.data(), view.to_client_id.size());
+  message.set_message_content(view.message_content.data(), view.message_content.size());
+  message.set_timestamp(view.timestamp.data(), view.timestamp.size());
+  message.set_sequence(view.sequence);
+  message.set_sender_epoch(view.sender_epoch);
+  message.set_priority(view.priority);
+  return message;
+}
+
+grpc::ByteBuffer ProtobufMessageCodec::Encode(const helloworld::ClientMessage& message) const {
+  grpc::ByteBuffer buffer;
+  bool own_buffer = false;
+  grpc::SerializationTraits<helloworld::ClientMessage>::Serialize(message, &buffer, &own_buffer);
+  return buffer;
+}
+
+grpc::Status ProtobufMessageCodec::Decode(grpc::ByteBuffer* buffer, DecodedMessage* decoded) const {
+  grpc::Status status = grpc::SerializationTraits<helloworld::ClientMessage>::Deserialize(buffer, &decoded->parsed);
+  if (!status.ok()) {
+    return Malformed("Not a protobuf ClientMessage");
+  }
+  const helloworld::ClientMessage& parsed = decoded->parsed;
+  decoded->view = ClientMessageView{parsed.from_client_id(), parsed.to_client_id(), parsed.message_content(),
+                                    parsed.timestamp(), parsed.sequence(), parsed.sender_epoch(),
+                                    parsed.priority()};
+  return grpc::Status::OK;
+}
+
+grpc::ByteBuffer FlatMessageCodec::Encode(const helloworld::ClientMessage& message) const {
+  const std::string* fields[] = {&message.from_client_id(), &message.to_client_id(),
+                                 &message.message_content(), &message.timestamp()};
+  size_t size = kFlatHeaderBytes;
+  for (const std::string* field : fields) {
+    size += field->size();
+  }
+
+  // Written in place into one slice that the buffer then owns
+  grpc_slice slice = grpc_slice_malloc(size);
+  uint8_t* out = GRPC_SLICE_START_PTR(slice);
+  Store32(out, kFlatMagic);
+  Store64(out + 4, message.sequence());
+  Store64(out + 12, message.sender_epoch());
+  Store32(out + 20, static_cast<uint32_t>(message.priority()));
+  out += 24;
+  for (const std::string* field : fields) {
+    Store32(out, static_cast<uint32_t>(field->size()));
+    out += 4;
+  }
+  for (const std::string* field : fields) {
+    std::memcpy(out, field->data(), field->size());
+    out += field->size();
+  }
+
+  grpc::Slice owned(slice, grpc::Slice::STEAL_REF);
+  return grpc::ByteBuffer(&owned, 1);
+}
+
+grpc::Status FlatMessageCodec::Decode(grpc::ByteBuffer* buffer, DecodedMessage* decoded) const {
+  // Free for the common single-slice buffer; larger messages may arrive in
+  // several slices and are joined once
+  if (!buffer->TrySingleSlice(&decoded->buffer).ok() && !buffer->DumpToSingleSlice(&decoded->buffer).ok()) {
+    return Malformed("Empty flat message");
+  }
+  const uint8_t* in = decoded->buffer.begin();
+  const size_t size = decoded->buffer.size();
+  if (size < kFlatHeaderBytes || Load32(in) != kFlatMagic) {
+    return Malformed("Not a flat ClientMessage");
+  }
+
+  ClientMessageView& view = decoded->view;
+  view.sequence = Load64(in + 4);
+  view.sender_epoch = Load64(in + 12);
+  const uint32_t priority = Load32(in + 20);
+  if (!helloworld::MessagePriority_IsValid(static_cast<int>(priority))) {
+    return Malformed("Unknown message priority");
+  }
+  view.priority = static_cast<helloworld::MessagePriority>(priority);
+
+  std::string_view* fields[] = {&view.from_client_id, &view.to_client_id, &view.message_content, &view.timestamp};
+  const char* text = reinterpret_cast<const char*>(in) + kFlatHeaderBytes;
+  size_t remaining = size - kFlatHeaderBytes;
+  for (int i = 0; i < 4; ++i) {
+    const uint32_t length = Load32(in + 24 + 4 * i);
+    if (length > remaining) {
+      return Malformed("Flat message field overruns the buffer");
+    }
+    *fields[i] = std::string_view(text, length);
+    if (!ValidUtf8(*fields[i])) {
+      return Malformed("Flat message field is not valid UTF-8");
+    }
+    text += length;
+    remaining -= length;
+  }
+  if (remaining != 0) {
+    return Malformed("Trailing bytes after flat message");
+  }
+  return grpc::Status::OK;
+}
+
+std::shared_ptr<const MessageCodec> MakeMessageCodec(const std::string& name) {
+  if (name == "protobuf") {
+    return std::make_shared<ProtobufMessageCodec>();
+  }
+  if (name == "flat") {
+    return std::make_shared<FlatMessageCodec>();
+  }
+  return nullptr;
+}
+
+}  // namespace helloworld
@@ -0,0 +1,88 @@
+#ifndef HELLOWORLD_MESSAGE_CODEC_H
+#define HELLOWORLD_MESSAGE_CODEC_H
+
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/impl/codegen/proto_utils.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "proto/helloworld.pb.h"
+
+namespace helloworld {
+
+// Full method names direct messages are sent to, one per wire encoding
+constexpr char kSendMessageMethod[] = "/helloworld.ClientCommunication/SendMessage";
+constexpr char kSendFlatMessageMethod[] = "/helloworld.ClientCommunication/SendFlatMessage";
+
+// Fields of a ClientMessage, read in place from wherever they were decoded
+struct ClientMessageView {
+  std::string_view from_client_id;
+  std::string_view to_client_id;
+  std::string_view message_content;
+  std::string_view timestamp;
+  uint64_t sequence = 0;
+  uint64_t sender_epoch = 0;
+  helloworld::MessagePriority priority = helloworld::MESSAGE_PRIORITY_NORMAL;
+};
+
+// A decoded message: the view points into buffer or parsed, so it is
+// neither copied nor moved
+struct DecodedMessage {
+  DecodedMessage() = default;
+  DecodedMessage(const DecodedMessage&) = delete;
+  DecodedMessage& operator=(const DecodedMessage&) = delete;
+
+  ClientMessageView view;
+  grpc::Slice buffer;
+  helloworld::ClientMessage parsed;
+};
+
+// Copies the view's fields into a message the mailbox can keep
+helloworld::ClientMessage ToMessage(const ClientMessageView& view);
+
+// Wire encoding of a ClientMessage on the direct peer path. Each codec has
+// its own method name, so a receiver knows how to decode what arrives.
+class MessageCodec {
+ public:
+  virtual ~MessageCodec() = default;
+
+  virtual const char* name() const = 0;
+  virtual const char* method() const = 0;
+
+  virtual grpc::ByteBuffer Encode(const helloworld::ClientMessage& message) const = 0;
+
+  // INVALID_ARGUMENT if buffer does not hold a message in this encoding.
+  // buffer may be consumed.
+  virtual grpc::Status Decode(grpc::ByteBuffer* buffer, DecodedMessage* decoded) const = 0;
+};
+
+// The generated protobuf encoding, as sent by the ClientCommunication stub
+class ProtobufMessageCodec final : public MessageCodec {
+ public:
+  const char* name() const override { return "protobuf"; }
+  const char* method() const override { return kSendMessageMethod; }
+  grpc::ByteBuffer Encode(const helloworld::ClientMessage& message) const override;
+  grpc::Status Decode(grpc::ByteBuffer* buffer, DecodedMessage* decoded) const override;
+};
+
+// Fixed little-endian header followed by the four strings back to back:
+//   magic u32, sequence u64, sender_epoch u64, priority u32,
+//   lengths of from_client_id, to_client_id, message_content, timestamp u32
+// Decoding checks the header and the strings' UTF-8 and points the view at
+// them, with no tags or varints and, for a single-slice buffer, no copy.
+class FlatMessageCodec final : public MessageCodec {
+ public:
+  const char* name() const override { return "flat"; }
+  const char* method() const override { return kSendFlatMessageMethod; }
+  grpc::ByteBuffer Encode(const helloworld::ClientMessage& message) const override;
+  grpc::Status Decode(grpc::ByteBuffer* buffer, DecodedMessage* decoded) const override;
+};
+
+// Codec by name ("protobuf" or "flat"); nullptr if unknown
+std::shared_ptr<const MessageCodec> MakeMessageCodec(const std::string& name);
+
+}  // namespace helloworld
+
+#endif  // HELLOWORLD_MESSAGE_CODEC_H
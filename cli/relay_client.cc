@@ -0,0 +1,206 @@
+#include "relay_client.h"
+
+#include <algorithm>
+#include <iostream>
+#include <utility>
+
+#include "client_support.h"
+
+namespace helloworld {
+
+RelayClient::RelayClient(std::shared_ptr<grpc::Channel> channel,
+                         const std::string& client_id,
+                         std::function<void(const helloworld::ClientMessage&)> on_message)
+    : stub_(helloworld::MessageRelay::NewStub(channel)),
+      client_id_(client_id),
+      on_message_(std::move(on_message)) {}
+
+RelayClient::~RelayClient() {
+  Close();
+}
+
+bool RelayClient::Connect(std::chrono::milliseconds timeout) {
+  std::future<bool> acked = OpenStream();
+  reader_thread_ = std::thread([this]() { ConnectionLoop(); });
+
+  if (acked.wait_for(timeout) != std::future_status::ready || !acked.get()) {
+    std::cout << "Failed to connect to relay" << std::endl;
+    Close();
+    return false;
+  }
+
+  std::cout << "Connected to relay as " << client_id_ << std::endl;
+  return true;
+}
+
+std::future<bool> RelayClient::SendAsync(const helloworld::ClientMessage& message) {
+  helloworld::RelayFrame frame;
+  *frame.mutable_message() = message;
+  return SendFrame(&frame);
+}
+
+bool RelayClient::Send(const helloworld::ClientMessage& message, std::chrono::milliseconds timeout) {
+  std::future<bool> delivered = SendAsync(message);
+  if (delivered.wait_for(timeout) != std::future_status::ready) {
+    std::cout << "Timed out waiting for relay ack" << std::endl;
+    return false;
+  }
+  return delivered.get();
+}
+
+bool RelayClient::connected() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return connected_;
+}
+
+void RelayClient::Close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+  }
+  cv_.notify_all();
+
+  // Half-close so the relay ends the stream cleanly; a write stuck on a dead
+  // connection only delays this until the timeout
+  std::unique_lock<std::timed_mutex> write_lock(write_mutex_, kRelayCloseTimeout);
+  if (write_lock.owns_lock()) {
+    bool open = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      open = stream_open_;
+    }
+    if (open) {
+      stream_->WritesDone();
+    }
+    write_lock.unlock();
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait_for(lock, kRelayCloseTimeout, [this] { return !stream_open_; });
+  if (context_) {
+    context_->TryCancel();
+  }
+  lock.unlock();
+
+  if (reader_thread_.joinable()) {
+    reader_thread_.join();
+  }
+}
+
+std::future<bool> RelayClient::OpenStream() {
+  auto context = std::make_unique<grpc::ClientContext>();
+  auto stream = stub_->Connect(context.get());
+
+  helloworld::RelayFrame hello;
+  hello.set_hello_client_id(client_id_);
+  std::promise<bool> acked;
+  std::future<bool> result = acked.get_future();
+
+  std::lock_guard<std::timed_mutex> write_lock(write_mutex_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_) {
+      context->TryCancel();
+    }
+    context_ = std::move(context);
+    stream_ = std::move(stream);
+    hello.set_sequence(next_sequence_++);
+    hello_sequence_ = hello.sequence();
+    pending_acks_.emplace(hello.sequence(), std::move(acked));
+    stream_open_ = true;
+  }
+  if (!stream_->Write(hello)) {
+    context_->TryCancel();
+  }
+  return result;
+}
+
+std::future<bool> RelayClient::SendFrame(helloworld::RelayFrame* frame) {
+  std::promise<bool> acked;
+  std::future<bool> result = acked.get_future();
+
+  // Sequence numbers go out in order, and never onto a stream being finished
+  std::lock_guard<std::timed_mutex> write_lock(write_mutex_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!stream_open_) {
+      acked.set_value(false);
+      return result;
+    }
+    frame->set_sequence(next_sequence_++);
+    pending_acks_.emplace(frame->sequence(), std::move(acked));
+  }
+
+  if (!stream_->Write(*frame)) {
+    // The stream is broken; ReadStream fails every pending ack when it ends
+    context_->TryCancel();
+  }
+  return result;
+}
+
+bool RelayClient::ReadStream() {
+  bool was_connected = false;
+  helloworld::RelayFrame frame;
+  while (stream_->Read(&frame)) {
+    if (frame.is_ack()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = pending_acks_.find(frame.sequence());
+      if (it != pending_acks_.end()) {
+        if (!frame.delivered()) {
+          std::cout << "Relay could not deliver message: " << frame.error() << std::endl;
+        }
+        if (frame.sequence() == hello_sequence_) {
+          connected_ = frame.delivered();
+          was_connected = connected_;
+        }
+        it->second.set_value(frame.delivered());
+        pending_acks_.erase(it);
+      }
+    } else if (frame.has_message()) {
+      on_message_(frame.message());
+    }
+  }
+
+  std::map<uint64_t, std::promise<bool>> abandoned;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stream_open_ = false;
+    connected_ = false;
+    abandoned.swap(pending_acks_);
+  }
+  cv_.notify_all();
+  for (auto& [sequence, acked] : abandoned) {
+    acked.set_value(false);
+  }
+
+  grpc::Status status;
+  {
+    // Reading has ended, so a write in flight fails soon; Finish must wait for it
+    std::lock_guard<std::timed_mutex> write_lock(write_mutex_);
+    status = stream_->Finish();
+  }
+  if (!status.ok() && status.error_code() != grpc::StatusCode::CANCELLED) {
+    std::cout << "Relay stream ended: " << status.error_message() << std::endl;
+  }
+  return was_connected;
+}
+
+void RelayClient::ConnectionLoop() {
+  auto backoff = kRelayReconnectBackoff;
+  while (true) {
+    if (ReadStream()) {
+      backoff = kRelayReconnectBackoff;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (cv_.wait_for(lock, backoff / 2 + RandomDelay(backoff), [this] { return closed_; })) {
+      return;
+    }
+    lock.unlock();
+    backoff = std::min(backoff * 2, kMaxRelayReconnectBackoff);
+
+    std::cout << "Reconnecting to relay as " << client_id_ << std::endl;
+    OpenStream();
+  }
+}
+
+}  // namespace helloworld
@@ -0,0 +1,87 @@
+#ifndef HELLOWORLD_RELAY_CLIENT_H
+#define HELLOWORLD_RELAY_CLIENT_H
+
+#include <grpcpp/grpcpp.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "proto/helloworld.grpc.pb.h"
+
+namespace helloworld {
+
+// Bounds on the jittered wait before reopening a relay stream that ended
+constexpr std::chrono::milliseconds kRelayReconnectBackoff(100);
+constexpr std::chrono::milliseconds kMaxRelayReconnectBackoff(5000);
+
+// How long Close lets the relay end the stream after WritesDone before cancelling it
+constexpr std::chrono::milliseconds kRelayCloseTimeout(1000);
+
+// Client end of a relay stream. Messages sent through it are forwarded by the
+// relay to the recipient's own stream; messages relayed to this client are
+// handed to on_message on the reader thread. A stream that ends is reopened
+// with backoff until Close.
+class RelayClient {
+ public:
+  RelayClient(std::shared_ptr<grpc::Channel> channel,
+              const std::string& client_id,
+              std::function<void(const helloworld::ClientMessage&)> on_message);
+  ~RelayClient();
+
+  // Open the stream and announce this client; false if the relay did not
+  // acknowledge within the timeout
+  bool Connect(std::chrono::milliseconds timeout);
+
+  // Forward a message. The future resolves to true once the relay has queued
+  // it on the recipient's stream, false if the recipient is not connected.
+  std::future<bool> SendAsync(const helloworld::ClientMessage& message);
+
+  // Forward a message and wait for the relay's ack
+  bool Send(const helloworld::ClientMessage& message, std::chrono::milliseconds timeout);
+
+  bool connected();
+
+  // Half-close the stream and stop reconnecting; pending sends resolve to false
+  void Close();
+
+ private:
+  // Open a stream and write the hello first; the future resolves with its ack
+  std::future<bool> OpenStream();
+  std::future<bool> SendFrame(helloworld::RelayFrame* frame);
+  // Read the stream until it ends, then finish it; true if its hello was acked
+  bool ReadStream();
+  // Read streams, reopening each one that ends, until Close
+  void ConnectionLoop();
+
+  std::unique_ptr<helloworld::MessageRelay::Stub> stub_;
+  std::string client_id_;
+  std::function<void(const helloworld::ClientMessage&)> on_message_;
+
+  std::unique_ptr<grpc::ClientContext> context_;
+  std::unique_ptr<grpc::ClientReaderWriter<helloworld::RelayFrame, helloworld::RelayFrame>> stream_;
+  std::thread reader_thread_;
+
+  // Held across each Write, WritesDone and Finish so they never overlap, and
+  // separate so a blocked write never stalls acks. Taken before mutex_.
+  std::timed_mutex write_mutex_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::map<uint64_t, std::promise<bool>> pending_acks_;
+  uint64_t next_sequence_ = 1;
+  uint64_t hello_sequence_ = 0;
+  // Frames may be written; set from OpenStream until the stream ends
+  bool stream_open_ = false;
+  // The relay acked this stream's hello
+  bool connected_ = false;
+  bool closed_ = false;
+};
+
+}  // namespace helloworld
+
+#endif  // HELLOWORLD_RELAY_CLIENT_H
@@ -0,0 +1,173 @@
+#include "tracing.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+
+namespace helloworld {
+
+namespace {
+
+// Random lowercase hex id of the given number of 64-bit words
+std::string RandomId(int words) {
+  thread_local std::mt19937_64 generator(std::random_device{}() ^
+                                         std::hash<std::thread::id>()(std::this_thread::get_id()));
+  std::string id;
+  char buffer[17];
+  for (int i = 0; i < words; ++i) {
+    std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(generator()));
+    id += buffer;
+  }
+  return id;
+}
+
+bool IsHex(const std::string& text) {
+  return text.find_first_not_of("0123456789abcdef") == std::string::npos;
+}
+
+// Escape a string for a JSON string literal
+std::string JsonEscape(const std::string& text) {
+  std::string escaped;
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buffer[7];
+      std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+      escaped += buffer;
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+int64_t Micros(std::chrono::system_clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+}  // namespace
+
+std::string TraceContext::ToTraceParent() const {
+  return "00-" + trace_id + "-" + span_id + (sampled ? "-01" : "-00");
+}
+
+TraceContext TraceContext::Parse(const std::string& traceparent) {
+  TraceContext context;
+  if (traceparent.size() != 55 || traceparent.compare(0, 3, "00-") != 0 || traceparent[35] != '-' ||
+      traceparent[52] != '-') {
+    return context;
+  }
+  std::string trace_id = traceparent.substr(3, 32);
+  std::string span_id = traceparent.substr(36, 16);
+  std::string flags = traceparent.substr(53, 2);
+  if (!IsHex(trace_id) || !IsHex(span_id) || !IsHex(flags)) {
+    return context;
+  }
+  context.trace_id = std::move(trace_id);
+  context.span_id = std::move(span_id);
+  context.sampled = std::stoi(flags, nullptr, 16) & 1;
+  return context;
+}
+
+Tracer::Tracer(const std::string& path, double sample_rate, const std::string& process_name)
+    : sample_rate_(sample_rate), out_(path, std::ios::app) {
+  ok_ = static_cast<bool>(out_);
+  if (!ok_) {
+    std::cout << "Cannot open trace file " << path << std::endl;
+    return;
+  }
+
+  // A JSON array that is never closed: trace viewers accept the truncated
+  // form, so spans can be appended until the process exits
+  if (out_.tellp() == 0) {
+    out_ << "[\n";
+  }
+  out_ << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << getpid() << ",\"args\":{\"name\":\""
+       << JsonEscape(process_name) << "\"}},\n";
+  out_.flush();
+}
+
+TraceContext Tracer::StartTrace() {
+  thread_local std::mt19937_64 generator(std::random_device{}());
+  TraceContext context;
+  context.trace_id = RandomId(2);
+  context.sampled = std::uniform_real_distribution<double>(0, 1)(generator) < sample_rate_;
+  return context;
+}
+
+void Tracer::Inject(const TraceContext& context, grpc::ClientContext* client_context) {
+  if (context.valid()) {
+    client_context->AddMetadata(kTraceParentMetadataKey, context.ToTraceParent());
+  }
+}
+
+TraceContext Tracer::Extract(const grpc::ServerContextBase& server_context) {
+  const auto& metadata = server_context.client_metadata();
+  auto it = metadata.find(kTraceParentMetadataKey);
+  if (it == metadata.end()) {
+    return TraceContext();
+  }
+  return TraceContext::Parse(std::string(it->second.data(), it->second.size()));
+}
+
+void Tracer::Export(const SpanRecord& span) {
+  std::ostringstream event;
+  event << "{\"name\":\"" << JsonEscape(span.name) << "\",\"cat\":\"helloworld\",\"ph\":\"X\""
+        << ",\"ts\":" << Micros(span.start.time_since_epoch()) << ",\"dur\":" << Micros(span.duration)
+        << ",\"pid\":" << getpid()
+        << ",\"tid\":" << (std::hash<std::thread::id>()(std::this_thread::get_id()) % 100000)
+        << ",\"args\":{\"trace_id\":\"" << span.context.trace_id << "\",\"span_id\":\"" << span.context.span_id
+        << "\",\"parent_span_id\":\"" << span.parent_span_id << "\"";
+  for (const auto& [key, value] : span.attributes) {
+    event << ",\"" << JsonEscape(key) << "\":\"" << JsonEscape(value) << "\"";
+  }
+  event << "}},\n";
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  out_ << event.str();
+  out_.flush();
+}
+
+Span::Span(Tracer* tracer, std::string name, const TraceContext& parent)
+    : tracer_(parent.sampled ? tracer : nullptr) {
+  record_.context.trace_id = parent.trace_id;
+  record_.context.sampled = parent.sampled;
+  if (tracer_ == nullptr) {
+    // Unsampled: still hand the context on so the callee skips it too. A
+    // root has no span id to pass on, and traceparent requires one.
+    record_.context.span_id = parent.span_id.empty() && parent.valid() ? RandomId(1) : parent.span_id;
+    return;
+  }
+  record_.name = std::move(name);
+  record_.context.span_id = RandomId(1);
+  record_.parent_span_id = parent.span_id;
+  record_.start = std::chrono::system_clock::now();
+}
+
+Span::~Span() {
+  End();
+}
+
+void Span::SetAttribute(const std::string& key, const std::string& value) {
+  if (tracer_ != nullptr) {
+    record_.attributes.emplace_back(key, value);
+  }
+}
+
+void Span::End() {
+  if (tracer_ == nullptr || ended_) {
+    return;
+  }
+  ended_ = true;
+  record_.duration = std::chrono::system_clock::now() - record_.start;
+  tracer_->Export(record_);
+}
+
+}  // namespace helloworld
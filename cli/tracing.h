@@ -0,0 +1,95 @@
+#ifndef HELLOWORLD_TRACING_H
+#define HELLOWORLD_TRACING_H
+
+#include <grpcpp/grpcpp.h>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace helloworld {
+
+// Metadata key carrying the W3C trace context of the calling span
+constexpr char kTraceParentMetadataKey[] = "traceparent";
+
+// Position of a span within a trace. Only sampled traces are recorded;
+// the decision is made once at the root and travels with the context.
+struct TraceContext {
+  std::string trace_id;  // 32 hex digits
+  std::string span_id;   // 16 hex digits
+  bool sampled = false;
+
+  bool valid() const { return !trace_id.empty(); }
+
+  // "00-<trace_id>-<span_id>-<flags>" and back; Parse returns an invalid
+  // context for anything malformed
+  std::string ToTraceParent() const;
+  static TraceContext Parse(const std::string& traceparent);
+};
+
+// Records spans to a file in the Chrome trace event format, which
+// chrome://tracing and Perfetto load directly. Every span is one complete
+// ("X") event written when it ends.
+class Tracer {
+ public:
+  // sample_rate is the fraction of new traces recorded, 0 to 1
+  Tracer(const std::string& path, double sample_rate, const std::string& process_name);
+
+  bool ok() const { return ok_; }
+
+  // Root context for a new trace, sampled with the configured probability
+  TraceContext StartTrace();
+
+  // Propagate a context to the callee / pick it up in a handler
+  static void Inject(const TraceContext& context, grpc::ClientContext* client_context);
+  static TraceContext Extract(const grpc::ServerContextBase& server_context);
+
+ private:
+  friend class Span;
+
+  struct SpanRecord {
+    std::string name;
+    TraceContext context;
+    std::string parent_span_id;
+    std::chrono::system_clock::time_point start;
+    std::chrono::system_clock::duration duration;
+    std::vector<std::pair<std::string, std::string>> attributes;
+  };
+
+  void Export(const SpanRecord& span);
+
+  const double sample_rate_;
+  std::mutex mutex_;
+  std::ofstream out_;
+  bool ok_ = false;
+};
+
+// A timed operation within a trace, exported when it ends. Spans with no
+// tracer or an unsampled parent do nothing, so call sites need no checks.
+class Span {
+ public:
+  Span(Tracer* tracer, std::string name, const TraceContext& parent);
+  ~Span();
+
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+
+  // Context for children of this span and for propagation
+  const TraceContext& context() const { return record_.context; }
+
+  void SetAttribute(const std::string& key, const std::string& value);
+
+  // End before destruction, e.g. when a phase finishes mid-scope
+  void End();
+
+ private:
+  Tracer* tracer_;
+  Tracer::SpanRecord record_;
+  bool ended_ = false;
+};
+
+}  // namespace helloworld
+
+#endif  // HELLOWORLD_TRACING_H
@@ -0,0 +1,21 @@
+#ifndef HELLOWORLD_METADATA_H
+#define HELLOWORLD_METADATA_H
+
+namespace helloworld {
+
+// Metadata key carrying the caller's client id on registry calls
+constexpr char kClientIdMetadataKey[] = "client-id";
+
+// Trailing metadata key carrying the registry's epoch on its unary replies
+constexpr char kRegistryEpochMetadataKey[] = "registry-epoch";
+
+// Trailing metadata key carrying how long to wait before retrying, in ms
+constexpr char kRetryAfterMetadataKey[] = "retry-after-ms";
+
+// Initial metadata the registry sets once a subscription is active; its
+// value is the topic subscribed to
+constexpr char kSubscribedTopicMetadataKey[] = "subscribed-topic";
+
+}  // namespace helloworld
+
+#endif  // HELLOWORLD_METADATA_H
@@ -0,0 +1,31 @@
+#ifndef HELLOWORLD_NULL_BUFFER_H
+#define HELLOWORLD_NULL_BUFFER_H
+
+#include <iostream>
+#include <streambuf>
+
+namespace helloworld {
+
+// Discards everything written to it; it keeps no state, so threads can log
+// through it concurrently
+class NullBuffer : public std::streambuf {
+ protected:
+  int overflow(int c) override { return c; }
+};
+
+// Points std::cout at another buffer until destroyed
+class CoutRedirect {
+ public:
+  explicit CoutRedirect(std::streambuf* buffer) : saved_(std::cout.rdbuf(buffer)) {}
+  ~CoutRedirect() { std::cout.rdbuf(saved_); }
+
+  CoutRedirect(const CoutRedirect&) = delete;
+  CoutRedirect& operator=(const CoutRedirect&) = delete;
+
+ private:
+  std::streambuf* saved_;
+};
+
+}  // namespace helloworld
+
+#endif  // HELLOWORLD_NULL_BUFFER_H
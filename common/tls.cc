@@ -0,0 +1,86 @@
+#include "tls.h"
+
+#include <grpc/grpc_security.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace helloworld {
+
+namespace {
+
+// Read whichever of the options' files are set
+bool ReadPemFiles(const TlsOptions& options, std::string* ca, std::string* cert, std::string* key) {
+  return (options.ca_file.empty() || ReadPemFile(options.ca_file, ca)) &&
+         (options.cert_file.empty() || ReadPemFile(options.cert_file, cert)) &&
+         (options.key_file.empty() || ReadPemFile(options.key_file, key));
+}
+
+// Never destroyed: channels may outlive any owner we could give it
+grpc_ssl_session_cache* SessionCache() {
+  static grpc_ssl_session_cache* cache = grpc_ssl_session_cache_create_lru(kTlsSessionCacheSize);
+  return cache;
+}
+
+}  // namespace
+
+bool ReadPemFile(const std::string& path, std::string* contents) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    std::cout << "Cannot read " << path << std::endl;
+    return false;
+  }
+  std::ostringstream buffer;
+  buffer << file.rdbuf();
+  *contents = buffer.str();
+  return true;
+}
+
+std::shared_ptr<grpc::ServerCredentials> MakeServerCredentials(const TlsOptions& options) {
+  if (!options.enabled()) {
+    return grpc::InsecureServerCredentials();
+  }
+  if (options.cert_file.empty() || options.key_file.empty()) {
+    std::cout << "Serving TLS needs a certificate and a key" << std::endl;
+    return nullptr;
+  }
+  grpc::SslServerCredentialsOptions ssl(options.require_client_cert
+                                            ? GRPC_SSL_REQUEST_AND_REQUIRE_CLIENT_CERTIFICATE_AND_VERIFY
+                                            : GRPC_SSL_DONT_REQUEST_CLIENT_CERTIFICATE);
+  grpc::SslServerCredentialsOptions::PemKeyCertPair pair;
+  if (!ReadPemFiles(options, &ssl.pem_root_certs, &pair.cert_chain, &pair.private_key)) {
+    return nullptr;
+  }
+  ssl.pem_key_cert_pairs.push_back(std::move(pair));
+  return grpc::SslServerCredentials(ssl);
+}
+
+ChannelFactory::ChannelFactory(const TlsOptions& options) : options_(options) {
+  if (!options_.enabled()) {
+    credentials_ = grpc::InsecureChannelCredentials();
+    return;
+  }
+  grpc::SslCredentialsOptions ssl;
+  if (ReadPemFiles(options_, &ssl.pem_root_certs, &ssl.pem_cert_chain, &ssl.pem_private_key)) {
+    credentials_ = grpc::SslCredentials(ssl);
+  }
+}
+
+std::shared_ptr<grpc::Channel> ChannelFactory::Create(const std::string& target,
+                                                      grpc::ChannelArguments args) const {
+  if (!credentials_) {
+    // Fail closed rather than fall back to plaintext
+    return grpc::CreateChannel("unix:/dev/null", grpc::InsecureChannelCredentials());
+  }
+  if (options_.enabled()) {
+    const grpc_arg cache = grpc_ssl_session_cache_create_channel_arg(SessionCache());
+    args.SetPointerWithVtable(cache.key, cache.value.pointer.p, cache.value.pointer.vtable);
+    if (!options_.server_name_override.empty()) {
+      args.SetSslTargetNameOverride(options_.server_name_override);
+    }
+  }
+  return grpc::CreateCustomChannel(target, credentials_, args);
+}
+
+}  // namespace helloworld
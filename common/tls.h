@@ -0,0 +1,58 @@
+#ifndef HELLOWORLD_TLS_H
+#define HELLOWORLD_TLS_H
+
+#include <grpcpp/grpcpp.h>
+#include <memory>
+#include <string>
+
+namespace helloworld {
+
+// Capacity of the process-wide cache of TLS sessions to resume
+constexpr size_t kTlsSessionCacheSize = 1024;
+
+// TLS settings, with certificates read from PEM files. TLS is off until a
+// certificate or CA file is set.
+struct TlsOptions {
+  // CA bundle the other side's certificate must chain to; system roots when
+  // empty
+  std::string ca_file;
+  // This side's certificate chain and key: required to serve, and presented
+  // to servers that ask for a client certificate (mTLS)
+  std::string cert_file;
+  std::string key_file;
+  // Servers refuse clients without a certificate signed by ca_file
+  bool require_client_cert = false;
+  // Name expected in server certificates instead of the dialed host
+  std::string server_name_override;
+
+  bool enabled() const { return !ca_file.empty() || !cert_file.empty(); }
+};
+
+// Contents of a PEM file; false, logging why, if it cannot be read
+bool ReadPemFile(const std::string& path, std::string* contents);
+
+// Server credentials for the options, insecure while TLS is off; nullptr
+// if a file cannot be read
+std::shared_ptr<grpc::ServerCredentials> MakeServerCredentials(const TlsOptions& options);
+
+// Creates channels per one set of TLS options, reading the files once.
+// Secure channels share one TLS session cache, so reconnecting to a server
+// resumes the previous session instead of running a full handshake.
+class ChannelFactory {
+ public:
+  explicit ChannelFactory(const TlsOptions& options = TlsOptions());
+
+  // False if a file could not be read; channels then fail every call
+  bool ok() const { return credentials_ != nullptr; }
+
+  std::shared_ptr<grpc::Channel> Create(const std::string& target,
+                                        grpc::ChannelArguments args = grpc::ChannelArguments()) const;
+
+ private:
+  TlsOptions options_;
+  std::shared_ptr<grpc::ChannelCredentials> credentials_;
+};
+
+}  // namespace helloworld
+
+#endif  // HELLOWORLD_TLS_H
@@ -0,0 +1,176 @@
+#include "client_table.h"
+
+#include <algorithm>
+#include <functional>
+
+namespace helloworld {
+
+namespace {
+
+// Initial number of index buckets; always a power of two
+constexpr size_t kInitialIndexBuckets = 16;
+
+size_t HashId(std::string_view client_id) {
+  return std::hash<std::string_view>()(client_id);
+}
+
+}  // namespace
+
+size_t ClientTable::Probe(std::string_view client_id) const {
+  const size_t mask = index_.size() - 1;
+  for (size_t bucket = HashId(client_id) & mask;; bucket = (bucket + 1) & mask) {
+    const uint32_t entry = index_[bucket];
+    if (entry == 0 || IdOf(slots_[entry - 1]) == client_id) {
+      return bucket;
+    }
+  }
+}
+
+uint32_t ClientTable::Find(std::string_view client_id) const {
+  if (index_.empty()) {
+    return kNoSlot;
+  }
+  const uint32_t entry = index_[Probe(client_id)];
+  return entry == 0 ? kNoSlot : entry - 1;
+}
+
+uint32_t ClientTable::Insert(std::string_view client_id, const std::string& address, int32_t port,
+                             bool online, const RegistryLabels& labels) {
+  // Keep the index at most 3/4 full so probe runs stay short
+  if ((size_ + 1) * 4 > index_.size() * 3) {
+    GrowIndex();
+  }
+  const size_t bucket = Probe(client_id);
+  if (index_[bucket] != 0) {
+    return kNoSlot;
+  }
+
+  // Id offsets are 32-bit; drop erased ids before giving up on the arena
+  constexpr size_t kMaxArena = std::numeric_limits<uint32_t>::max();
+  if (arena_.size() + client_id.size() > kMaxArena && arena_garbage_ > 0) {
+    CompactArena();
+  }
+  if (arena_.size() + client_id.size() > kMaxArena || (free_slots_.empty() && slots_.size() >= kTableFull)) {
+    return kTableFull;
+  }
+
+  uint32_t slot;
+  if (free_slots_.empty()) {
+    slot = static_cast<uint32_t>(slots_.size());
+    slots_.emplace_back();
+  } else {
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+  }
+
+  Slot& entry = slots_[slot];
+  entry.id_offset = static_cast<uint32_t>(arena_.size());
+  entry.id_length = static_cast<uint32_t>(client_id.size());
+  arena_.insert(arena_.end(), client_id.begin(), client_id.end());
+  entry.address = addresses_.Acquire(address);
+  entry.labels = label_sets_.Acquire(labels);
+  entry.port = port;
+  entry.online = online ? 1 : 0;
+  entry.live = 1;
+
+  index_[bucket] = slot + 1;
+  ++size_;
+  sorted_ = false;
+  return slot;
+}
+
+void ClientTable::Erase(uint32_t slot) {
+  Slot& entry = slots_[slot];
+
+  // Backward-shift deletion: pull later members of the probe run into the
+  // hole so lookups never need tombstones
+  const size_t mask = index_.size() - 1;
+  size_t hole = Probe(IdOf(entry));
+  for (size_t bucket = (hole + 1) & mask; index_[bucket] != 0; bucket = (bucket + 1) & mask) {
+    const size_t home = HashId(IdOf(slots_[index_[bucket] - 1])) & mask;
+    // Move it back unless its home lies cyclically in (hole, bucket]
+    if (((bucket - home) & mask) >= ((bucket - hole) & mask)) {
+      index_[hole] = index_[bucket];
+      hole = bucket;
+    }
+  }
+  index_[hole] = 0;
+
+  addresses_.Release(entry.address);
+  label_sets_.Release(entry.labels);
+  arena_garbage_ += entry.id_length;
+  entry = Slot();
+  free_slots_.push_back(slot);
+  --size_;
+  sorted_ = false;
+
+  if (arena_garbage_ > arena_.size() / 2) {
+    CompactArena();
+  }
+}
+
+ClientView ClientTable::Get(uint32_t slot) const {
+  const Slot& entry = slots_[slot];
+  return ClientView{IdOf(entry), addresses_.Get(entry.address), entry.port, entry.online != 0,
+                    label_sets_.Get(entry.labels)};
+}
+
+void ClientTable::Clear() {
+  slots_.clear();
+  free_slots_.clear();
+  size_ = 0;
+  arena_.clear();
+  arena_garbage_ = 0;
+  index_.clear();
+  addresses_.Clear();
+  label_sets_.Clear();
+  sorted_slots_.clear();
+  sorted_ = true;
+}
+
+void ClientTable::SortById(std::vector<uint32_t>* slots) const {
+  std::sort(slots->begin(), slots->end(),
+            [this](uint32_t a, uint32_t b) { return IdOf(slots_[a]) < IdOf(slots_[b]); });
+}
+
+const std::vector<uint32_t>& ClientTable::SortedSlots() const {
+  if (!sorted_) {
+    sorted_slots_.clear();
+    sorted_slots_.reserve(size_);
+    for (uint32_t slot = 0; slot < slots_.size(); ++slot) {
+      if (slots_[slot].live) {
+        sorted_slots_.push_back(slot);
+      }
+    }
+    SortById(&sorted_slots_);
+    sorted_ = true;
+  }
+  return sorted_slots_;
+}
+
+void ClientTable::GrowIndex() {
+  std::vector<uint32_t> old_index = std::move(index_);
+  index_.assign(old_index.empty() ? kInitialIndexBuckets : old_index.size() * 2, 0);
+  for (uint32_t entry : old_index) {
+    if (entry != 0) {
+      index_[Probe(IdOf(slots_[entry - 1]))] = entry;
+    }
+  }
+}
+
+void ClientTable::CompactArena() {
+  std::vector<char> arena;
+  arena.reserve(arena_.size() - arena_garbage_);
+  for (Slot& entry : slots_) {
+    if (entry.live) {
+      const uint32_t offset = static_cast<uint32_t>(arena.size());
+      arena.insert(arena.end(), arena_.begin() + entry.id_offset,
+                   arena_.begin() + entry.id_offset + entry.id_length);
+      entry.id_offset = offset;
+    }
+  }
+  arena_ = std::move(arena);
+  arena_garbage_ = 0;
+}
+
+}  // namespace helloworld
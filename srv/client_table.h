@@ -0,0 +1,162 @@
+#ifndef HELLOWORLD_CLIENT_TABLE_H
+#define HELLOWORLD_CLIENT_TABLE_H
+
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace helloworld {
+
+// Labels a client registered with
+using RegistryLabels = std::map<std::string, std::string>;
+
+// Deduplicated values referenced by 32-bit ids; a value is freed with its
+// last reference
+template <typename T>
+class Interner {
+ public:
+  uint32_t Acquire(const T& value) {
+    auto [it, inserted] = ids_.try_emplace(value, 0);
+    if (inserted) {
+      if (free_.empty()) {
+        it->second = static_cast<uint32_t>(values_.size());
+        values_.push_back(&it->first);
+        refs_.push_back(0);
+      } else {
+        it->second = free_.back();
+        free_.pop_back();
+        values_[it->second] = &it->first;
+      }
+    }
+    ++refs_[it->second];
+    return it->second;
+  }
+
+  void Release(uint32_t id) {
+    if (--refs_[id] == 0) {
+      ids_.erase(*values_[id]);
+      values_[id] = nullptr;
+      free_.push_back(id);
+    }
+  }
+
+  const T& Get(uint32_t id) const { return *values_[id]; }
+
+  size_t size() const { return ids_.size(); }
+
+  void Clear() {
+    ids_.clear();
+    values_.clear();
+    refs_.clear();
+    free_.clear();
+  }
+
+ private:
+  // Map keys never move, so values_ can point at them
+  std::map<T, uint32_t> ids_;
+  std::vector<const T*> values_;
+  std::vector<uint32_t> refs_;
+  std::vector<uint32_t> free_;
+};
+
+// A registered client read from a ClientTable; valid until the table changes
+struct ClientView {
+  std::string_view client_id;
+  const std::string& address;
+  int32_t port;
+  bool online;
+  const RegistryLabels& labels;
+};
+
+// Registered clients in a compact layout for registries with millions of
+// entries. Each client is a 20-byte slot in one vector: its id lives once in
+// a shared character arena, and its address and label set are ids into
+// interned tables, since most clients share them with many others. An
+// open-addressing index of 32-bit slot numbers finds a client by id.
+// Slots are stable until the client is erased, so other indexes can hold
+// them.
+class ClientTable {
+ public:
+  static constexpr uint32_t kNoSlot = std::numeric_limits<uint32_t>::max();
+
+  // Insert result when the 32-bit slot numbers or id offsets are used up
+  static constexpr uint32_t kTableFull = kNoSlot - 1;
+
+  // Slot of client_id, or kNoSlot
+  uint32_t Find(std::string_view client_id) const;
+
+  // Add a client and return its slot; kNoSlot if the id is taken,
+  // kTableFull if the table cannot address another client
+  uint32_t Insert(std::string_view client_id, const std::string& address, int32_t port, bool online,
+                  const RegistryLabels& labels);
+
+  void Erase(uint32_t slot);
+
+  ClientView Get(uint32_t slot) const;
+
+  // Visit every client in id order, as the registry lists them. The order
+  // is sorted once and reused until the table next changes.
+  template <typename Visitor>
+  void ForEach(Visitor visit) const {
+    for (uint32_t slot : SortedSlots()) {
+      visit(slot, Get(slot));
+    }
+  }
+
+  // Order slots by their clients' ids
+  void SortById(std::vector<uint32_t>* slots) const;
+
+  size_t size() const { return size_; }
+
+  void Clear();
+
+ private:
+  // Value-initialized (all zero) when created or freed. Ids are far
+  // shorter than 2^30 bytes, a gRPC message being a few MiB at most.
+  struct Slot {
+    uint32_t id_offset;
+    uint32_t id_length : 30;
+    uint32_t online : 1;
+    uint32_t live : 1;
+    uint32_t address;
+    uint32_t labels;
+    int32_t port;
+  };
+
+  std::string_view IdOf(const Slot& slot) const {
+    return std::string_view(arena_.data() + slot.id_offset, slot.id_length);
+  }
+
+  // Bucket holding slot for client_id, or the empty bucket it would go in
+  size_t Probe(std::string_view client_id) const;
+  void GrowIndex();
+
+  // Rewrite the arena without the ids of erased clients
+  void CompactArena();
+
+  const std::vector<uint32_t>& SortedSlots() const;
+
+  std::vector<Slot> slots_;
+  std::vector<uint32_t> free_slots_;
+  size_t size_ = 0;
+
+  std::vector<char> arena_;
+  size_t arena_garbage_ = 0;
+
+  // Slot + 1 per bucket, 0 when empty; linear probing
+  std::vector<uint32_t> index_;
+
+  // Live slots in id order, cached for ForEach; cleared by any change
+  mutable std::vector<uint32_t> sorted_slots_;
+  mutable bool sorted_ = true;
+
+  Interner<std::string> addresses_;
+  Interner<RegistryLabels> label_sets_;
+};
+
+}  // namespace helloworld
+
+#endif  // HELLOWORLD_CLIENT_TABLE_H
@@ -1,8 +1,106 @@
 #include "server.h"
 
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+// Parse a whole non-negative number; false on anything else
+bool ParseRate(const std::string& text, double* value) {
+  char* end = nullptr;
+  *value = std::strtod(text.c_str(), &end);
+  return !text.empty() && end == text.c_str() + text.size() && *value >= 0;
+}
+
+// Parse "<rate>[/<burst>]"; the burst defaults to one second's worth
+bool ParseRateLimit(const std::string& text, helloworld::RateLimit* limit) {
+  size_t slash = text.find('/');
+  if (!ParseRate(text.substr(0, slash), &limit->per_second)) {
+    return false;
+  }
+  if (slash == std::string::npos) {
+    limit->burst = limit->per_second;
+    return true;
+  }
+  return ParseRate(text.substr(slash + 1), &limit->burst);
+}
+
+void print_usage(const char* program_name) {
+  std::cout << "Usage: " << program_name << " [options]\n";
+  std::cout << "Options:\n";
+  std::cout << "  -a <server_address>    Listening address (default: 0.0.0.0:50051)\n";
+  std::cout << "  -f <snapshot_file>     Registry snapshot written on drain and loaded on start\n";
+  std::cout << "  -w                     Take over from a draining registry on the same port\n";
+  std::cout << "  -d <drain_timeout_ms>  Time in-flight RPCs get to finish on drain (default: 5000)\n";
+  std::cout << "  -n                     Do not serve the message relay\n";
+  std::cout << "  -l <rate>[/<burst>]    Calls per second each client may make to each method\n";
+  std::cout << "  -L <Method>=<rate>[/<burst>]  Limit for one method, e.g. ListClients=5/10 (repeatable)\n";
+  std::cout << "  -c <cert_file>         Serve TLS with this certificate chain (PEM)\n";
+  std::cout << "  -k <key_file>          Private key of the TLS certificate (PEM)\n";
+  std::cout << "  -C <ca_file>           Require client certificates signed by this CA (mTLS)\n";
+  std::cout << "  -h                     Show this help message\n";
+}
+
 int main(const int argc, const char* const argv[]) {
-  (void)argc;
-  (void)argv;
-  helloworld::RunServer();
+  helloworld::ServerOptions options;
+
+  // Parse command line arguments
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+
+    if (arg == "-a" && i + 1 < argc) {
+      options.server_address = argv[++i];
+    } else if (arg == "-f" && i + 1 < argc) {
+      options.snapshot_path = argv[++i];
+    } else if (arg == "-w") {
+      options.await_snapshot = true;
+    } else if (arg == "-d" && i + 1 < argc) {
+      options.drain_timeout = std::chrono::milliseconds(std::stoi(argv[++i]));
+    } else if (arg == "-n") {
+      options.enable_relay = false;
+    } else if (arg == "-l" && i + 1 < argc) {
+      if (!ParseRateLimit(argv[++i], &options.rate_limit)) {
+        std::cout << "Rate limits must be rate[/burst]: " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (arg == "-L" && i + 1 < argc) {
+      std::string limit = argv[++i];
+      size_t separator = limit.find('=');
+      if (separator == std::string::npos || separator == 0) {
+        std::cout << "Method limits must be Method=rate[/burst]: " << limit << std::endl;
+        return 1;
+      }
+      if (!ParseRateLimit(limit.substr(separator + 1), &options.method_rate_limits[limit.substr(0, separator)])) {
+        std::cout << "Method limits must be Method=rate[/burst]: " << limit << std::endl;
+        return 1;
+      }
+    } else if (arg == "-c" && i + 1 < argc) {
+      options.tls.cert_file = argv[++i];
+    } else if (arg == "-k" && i + 1 < argc) {
+      options.tls.key_file = argv[++i];
+    } else if (arg == "-C" && i + 1 < argc) {
+      options.tls.ca_file = argv[++i];
+      options.tls.require_client_cert = true;
+    } else if (arg == "-h") {
+      print_usage(argv[0]);
+      return 0;
+    } else {
+      std::cout << "Unknown option: " << arg << std::endl;
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (options.await_snapshot && options.snapshot_path.empty()) {
+    std::cout << "Error: -w requires a snapshot file (-f)" << std::endl;
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  // SIGTERM / Ctrl-C drain the server instead of killing in-flight RPCs
+  std::signal(SIGTERM, [](int) { helloworld::RequestServerDrain(); });
+  std::signal(SIGINT, [](int) { helloworld::RequestServerDrain(); });
+
+  helloworld::RunServer(options);
   return 0;
 }
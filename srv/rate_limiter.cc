@@ -0,0 +1,156 @@
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iterator>
+
+namespace helloworld {
+
+namespace {
+
+// The client id a caller sent, if any
+std::string ClientIdOf(grpc::ServerContextBase* context) {
+  const auto& metadata = context->client_metadata();
+  auto it = metadata.find(kClientIdMetadataKey);
+  return it != metadata.end() ? std::string(it->second.data(), it->second.size()) : std::string();
+}
+
+// Wait until a bucket short of a token has one
+std::chrono::milliseconds WaitForToken(double tokens, double per_second) {
+  return std::chrono::milliseconds(static_cast<int64_t>(std::ceil((1 - tokens) / per_second * 1000)));
+}
+
+}  // namespace
+
+std::string PeerHost(const std::string& peer) {
+  size_t port = peer.rfind(':');
+  std::string host = port == std::string::npos ? peer : peer.substr(0, port);
+  if (host.rfind("ipv4:127.", 0) == 0 || host == "ipv6:[::1]" || host == "ipv6:%5B::1%5D") {
+    return "localhost";
+  }
+  return host;
+}
+
+void RateLimiter::SetDefaultLimit(const RateLimit& limit) {
+  std::unique_lock<std::shared_mutex> lock(limits_mutex_);
+  default_limit_ = limit;
+  enabled_ = default_limit_.per_second > 0 || !method_limits_.empty();
+}
+
+void RateLimiter::SetMethodLimit(const std::string& method, const RateLimit& limit) {
+  std::unique_lock<std::shared_mutex> lock(limits_mutex_);
+  method_limits_[method] = limit;
+  enabled_ = true;
+}
+
+RateLimit RateLimiter::LimitFor(const std::string& method) {
+  // Without any limits configured, admission costs one atomic load
+  if (!enabled_) {
+    return RateLimit();
+  }
+  std::shared_lock<std::shared_mutex> lock(limits_mutex_);
+  auto it = method_limits_.find(method);
+  return it != method_limits_.end() ? it->second : default_limit_;
+}
+
+bool RateLimiter::Admit(const std::string& host,
+                        const std::string& client_id,
+                        const std::string& method,
+                        std::chrono::milliseconds* retry_after) {
+  const RateLimit limit = LimitFor(method);
+  if (limit.per_second <= 0) {
+    return true;
+  }
+  const double capacity = std::max(limit.burst, 1.0);
+
+  // A host's buckets share a shard, so its id count is kept under one lock
+  Shard& shard = shards_[std::hash<std::string>()(host) % kShards];
+  const std::string host_key = host + '\n' + method;
+  const auto now = std::chrono::steady_clock::now();
+
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if (shard.buckets.size() >= shard.sweep_at) {
+    SweepLocked(shard, now);
+  }
+
+  // Past the cap, new ids of a host share one bucket; "\n" is in no id
+  std::string client_key = host_key + '\n' + client_id;
+  size_t& host_ids = shard.ids_per_host[host];
+  if (host_ids >= kMaxClientBucketsPerHost && shard.buckets.count(client_key) == 0) {
+    client_key = host_key + "\n\n";
+  }
+
+  Bucket* client = nullptr;
+  const bool client_ok = RefillLocked(shard, client_key, limit.per_second, capacity, now, &client);
+  if (client->host_ids == nullptr) {
+    client->host_ids = &host_ids;
+    ++host_ids;
+  }
+  Bucket* host_bucket = nullptr;
+  const bool host_ok = RefillLocked(shard, host_key, limit.per_second * kHostLimitFactor,
+                                    capacity * kHostLimitFactor, now, &host_bucket);
+
+  if (client_ok && host_ok) {
+    client->tokens -= 1;
+    host_bucket->tokens -= 1;
+    return true;
+  }
+  *retry_after = std::max(client_ok ? std::chrono::milliseconds(0) : WaitForToken(client->tokens, client->per_second),
+                          host_ok ? std::chrono::milliseconds(0)
+                                  : WaitForToken(host_bucket->tokens, host_bucket->per_second));
+  return false;
+}
+
+bool RateLimiter::RefillLocked(Shard& shard,
+                               const std::string& key,
+                               double per_second,
+                               double capacity,
+                               std::chrono::steady_clock::time_point now,
+                               Bucket** bucket) {
+  auto [it, inserted] = shard.buckets.try_emplace(key);
+  Bucket& found = it->second;
+  if (inserted) {
+    found.tokens = capacity;
+  } else {
+    const double elapsed = std::chrono::duration<double>(now - found.refilled).count();
+    found.tokens = std::min(capacity, found.tokens + elapsed * per_second);
+  }
+  found.per_second = per_second;
+  found.capacity = capacity;
+  found.refilled = now;
+  *bucket = &found;
+  return found.tokens >= 1;
+}
+
+void RateLimiter::SweepLocked(Shard& shard, std::chrono::steady_clock::time_point now) {
+  // Refilled buckets start full anyway, so dropping them changes nothing
+  for (auto it = shard.buckets.begin(); it != shard.buckets.end();) {
+    const Bucket& bucket = it->second;
+    const double idle = std::chrono::duration<double>(now - bucket.refilled).count();
+    if (bucket.tokens + idle * bucket.per_second < bucket.capacity) {
+      ++it;
+      continue;
+    }
+    if (bucket.host_ids != nullptr) {
+      --*bucket.host_ids;
+    }
+    it = shard.buckets.erase(it);
+  }
+  for (auto it = shard.ids_per_host.begin(); it != shard.ids_per_host.end();) {
+    it = it->second == 0 ? shard.ids_per_host.erase(it) : std::next(it);
+  }
+  shard.sweep_at = std::max(kMinSweepBuckets, shard.buckets.size() * 2);
+}
+
+grpc::Status RateLimiter::Admit(grpc::ServerContextBase* context, const std::string& method) {
+  std::chrono::milliseconds retry_after(0);
+  if (Admit(PeerHost(context->peer()), ClientIdOf(context), method, &retry_after)) {
+    return grpc::Status::OK;
+  }
+
+  context->AddTrailingMetadata(kRetryAfterMetadataKey, std::to_string(retry_after.count()));
+  return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "Rate limit exceeded for " + method);
+}
+
+}  // namespace helloworld
@@ -0,0 +1,116 @@
+#ifndef HELLOWORLD_RATE_LIMITER_H
+#define HELLOWORLD_RATE_LIMITER_H
+
+#include <grpcpp/grpcpp.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+#include "common/metadata.h"
+
+namespace helloworld {
+
+// Host part of a peer address ("ipv4:127.0.0.1:5000" -> "ipv4:127.0.0.1").
+// Every loopback address maps to "localhost", as a local client may reach
+// the registry over IPv4 on one channel and IPv6 on another.
+std::string PeerHost(const std::string& peer);
+
+// Token bucket parameters: sustained calls per second and the burst allowed
+// on top. A zero rate means unlimited.
+struct RateLimit {
+  double per_second = 0;
+  double burst = 0;
+};
+
+// Token buckets per (caller, method), where a caller is a peer host and the
+// client id it sends. Each host also has a bucket per method, kHostLimitFactor
+// times the client limit, in front of its callers' buckets, and only its first
+// kMaxClientBucketsPerHost (id, method) pairs get buckets of their own. A host
+// cycling through ids therefore gets no more than its host budget. Buckets are spread over
+// shards by host, each with its own lock, so admission stays cheap under
+// load and never touches the registry's locks.
+class RateLimiter {
+ public:
+  // Limit applied to methods without their own
+  void SetDefaultLimit(const RateLimit& limit);
+
+  // Limit for one method, by its name (e.g. "ListClients")
+  void SetMethodLimit(const std::string& method, const RateLimit& limit);
+
+  // Take a token for a call to method from client_id (empty if it sent
+  // none) on host, and one from the host's bucket. When over either limit,
+  // returns false and sets retry_after to the wait until the next token.
+  bool Admit(const std::string& host,
+             const std::string& client_id,
+             const std::string& method,
+             std::chrono::milliseconds* retry_after);
+
+  // Admit a call, identifying the caller by its peer host and the client id
+  // it sends, so a client cannot spend another host's budget by claiming
+  // its id. Returns RESOURCE_EXHAUSTED (with a retry-after trailer) when
+  // over the limit. Handlers call this first, so over-limit callers are
+  // turned away before any registry lock is taken.
+  grpc::Status Admit(grpc::ServerContextBase* context, const std::string& method);
+
+ private:
+  // Keeps the limit it was filled under, so a sweep refills it at its own rate
+  struct Bucket {
+    double tokens = 0;
+    double per_second = 0;
+    double capacity = 0;
+    std::chrono::steady_clock::time_point refilled;
+    // A client's bucket: its host's id count, released when swept
+    size_t* host_ids = nullptr;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<std::string, Bucket> buckets;
+    // Client buckets held per host, for the hosts in this shard
+    std::unordered_map<std::string, size_t> ids_per_host;
+    // Size at which idle buckets are next swept
+    size_t sweep_at = kMinSweepBuckets;
+  };
+
+  static constexpr size_t kShards = 16;
+
+  // A host's budget per method, in multiples of the client limit
+  static constexpr double kHostLimitFactor = 16;
+
+  // Client buckets a host may hold; later ids share one per method
+  static constexpr size_t kMaxClientBucketsPerHost = 64;
+
+  // Idle buckets are first swept once a shard holds this many. Later sweeps
+  // wait until the shard doubles what the last one left, so each sweep is
+  // paid for by as many new buckets and admission stays O(1) amortized.
+  static constexpr size_t kMinSweepBuckets = 4096;
+
+  // Drop the shard's buckets idle long enough to have refilled
+  static void SweepLocked(Shard& shard, std::chrono::steady_clock::time_point now);
+
+  // Refill the bucket for key, created full; true if it holds a token
+  static bool RefillLocked(Shard& shard,
+                           const std::string& key,
+                           double per_second,
+                           double capacity,
+                           std::chrono::steady_clock::time_point now,
+                           Bucket** bucket);
+
+  RateLimit LimitFor(const std::string& method);
+
+  // Read on every call, written only while configuring
+  std::shared_mutex limits_mutex_;
+  RateLimit default_limit_;
+  std::map<std::string, RateLimit> method_limits_;
+  std::atomic<bool> enabled_{false};
+
+  Shard shards_[kShards];
+};
+
+}  // namespace helloworld
+
+#endif  // HELLOWORLD_RATE_LIMITER_H
@@ -0,0 +1,205 @@
+#include "relay.h"
+
+#include <deque>
+#include <iostream>
+#include <string>
+#include <utility>
+
+namespace helloworld {
+
+namespace {
+
+// Frames queued for a client stream before further deliveries are refused
+constexpr size_t kMaxPendingRelayFrames = 4096;
+
+}  // namespace
+
+// One client's relay stream. Incoming frames are handled one read at a time;
+// frames for the client are queued and written in order. The reactor deletes
+// itself once the stream is done.
+class RelayConnection : public grpc::ServerBidiReactor<helloworld::RelayFrame, helloworld::RelayFrame> {
+ public:
+  RelayConnection(MessageRelayServiceImpl* service, std::string peer)
+      : service_(service), peer_(std::move(peer)) {
+    StartRead(&incoming_);
+  }
+
+  // Queue a frame for this client; false if the stream is closing or too far behind
+  bool Enqueue(helloworld::RelayFrame frame) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (finishing_ || pending_.size() >= kMaxPendingRelayFrames) {
+      return false;
+    }
+    pending_.push_back(std::move(frame));
+    if (!writing_) {
+      WriteNextLocked();
+    }
+    return true;
+  }
+
+  void Close(const grpc::Status& status) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    FinishLocked(status);
+  }
+
+  void OnReadDone(bool ok) override {
+    if (!ok) {
+      // Client closed its side
+      Close(grpc::Status::OK);
+      return;
+    }
+
+    helloworld::RelayFrame ack;
+    ack.set_sequence(incoming_.sequence());
+    ack.set_is_ack(true);
+
+    if (client_id_.empty()) {
+      if (incoming_.hello_client_id().empty()) {
+        Close(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "First relay frame must be a hello"));
+        return;
+      }
+      if (service_->hello_check_ && !service_->hello_check_(incoming_.hello_client_id(), peer_)) {
+        std::cout << "Refused relay hello for " << incoming_.hello_client_id() << " from " << peer_ << std::endl;
+        Close(grpc::Status(grpc::StatusCode::PERMISSION_DENIED, "Client is not registered from this host"));
+        return;
+      }
+      client_id_ = incoming_.hello_client_id();
+      service_->AddConnection(client_id_, this);
+      ack.set_delivered(true);
+      std::cout << "Client " << client_id_ << " connected to relay" << std::endl;
+    } else if (incoming_.message().from_client_id() != client_id_) {
+      // A stream speaks only for the client its hello was checked for
+      ack.set_delivered(false);
+      ack.set_error("Sender does not match the relay hello");
+    } else {
+      std::string error;
+      ack.set_delivered(service_->Forward(incoming_.message(), &error));
+      ack.set_error(error);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (finishing_) {
+      return;
+    }
+    pending_.push_back(std::move(ack));
+    if (!writing_) {
+      WriteNextLocked();
+    }
+    StartRead(&incoming_);
+  }
+
+  void OnWriteDone(bool ok) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    writing_ = false;
+    pending_.pop_front();
+    if (finishing_) {
+      // Close deferred the Finish until this write completed
+      Finish(final_status_);
+    } else if (!ok) {
+      FinishLocked(grpc::Status(grpc::StatusCode::UNAVAILABLE, "Relay stream broken"));
+    } else if (!pending_.empty()) {
+      WriteNextLocked();
+    }
+  }
+
+  void OnCancel() override {
+    Close(grpc::Status::CANCELLED);
+  }
+
+  void OnDone() override {
+    if (!client_id_.empty()) {
+      service_->RemoveConnection(client_id_, this);
+      std::cout << "Client " << client_id_ << " disconnected from relay" << std::endl;
+    }
+    delete this;
+  }
+
+ private:
+  void WriteNextLocked() {
+    writing_ = true;
+    StartWrite(&pending_.front());
+  }
+
+  // Finish now, or after the outstanding write completes
+  void FinishLocked(const grpc::Status& status) {
+    if (finishing_) {
+      return;
+    }
+    finishing_ = true;
+    if (writing_) {
+      pending_.resize(1);
+      final_status_ = status;
+    } else {
+      pending_.clear();
+      Finish(status);
+    }
+  }
+
+  MessageRelayServiceImpl* service_;
+  const std::string peer_;
+  std::string client_id_;
+  helloworld::RelayFrame incoming_;
+
+  std::mutex mutex_;
+  std::deque<helloworld::RelayFrame> pending_;
+  bool writing_ = false;
+  bool finishing_ = false;
+  grpc::Status final_status_;
+};
+
+grpc::ServerBidiReactor<helloworld::RelayFrame, helloworld::RelayFrame>* MessageRelayServiceImpl::Connect(
+    grpc::CallbackServerContext* context) {
+  return new RelayConnection(this, context->peer());
+}
+
+void MessageRelayServiceImpl::SetHelloCheck(std::function<bool(const std::string&, const std::string&)> check) {
+  hello_check_ = std::move(check);
+}
+
+size_t MessageRelayServiceImpl::ConnectedClients() {
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  return connections_.size();
+}
+
+void MessageRelayServiceImpl::CloseConnections() {
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  for (const auto& [client_id, connection] : connections_) {
+    connection->Close(grpc::Status(grpc::StatusCode::UNAVAILABLE, "Relay is shutting down"));
+  }
+}
+
+void MessageRelayServiceImpl::AddConnection(const std::string& client_id, RelayConnection* connection) {
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  RelayConnection*& current = connections_[client_id];
+  if (current != nullptr && current != connection) {
+    current->Close(grpc::Status(grpc::StatusCode::ALREADY_EXISTS, "Client reconnected to relay"));
+  }
+  current = connection;
+}
+
+void MessageRelayServiceImpl::RemoveConnection(const std::string& client_id, RelayConnection* connection) {
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  auto it = connections_.find(client_id);
+  if (it != connections_.end() && it->second == connection) {
+    connections_.erase(it);
+  }
+}
+
+bool MessageRelayServiceImpl::Forward(const helloworld::ClientMessage& message, std::string* error) {
+  helloworld::RelayFrame delivery;
+  *delivery.mutable_message() = message;
+
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  auto it = connections_.find(message.to_client_id());
+  if (it == connections_.end()) {
+    *error = "Client not connected to relay";
+    return false;
+  }
+  if (!it->second->Enqueue(std::move(delivery))) {
+    *error = "Client relay stream is full";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace helloworld
@@ -0,0 +1,50 @@
+#ifndef HELLOWORLD_RELAY_H
+#define HELLOWORLD_RELAY_H
+
+#include <grpcpp/grpcpp.h>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "proto/helloworld.grpc.pb.h"
+
+namespace helloworld {
+
+class RelayConnection;
+
+// Relay service: forwards ClientMessages between the streams of clients that
+// cannot dial each other directly. Runs inside the registry or on its own.
+class MessageRelayServiceImpl final : public helloworld::MessageRelay::CallbackService {
+ public:
+  grpc::ServerBidiReactor<helloworld::RelayFrame, helloworld::RelayFrame>* Connect(
+      grpc::CallbackServerContext* context) override;
+
+  // Check every hello with check(client_id, peer) and refuse the stream
+  // unless it passes; without one any hello is taken. Call before serving.
+  void SetHelloCheck(std::function<bool(const std::string&, const std::string&)> check);
+
+  // Number of clients currently connected to the relay
+  size_t ConnectedClients();
+
+  // End every relay stream so clients can reconnect elsewhere
+  void CloseConnections();
+
+ private:
+  friend class RelayConnection;
+
+  // A reconnecting client replaces (and closes) its previous stream
+  void AddConnection(const std::string& client_id, RelayConnection* connection);
+  void RemoveConnection(const std::string& client_id, RelayConnection* connection);
+
+  // Hand a message to the recipient's stream; false if it is not connected
+  bool Forward(const helloworld::ClientMessage& message, std::string* error);
+
+  std::function<bool(const std::string&, const std::string&)> hello_check_;
+  std::map<std::string, RelayConnection*> connections_;
+  std::mutex connections_mutex_;
+};
+
+}  // namespace helloworld
+
+#endif  // HELLOWORLD_RELAY_H
@@ -1,36 +1,215 @@
 #include "server.h"
+#include "relay.h"
 
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <limits>
 #include <memory>
+#include <random>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <chrono>
 
 namespace helloworld {
 
+namespace {
+
+// Upper bound on how long an RPC is held while a snapshot is being restored
+constexpr std::chrono::seconds kMaxReadyWait(30);
+
+// Messages queued for a subscriber that is not keeping up before new
+// publishes to it are dropped
+constexpr size_t kMaxPendingTopicMessages = 1024;
+
+std::atomic<bool> drain_requested(false);
+
+void CopyClientInfo(const ClientView& client_info, helloworld::ClientInfo* client) {
+  client->set_client_id(client_info.client_id.data(), client_info.client_id.size());
+  client->set_client_address(client_info.address);
+  client->set_client_port(client_info.port);
+  client->set_online(client_info.online);
+  client->mutable_labels()->insert(client_info.labels.begin(), client_info.labels.end());
+}
+
+// One column per field, addresses numbered in order of first appearance.
+// The table interns addresses, so each distinct one is a single string and
+// is keyed by its address in memory rather than hashed.
+void CopyCompactClientList(const ClientTable& clients, helloworld::CompactClientList* list) {
+  const int count = static_cast<int>(clients.size());
+  list->mutable_id_lengths()->Reserve(count);
+  list->mutable_address_refs()->Reserve(count);
+  list->mutable_port_deltas()->Reserve(count);
+  std::string* client_ids = list->mutable_client_ids();
+  std::string* online = list->mutable_online();
+  online->assign((clients.size() + 7) / 8, '\0');
+  
+  std::unordered_map<const std::string*, uint32_t> address_refs;
+  size_t index = 0;
+  int32_t previous_port = 0;
+  clients.ForEach([&](uint32_t, const ClientView& client_info) {
+    client_ids->append(client_info.client_id.data(), client_info.client_id.size());
+    list->add_id_lengths(static_cast<uint32_t>(client_info.client_id.size()));
+    
+    auto [ref, inserted] = address_refs.try_emplace(&client_info.address, list->addresses_size());
+    if (inserted) {
+      list->add_addresses(client_info.address);
+    }
+    list->add_address_refs(ref->second);
+    
+    // Wraps rather than overflows for ports far apart
+    list->add_port_deltas(static_cast<int32_t>(static_cast<uint32_t>(client_info.port) -
+                                               static_cast<uint32_t>(previous_port)));
+    previous_port = client_info.port;
+    
+    if (client_info.online) {
+      (*online)[index / 8] = static_cast<char>((*online)[index / 8] | (1 << (index % 8)));
+    }
+    ++index;
+  });
+}
+
+bool MatchesSelector(const ClientView& client_info, const helloworld::LabelSelector& selector) {
+  auto it = client_info.labels.find(selector.key());
+  return it != client_info.labels.end() &&
+         std::find(selector.values().begin(), selector.values().end(), it->second) !=
+             selector.values().end();
+}
+
+// Random non-zero epoch, so restarts are told apart even within a second
+// Whether two stats are of the same file, unchanged: a snapshot is
+// published by renaming a new file over the path, so it never matches
+bool SameFile(const struct stat& a, const struct stat& b) {
+  return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+         a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+uint64_t NewRegistryEpoch() {
+  std::mt19937_64 generator(std::random_device{}());
+  return std::uniform_int_distribution<uint64_t>(1)(generator);
+}
+
+}  // namespace
+
+// Server side of one Subscribe stream. Published messages are queued and
+// written one at a time; the reactor deletes itself when the stream is done.
+class TopicSubscriber : public grpc::ServerWriteReactor<grpc::ByteBuffer> {
+ public:
+  TopicSubscriber(ClientRegistryServiceImpl* service, std::string topic)
+      : service_(service), topic_(std::move(topic)) {}
+
+  // Queue a message; false if the stream is closing or too far behind
+  bool Deliver(const grpc::ByteBuffer& message) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (finishing_ || pending_.size() >= kMaxPendingTopicMessages) {
+      return false;
+    }
+    pending_.push_back(message);
+    if (!writing_) {
+      WriteNextLocked();
+    }
+    return true;
+  }
+
+  void Close(const grpc::Status& status) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    FinishLocked(status);
+  }
+
+  void OnWriteDone(bool ok) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    writing_ = false;
+    pending_.pop_front();
+    if (finishing_) {
+      // Close or OnCancel deferred the Finish until this write completed
+      Finish(final_status_);
+    } else if (!ok) {
+      FinishLocked(grpc::Status(grpc::StatusCode::UNAVAILABLE, "Subscriber stream broken"));
+    } else if (!pending_.empty()) {
+      WriteNextLocked();
+    }
+  }
+
+  void OnCancel() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    FinishLocked(grpc::Status::CANCELLED);
+  }
+
+  void OnDone() override {
+    service_->RemoveSubscriber(topic_, this);
+    delete this;
+  }
+
+ private:
+  void WriteNextLocked() {
+    writing_ = true;
+    StartWrite(&pending_.front());
+  }
+
+  // Finish now, or after the outstanding write completes
+  void FinishLocked(const grpc::Status& status) {
+    if (finishing_) {
+      return;
+    }
+    finishing_ = true;
+    if (writing_) {
+      pending_.resize(1);
+      final_status_ = status;
+    } else {
+      pending_.clear();
+      Finish(status);
+    }
+  }
+
+  ClientRegistryServiceImpl* service_;
+  const std::string topic_;
+  std::mutex mutex_;
+  std::deque<grpc::ByteBuffer> pending_;
+  bool writing_ = false;
+  bool finishing_ = false;
+  grpc::Status final_status_;
+};
+
+ClientRegistryServiceImpl::ClientRegistryServiceImpl()
+    : epoch_(NewRegistryEpoch()) {}
+
 grpc::Status ClientRegistryServiceImpl::RegisterClient(grpc::ServerContext* context,
                                                       const helloworld::ClientRegistration* request,
                                                       helloworld::RegistrationResponse* reply) {
-  std::lock_guard<std::mutex> lock(clients_mutex_);
+  grpc::Status admitted = rate_limiter_.Admit(context, "RegisterClient");
+  if (!admitted.ok()) {
+    return admitted;
+  }
   
-  // Check if client already exists
-  if (registered_clients_.find(request->client_id()) != registered_clients_.end()) {
+  std::unique_lock<std::mutex> lock(clients_mutex_);
+  if (!AwaitReady(context, lock)) {
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE, "Registry is restoring state");
+  }
+  AddEpoch(context);
+  
+  // Register the client, unless the ID is taken
+  const uint32_t slot = clients_.Insert(request->client_id(), request->client_address(), request->client_port(),
+                                        true, RegistryLabels(request->labels().begin(), request->labels().end()));
+  if (slot == ClientTable::kTableFull) {
+    std::cout << "Client registration failed: registry is full" << std::endl;
+    return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "Registry is full");
+  }
+  if (slot == ClientTable::kNoSlot) {
     reply->set_success(false);
     reply->set_message("Client ID already exists");
     std::cout << "Client registration failed: ID " << request->client_id() << " already exists" << std::endl;
     return grpc::Status::OK;
   }
-  
-  // Register the client
-  ClientRegistryInfo client_info;
-  client_info.client_id = request->client_id();
-  client_info.address = request->client_address();
-  client_info.port = request->client_port();
-  client_info.online = true;
-  
-  registered_clients_[request->client_id()] = client_info;
+  IndexClientLocked(slot);
+  registration_hosts_[request->client_id()] = PeerHost(context->peer());
   
   reply->set_success(true);
   reply->set_message("Client registered successfully");
@@ -43,10 +222,19 @@ grpc::Status ClientRegistryServiceImpl::RegisterClient(grpc::ServerContext* cont
 grpc::Status ClientRegistryServiceImpl::GetClient(grpc::ServerContext* context,
                                                   const helloworld::ClientLookup* request,
                                                   helloworld::ClientInfo* reply) {
-  std::lock_guard<std::mutex> lock(clients_mutex_);
+  grpc::Status admitted = rate_limiter_.Admit(context, "GetClient");
+  if (!admitted.ok()) {
+    return admitted;
+  }
   
-  auto it = registered_clients_.find(request->client_id());
-  if (it == registered_clients_.end()) {
+  std::unique_lock<std::mutex> lock(clients_mutex_);
+  if (!AwaitReady(context, lock)) {
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE, "Registry is restoring state");
+  }
+  AddEpoch(context);
+  
+  const uint32_t slot = clients_.Find(request->client_id());
+  if (slot == ClientTable::kNoSlot) {
     reply->set_client_id(request->client_id());
     reply->set_client_address("");
     reply->set_client_port(0);
@@ -55,11 +243,8 @@ grpc::Status ClientRegistryServiceImpl::GetClient(grpc::ServerContext* context,
     return grpc::Status::OK;
   }
   
-  const ClientRegistryInfo& client_info = it->second;
-  reply->set_client_id(client_info.client_id);
-  reply->set_client_address(client_info.address);
-  reply->set_client_port(client_info.port);
-  reply->set_online(client_info.online);
+  const ClientView client_info = clients_.Get(slot);
+  CopyClientInfo(client_info, reply);
   
   std::cout << "Client lookup successful: " << client_info.client_id 
             << " at " << client_info.address << ":" << client_info.port << std::endl;
@@ -67,20 +252,135 @@ grpc::Status ClientRegistryServiceImpl::GetClient(grpc::ServerContext* context,
   return grpc::Status::OK;
 }
 
+grpc::Status ClientRegistryServiceImpl::GetClients(grpc::ServerContext* context,
+                                                   const helloworld::ClientLookupBatch* request,
+                                                   helloworld::ClientList* reply) {
+  grpc::Status admitted = rate_limiter_.Admit(context, "GetClients");
+  if (!admitted.ok()) {
+    return admitted;
+  }
+  
+  std::unique_lock<std::mutex> lock(clients_mutex_);
+  if (!AwaitReady(context, lock)) {
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE, "Registry is restoring state");
+  }
+  AddEpoch(context);
+  
+  // Unknown IDs come back offline, matching GetClient
+  for (const auto& client_id : request->client_ids()) {
+    helloworld::ClientInfo* client = reply->add_clients();
+    
+    const uint32_t slot = clients_.Find(client_id);
+    if (slot == ClientTable::kNoSlot) {
+      client->set_client_id(client_id);
+      client->set_online(false);
+      continue;
+    }
+    CopyClientInfo(clients_.Get(slot), client);
+  }
+  
+  std::cout << "Batch lookup of " << request->client_ids_size() << " clients" << std::endl;
+  
+  return grpc::Status::OK;
+}
+
 grpc::Status ClientRegistryServiceImpl::ListClients(grpc::ServerContext* context,
                                                    const helloworld::ClientListRequest* request,
                                                    helloworld::ClientList* reply) {
-  std::lock_guard<std::mutex> lock(clients_mutex_);
+  grpc::Status admitted = rate_limiter_.Admit(context, "ListClients");
+  if (!admitted.ok()) {
+    return admitted;
+  }
   
-  for (const auto& [client_id, client_info] : registered_clients_) {
-    helloworld::ClientInfo* client = reply->add_clients();
-    client->set_client_id(client_info.client_id);
-    client->set_client_address(client_info.address);
-    client->set_client_port(client_info.port);
-    client->set_online(client_info.online);
+  std::unique_lock<std::mutex> lock(clients_mutex_);
+  if (!AwaitReady(context, lock)) {
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE, "Registry is restoring state");
+  }
+  AddEpoch(context);
+  
+  if (request->compact()) {
+    CopyCompactClientList(clients_, reply->mutable_compact());
+  } else {
+    reply->mutable_clients()->Reserve(static_cast<int>(clients_.size()));
+    clients_.ForEach([reply](uint32_t, const ClientView& client_info) {
+      CopyClientInfo(client_info, reply->add_clients());
+    });
+  }
+  
+  std::cout << "Listed " << clients_.size() << " registered clients" << std::endl;
+  
+  return grpc::Status::OK;
+}
+
+grpc::Status ClientRegistryServiceImpl::QueryClients(grpc::ServerContext* context,
+                                                    const helloworld::ClientQuery* request,
+                                                    helloworld::ClientList* reply) {
+  grpc::Status admitted = rate_limiter_.Admit(context, "QueryClients");
+  if (!admitted.ok()) {
+    return admitted;
+  }
+  
+  if (request->selectors().empty()) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "At least one label selector is required");
+  }
+  for (const auto& selector : request->selectors()) {
+    if (selector.key().empty() || selector.values().empty()) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Label selectors need a key and a value");
+    }
   }
   
-  std::cout << "Listed " << registered_clients_.size() << " registered clients" << std::endl;
+  std::unique_lock<std::mutex> lock(clients_mutex_);
+  if (!AwaitReady(context, lock)) {
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE, "Registry is restoring state");
+  }
+  AddEpoch(context);
+  
+  // Walk the index entries of the most selective predicate and check each
+  // candidate's own labels against the rest
+  const helloworld::LabelSelector* narrowest = nullptr;
+  size_t narrowest_size = std::numeric_limits<size_t>::max();
+  for (const auto& selector : request->selectors()) {
+    size_t size = 0;
+    for (const auto& value : selector.values()) {
+      auto it = label_index_.find({selector.key(), value});
+      if (it != label_index_.end()) {
+        size += it->second.size();
+      }
+    }
+    if (size < narrowest_size) {
+      narrowest = &selector;
+      narrowest_size = size;
+    }
+  }
+  
+  std::set<std::string> values(narrowest->values().begin(), narrowest->values().end());
+  std::vector<uint32_t> matched;
+  for (const auto& value : values) {
+    auto it = label_index_.find({narrowest->key(), value});
+    if (it == label_index_.end()) {
+      continue;
+    }
+    for (uint32_t slot : it->second) {
+      const ClientView client_info = clients_.Get(slot);
+      bool matches = std::all_of(request->selectors().begin(), request->selectors().end(),
+                                 [&](const helloworld::LabelSelector& selector) {
+                                   return &selector == narrowest || MatchesSelector(client_info, selector);
+                                 });
+      if (matches) {
+        matched.push_back(slot);
+      }
+    }
+  }
+  
+  // Listed in id order, like ListClients
+  clients_.SortById(&matched);
+  reply->mutable_clients()->Reserve(static_cast<int>(matched.size()));
+  for (uint32_t slot : matched) {
+    CopyClientInfo(clients_.Get(slot), reply->add_clients());
+  }
+  
+  std::cout << "Label query matched " << reply->clients_size() << " of "
+            << narrowest_size << " candidate clients" << std::endl;
   
   return grpc::Status::OK;
 }
@@ -88,17 +388,28 @@ grpc::Status ClientRegistryServiceImpl::ListClients(grpc::ServerContext* context
 grpc::Status ClientRegistryServiceImpl::UnregisterClient(grpc::ServerContext* context,
                                                          const helloworld::ClientUnregistration* request,
                                                          helloworld::UnregistrationResponse* reply) {
-  std::lock_guard<std::mutex> lock(clients_mutex_);
+  grpc::Status admitted = rate_limiter_.Admit(context, "UnregisterClient");
+  if (!admitted.ok()) {
+    return admitted;
+  }
   
-  auto it = registered_clients_.find(request->client_id());
-  if (it == registered_clients_.end()) {
+  std::unique_lock<std::mutex> lock(clients_mutex_);
+  if (!AwaitReady(context, lock)) {
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE, "Registry is restoring state");
+  }
+  AddEpoch(context);
+  
+  const uint32_t slot = clients_.Find(request->client_id());
+  if (slot == ClientTable::kNoSlot) {
     reply->set_success(false);
     reply->set_message("Client ID not found");
     std::cout << "Client unregistration failed: ID " << request->client_id() << " not found" << std::endl;
     return grpc::Status::OK;
   }
   
-  registered_clients_.erase(it);
+  UnindexClientLocked(slot);
+  clients_.Erase(slot);
+  registration_hosts_.erase(request->client_id());
   
   reply->set_success(true);
   reply->set_message("Client unregistered successfully");
@@ -107,24 +418,325 @@ grpc::Status ClientRegistryServiceImpl::UnregisterClient(grpc::ServerContext* co
   return grpc::Status::OK;
 }
 
+grpc::ServerWriteReactor<grpc::ByteBuffer>* ClientRegistryServiceImpl::Subscribe(
+    grpc::CallbackServerContext* context, const grpc::ByteBuffer* request) {
+  helloworld::SubscribeRequest subscribe_request;
+  grpc::ByteBuffer request_buffer(*request);
+  grpc::Status status = grpc::SerializationTraits<helloworld::SubscribeRequest>::Deserialize(
+      &request_buffer, &subscribe_request);
+  
+  auto* subscriber = new TopicSubscriber(this, subscribe_request.topic());
+  grpc::Status admitted = rate_limiter_.Admit(context, "Subscribe");
+  if (!admitted.ok()) {
+    subscriber->Close(admitted);
+    return subscriber;
+  }
+  if (!status.ok() || subscribe_request.topic().empty()) {
+    subscriber->Close(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Topic is required"));
+    return subscriber;
+  }
+  
+  // Send initial metadata while holding the topic lock: once the subscriber
+  // sees it, it is guaranteed to receive every later publish.
+  std::lock_guard<std::mutex> lock(topics_mutex_);
+  topic_subscribers_[subscribe_request.topic()].insert(subscriber);
+  context->AddInitialMetadata(kSubscribedTopicMetadataKey, subscribe_request.topic());
+  subscriber->StartSendInitialMetadata();
+  
+  std::cout << "Client " << subscribe_request.client_id() << " subscribed to topic "
+            << subscribe_request.topic() << std::endl;
+  
+  return subscriber;
+}
+
+grpc::Status ClientRegistryServiceImpl::Publish(grpc::ServerContext* context,
+                                                const helloworld::TopicMessage* request,
+                                                helloworld::PublishResponse* reply) {
+  grpc::Status admitted = rate_limiter_.Admit(context, "Publish");
+  if (!admitted.ok()) {
+    return admitted;
+  }
+  AddEpoch(context);
+  
+  // Serialize once; every subscriber's write shares the same buffer
+  grpc::ByteBuffer message;
+  bool own_buffer = false;
+  grpc::Status status = grpc::SerializationTraits<helloworld::TopicMessage>::Serialize(
+      *request, &message, &own_buffer);
+  if (!status.ok()) {
+    return status;
+  }
+  
+  int32_t delivered = 0;
+  {
+    std::lock_guard<std::mutex> lock(topics_mutex_);
+    auto it = topic_subscribers_.find(request->topic());
+    if (it != topic_subscribers_.end()) {
+      for (TopicSubscriber* subscriber : it->second) {
+        if (subscriber->Deliver(message)) {
+          ++delivered;
+        }
+      }
+    }
+  }
+  
+  reply->set_success(true);
+  reply->set_subscriber_count(delivered);
+  std::cout << "Published to " << delivered << " subscribers of topic " << request->topic() << std::endl;
+  
+  return grpc::Status::OK;
+}
+
+void ClientRegistryServiceImpl::CloseSubscriptions() {
+  std::lock_guard<std::mutex> lock(topics_mutex_);
+  for (const auto& [topic, subscribers] : topic_subscribers_) {
+    for (TopicSubscriber* subscriber : subscribers) {
+      subscriber->Close(grpc::Status(grpc::StatusCode::UNAVAILABLE, "Registry is shutting down"));
+    }
+  }
+}
+
+void ClientRegistryServiceImpl::RemoveSubscriber(const std::string& topic,
+                                                 TopicSubscriber* subscriber) {
+  std::lock_guard<std::mutex> lock(topics_mutex_);
+  auto it = topic_subscribers_.find(topic);
+  if (it == topic_subscribers_.end()) {
+    return;
+  }
+  it->second.erase(subscriber);
+  if (it->second.empty()) {
+    topic_subscribers_.erase(it);
+  }
+}
+
+void ClientRegistryServiceImpl::ExportSnapshot(helloworld::RegistrySnapshot* snapshot) {
+  std::lock_guard<std::mutex> lock(clients_mutex_);
+  
+  snapshot->set_epoch(epoch_);
+  snapshot->mutable_clients()->Reserve(static_cast<int>(clients_.size()));
+  clients_.ForEach([snapshot](uint32_t, const ClientView& client_info) {
+    CopyClientInfo(client_info, snapshot->add_clients());
+  });
+  snapshot->mutable_registration_hosts()->insert(registration_hosts_.begin(), registration_hosts_.end());
+}
+
+void ClientRegistryServiceImpl::RestoreSnapshot(const helloworld::RegistrySnapshot& snapshot) {
+  std::lock_guard<std::mutex> lock(clients_mutex_);
+  
+  clients_.Clear();
+  label_index_.clear();
+  registration_hosts_ = std::map<std::string, std::string>(snapshot.registration_hosts().begin(),
+                                                           snapshot.registration_hosts().end());
+  for (const auto& client : snapshot.clients()) {
+    const uint32_t slot = clients_.Insert(client.client_id(), client.client_address(), client.client_port(),
+                                          client.online(),
+                                          RegistryLabels(client.labels().begin(), client.labels().end()));
+    if (slot != ClientTable::kNoSlot) {
+      IndexClientLocked(slot);
+    }
+  }
+  // The state lives on, so clients need not register again
+  if (snapshot.epoch() != 0) {
+    epoch_ = snapshot.epoch();
+  }
+  
+  ready_ = true;
+  ready_cv_.notify_all();
+}
+
+bool ClientRegistryServiceImpl::IsRegisteredFrom(const std::string& client_id, const std::string& peer) {
+  std::lock_guard<std::mutex> lock(clients_mutex_);
+  auto it = registration_hosts_.find(client_id);
+  return it != registration_hosts_.end() && it->second == PeerHost(peer);
+}
+
+void ClientRegistryServiceImpl::IndexClientLocked(uint32_t slot) {
+  for (const auto& label : clients_.Get(slot).labels) {
+    label_index_[label].insert(slot);
+  }
+}
+
+void ClientRegistryServiceImpl::UnindexClientLocked(uint32_t slot) {
+  for (const auto& label : clients_.Get(slot).labels) {
+    auto it = label_index_.find(label);
+    if (it == label_index_.end()) {
+      continue;
+    }
+    it->second.erase(slot);
+    if (it->second.empty()) {
+      label_index_.erase(it);
+    }
+  }
+}
+
+bool ClientRegistryServiceImpl::SaveSnapshot(const std::string& path) {
+  helloworld::RegistrySnapshot snapshot;
+  ExportSnapshot(&snapshot);
+  
+  // Write to a temporary file first so a reader never sees a partial snapshot
+  const std::string tmp_path = path + ".tmp";
+  std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+  if (!out || !snapshot.SerializeToOstream(&out)) {
+    std::cout << "Failed to write registry snapshot to " << tmp_path << std::endl;
+    return false;
+  }
+  out.close();
+  
+  if (!out || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::cout << "Failed to publish registry snapshot at " << path << std::endl;
+    return false;
+  }
+  
+  std::cout << "Saved " << snapshot.clients_size() << " clients to snapshot " << path << std::endl;
+  return true;
+}
+
+bool ClientRegistryServiceImpl::LoadSnapshot(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  
+  helloworld::RegistrySnapshot snapshot;
+  if (!snapshot.ParseFromIstream(&in)) {
+    std::cout << "Failed to parse registry snapshot " << path << std::endl;
+    return false;
+  }
+  
+  RestoreSnapshot(snapshot);
+  std::cout << "Restored " << snapshot.clients_size() << " clients from snapshot " << path << std::endl;
+  return true;
+}
+
+void ClientRegistryServiceImpl::SetReady(bool ready) {
+  std::lock_guard<std::mutex> lock(clients_mutex_);
+  ready_ = ready;
+  ready_cv_.notify_all();
+}
+
+bool ClientRegistryServiceImpl::AwaitReady(grpc::ServerContext* context,
+                                           std::unique_lock<std::mutex>& lock) {
+  if (ready_) {
+    return true;
+  }
+  
+  // Hold the call rather than fail it, but never past its own deadline
+  auto deadline = std::chrono::system_clock::now() + kMaxReadyWait;
+  if (context != nullptr && context->deadline() < deadline) {
+    deadline = context->deadline();
+  }
+  return ready_cv_.wait_until(lock, deadline, [this] { return ready_; });
+}
+
+void ClientRegistryServiceImpl::AddEpoch(grpc::ServerContext* context) const {
+  context->AddTrailingMetadata(kRegistryEpochMetadataKey, std::to_string(epoch_.load()));
+}
+
+void RequestServerDrain() {
+  drain_requested.store(true);
+}
+
 void RunServer() {
-  const std::string server_address("0.0.0.0:50051");
+  RunServer(ServerOptions());
+}
+
+void RunServer(const ServerOptions& options) {
   ClientRegistryServiceImpl service;
+  
+  // A loaded snapshot is only deleted once this server is serving it, so a
+  // start that fails leaves it for the next attempt
+  bool snapshot_loaded = false;
+  // A snapshot an earlier drain left behind is not the one the draining
+  // registry is about to write, and must not be taken for it
+  struct stat stale {};
+  bool has_stale = false;
+  if (options.await_snapshot) {
+    service.SetReady(false);
+    has_stale = ::stat(options.snapshot_path.c_str(), &stale) == 0;
+    if (has_stale) {
+      std::cout << "Ignoring snapshot " << options.snapshot_path << " left by an earlier drain" << std::endl;
+    }
+  } else if (!options.snapshot_path.empty()) {
+    snapshot_loaded = service.LoadSnapshot(options.snapshot_path);
+  }
+  service.rate_limiter().SetDefaultLimit(options.rate_limit);
+  for (const auto& [method, limit] : options.method_rate_limits) {
+    service.rate_limiter().SetMethodLimit(method, limit);
+  }
+
+  std::shared_ptr<grpc::ServerCredentials> credentials = MakeServerCredentials(options.tls);
+  if (!credentials) {
+    std::cout << "Failed to load TLS credentials" << std::endl;
+    return;
+  }
 
   grpc::EnableDefaultHealthCheckService(true);
   grpc::ServerBuilder builder;
-  // Listen on the given address without any authentication mechanism.
-  builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+  // Let a replacement process bind the same port while this one drains.
+  builder.AddChannelArgument(GRPC_ARG_ALLOW_REUSEPORT, 1);
+  // Listen on the given address, over TLS if configured.
+  builder.AddListeningPort(options.server_address, credentials);
   // Register the client registry service
   builder.RegisterService(&service);
+  MessageRelayServiceImpl relay_service;
+  if (options.enable_relay) {
+    // Only a registered client, from where it registered, may take its relay stream
+    relay_service.SetHelloCheck([&service](const std::string& client_id, const std::string& peer) {
+      return service.IsRegisteredFrom(client_id, peer);
+    });
+    builder.RegisterService(&relay_service);
+  }
   // Finally assemble the server.
   std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
-  std::cout << "Client Registry Server listening on " << server_address << std::endl;
+  if (!server) {
+    std::cout << "Failed to start registry server on " << options.server_address << std::endl;
+    return;
+  }
+  std::cout << "Client Registry Server listening on " << options.server_address << std::endl;
   std::cout << "Clients can register and discover other clients" << std::endl;
+  if (snapshot_loaded) {
+    std::remove(options.snapshot_path.c_str());
+  }
+
+  // Take over from a draining registry: its snapshot appears once its
+  // in-flight RPCs have finished. Until then our RPCs wait instead of failing.
+  std::thread restore_thread;
+  if (options.await_snapshot) {
+    restore_thread = std::thread([&service, &options, &stale, has_stale]() {
+      const auto give_up = std::chrono::steady_clock::now() + kMaxReadyWait;
+      while (!drain_requested.load() && std::chrono::steady_clock::now() < give_up) {
+        struct stat current {};
+        if (::stat(options.snapshot_path.c_str(), &current) == 0 && !(has_stale && SameFile(current, stale)) &&
+            service.LoadSnapshot(options.snapshot_path)) {
+          std::remove(options.snapshot_path.c_str());
+          return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      std::cout << "No snapshot from previous registry, starting empty" << std::endl;
+      service.SetReady(true);
+    });
+  }
 
-  // Wait for the server to shutdown. Note that some other thread must be
-  // responsible for shutting down the server for this call to ever return.
-  server->Wait();
+  while (!drain_requested.load()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  if (restore_thread.joinable()) {
+    restore_thread.join();
+  }
+
+  // Stop accepting new RPCs and give in-flight ones until the deadline to
+  // finish; the snapshot is written after that so it includes their effects.
+  std::cout << "Draining registry server" << std::endl;
+  // Health checks turn NOT_SERVING so multi-endpoint clients move their reads
+  server->GetHealthCheckService()->SetServingStatus(false);
+  service.CloseSubscriptions();
+  relay_service.CloseConnections();
+  server->Shutdown(std::chrono::system_clock::now() + options.drain_timeout);
+  if (!options.snapshot_path.empty()) {
+    service.SaveSnapshot(options.snapshot_path);
+  }
+  std::cout << "Registry server stopped" << std::endl;
 }
 
 }  // namespace helloworld
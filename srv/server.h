@@ -2,27 +2,35 @@
 #define HELLOWORLD_SERVER_H
 
 #include <grpcpp/grpcpp.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
 #include <string>
 #include <vector>
 #include <map>
 #include <mutex>
+#include <set>
+#include <utility>
 
 #include "proto/helloworld.grpc.pb.h"
+#include "common/metadata.h"
+#include "common/tls.h"
+#include "client_table.h"
+#include "rate_limiter.h"
 
 namespace helloworld {
 
-// Client registry info
-struct ClientRegistryInfo {
-  std::string client_id;
-  std::string address;
-  int32_t port;
-  bool online;
-};
+class TopicSubscriber;
 
-// Client registry service implementation
-class ClientRegistryServiceImpl final : public helloworld::ClientRegistry::Service {
+// Client registry service implementation. Subscribe is a raw callback method
+// so a publish is serialized once and shared by every subscriber's stream.
+class ClientRegistryServiceImpl final
+    : public helloworld::ClientRegistry::WithRawCallbackMethod_Subscribe<
+          helloworld::ClientRegistry::Service> {
  public:
+  ClientRegistryServiceImpl();
+
   grpc::Status RegisterClient(grpc::ServerContext* context,
                            const helloworld::ClientRegistration* request,
                            helloworld::RegistrationResponse* reply) override;
@@ -31,21 +39,114 @@ class ClientRegistryServiceImpl final : public helloworld::ClientRegistry::Servi
                         const helloworld::ClientLookup* request,
                         helloworld::ClientInfo* reply) override;
   
+  grpc::Status GetClients(grpc::ServerContext* context,
+                         const helloworld::ClientLookupBatch* request,
+                         helloworld::ClientList* reply) override;
+  
   grpc::Status ListClients(grpc::ServerContext* context,
                           const helloworld::ClientListRequest* request,
                           helloworld::ClientList* reply) override;
   
+  grpc::Status QueryClients(grpc::ServerContext* context,
+                           const helloworld::ClientQuery* request,
+                           helloworld::ClientList* reply) override;
+  
   grpc::Status UnregisterClient(grpc::ServerContext* context,
                                const helloworld::ClientUnregistration* request,
                                helloworld::UnregistrationResponse* reply) override;
 
+  grpc::ServerWriteReactor<grpc::ByteBuffer>* Subscribe(grpc::CallbackServerContext* context,
+                                                         const grpc::ByteBuffer* request) override;
+  
+  grpc::Status Publish(grpc::ServerContext* context,
+                       const helloworld::TopicMessage* request,
+                       helloworld::PublishResponse* reply) override;
+
+  // End every subscription stream so subscribers can reconnect elsewhere
+  void CloseSubscriptions();
+
+  // Copy the registered clients into a snapshot
+  void ExportSnapshot(helloworld::RegistrySnapshot* snapshot);
+
+  // Replace the registered clients with a snapshot and start serving
+  void RestoreSnapshot(const helloworld::RegistrySnapshot& snapshot);
+
+  // Write / read a snapshot file (written atomically via rename)
+  bool SaveSnapshot(const std::string& path);
+  bool LoadSnapshot(const std::string& path);
+
+  // True if client_id is registered from the host peer connects from; the
+  // relay admits a client's stream only then
+  bool IsRegisteredFrom(const std::string& client_id, const std::string& peer);
+
+  // While not ready, RPCs wait for RestoreSnapshot instead of serving empty state
+  void SetReady(bool ready);
+
+  // Per-caller, per-method limits checked first thing in every RPC
+  RateLimiter& rate_limiter() { return rate_limiter_; }
+
+  // Identifies the registry's state: random for a registry that starts
+  // empty, carried over through a snapshot. Clients that see it change know
+  // their registration was lost.
+  uint64_t epoch() const { return epoch_; }
+
  private:
-  std::map<std::string, ClientRegistryInfo> registered_clients_;
+  // Wait (holding clients_mutex_) until the registry is ready or the call deadline passes
+  bool AwaitReady(grpc::ServerContext* context, std::unique_lock<std::mutex>& lock);
+
+  // Tag a reply with the registry epoch
+  void AddEpoch(grpc::ServerContext* context) const;
+
+  // Keep label_index_ in step with clients_ (clients_mutex_ held)
+  void IndexClientLocked(uint32_t slot);
+  void UnindexClientLocked(uint32_t slot);
+
+  friend class TopicSubscriber;
+  void RemoveSubscriber(const std::string& topic, TopicSubscriber* subscriber);
+
+  ClientTable clients_;
+  // Inverted index from (label key, value) to the slots of clients carrying it
+  std::map<std::pair<std::string, std::string>, std::set<uint32_t>> label_index_;
+  // PeerHost each client registered from, by client id
+  std::map<std::string, std::string> registration_hosts_;
   std::mutex clients_mutex_;
+  std::condition_variable ready_cv_;
+  bool ready_ = true;
+
+  // Topic subscribers; separate lock so publishes never block lookups
+  std::map<std::string, std::set<TopicSubscriber*>> topic_subscribers_;
+  std::mutex topics_mutex_;
+  RateLimiter rate_limiter_;
+  std::atomic<uint64_t> epoch_;
+};
+
+// Registry server options
+struct ServerOptions {
+  std::string server_address = "0.0.0.0:50051";
+  // Snapshot file written when draining and read on startup
+  std::string snapshot_path;
+  // Share the listening port with the draining process and hold RPCs until it
+  // writes its snapshot
+  bool await_snapshot = false;
+  // How long in-flight RPCs get to finish once draining starts
+  std::chrono::milliseconds drain_timeout{5000};
+  // Also serve the MessageRelay service for clients that cannot dial peers
+  bool enable_relay = true;
+  // Token bucket applied to every registry method, and per-method overrides
+  RateLimit rate_limit;
+  std::map<std::string, RateLimit> method_rate_limits;
+  // Serve TLS with tls.cert_file and tls.key_file; with
+  // tls.require_client_cert, also require client certificates chaining to
+  // tls.ca_file (mTLS)
+  TlsOptions tls;
 };
 
 // Server management functions
 void RunServer();
+void RunServer(const ServerOptions& options);
+
+// Ask a running RunServer() to drain and exit (async-signal-safe)
+void RequestServerDrain();
 
 }  // namespace helloworld
 
@@ -1,4 +1,5 @@
 #include "cli/client.h"
+#include "cli/batch_runner.h"
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
@@ -7,9 +8,18 @@
 #include <grpcpp/server.h>
 #include <grpcpp/server_builder.h>
 #include <grpcpp/server_context.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "proto/helloworld.grpc.pb.h"
 
@@ -94,5 +104,598 @@ TEST_F(ClientTest, ClientWithSpecialCharacters) {
   EXPECT_TRUE(true);
 }
 
+// Test that resent messages are dropped and late ones keep sender order
+TEST_F(ClientTest, MailboxDropsDuplicatesAndOrdersPerSender) {
+  ClientCommunicationServiceImpl mailbox;
+  auto message = [](const std::string& from, uint64_t epoch, uint64_t sequence) {
+    helloworld::ClientMessage message;
+    message.set_from_client_id(from);
+    message.set_sender_epoch(epoch);
+    message.set_sequence(sequence);
+    message.set_message_content(from + "#" + std::to_string(sequence));
+    return message;
+  };
+  
+  EXPECT_EQ(mailbox.DeliverMessage(message("alice", 1, 1)), DeliveryResult::kQueued);
+  EXPECT_EQ(mailbox.DeliverMessage(message("alice", 1, 3)), DeliveryResult::kQueued);
+  EXPECT_EQ(mailbox.DeliverMessage(message("bob", 1, 1)), DeliveryResult::kQueued);
+  EXPECT_EQ(mailbox.DeliverMessage(message("alice", 1, 3)), DeliveryResult::kDuplicate);
+  EXPECT_EQ(mailbox.DeliverMessage(message("alice", 1, 2)), DeliveryResult::kQueued);
+  EXPECT_EQ(mailbox.DeliverMessage(message("alice", 1, 2)), DeliveryResult::kDuplicate);
+  
+  // Beyond the window, old sequences count as already seen
+  EXPECT_EQ(mailbox.DeliverMessage(message("alice", 1, 3 + kDedupWindow)), DeliveryResult::kQueued);
+  EXPECT_EQ(mailbox.DeliverMessage(message("alice", 1, 3)), DeliveryResult::kDuplicate);
+  
+  // A restarted sender starts a new epoch with its sequences starting over.
+  // Epochs are random, so a lower one is just as new.
+  EXPECT_EQ(mailbox.DeliverMessage(message("alice", 2, 1)), DeliveryResult::kQueued);
+  EXPECT_EQ(mailbox.DeliverMessage(message("alice", 2, 1)), DeliveryResult::kDuplicate);
+  EXPECT_EQ(mailbox.DeliverMessage(message("alice", 0, 7)), DeliveryResult::kQueued);
+  
+  // Unsequenced messages are never deduplicated
+  helloworld::ClientMessage unsequenced;
+  unsequenced.set_from_client_id("carol");
+  EXPECT_EQ(mailbox.DeliverMessage(unsequenced), DeliveryResult::kQueued);
+  EXPECT_EQ(mailbox.DeliverMessage(unsequenced), DeliveryResult::kQueued);
+  
+  std::vector<std::string> received;
+  for (int i = 0; i < 9; ++i) {
+    helloworld::MessageRequest request;
+    helloworld::ClientMessage reply;
+    grpc::ServerContext context;
+    mailbox.ReceiveMessage(&context, &request, &reply);
+    received.push_back(reply.message_content());
+  }
+  EXPECT_THAT(received, ::testing::ElementsAre("alice#1", "alice#2", "alice#3", "bob#1",
+                                               "alice#" + std::to_string(3 + kDedupWindow),
+                                               "alice#1", "alice#7", "", ""));
+}
+
+// Test that a full mailbox refuses messages with a retry hint and credits
+TEST_F(ClientTest, MailboxCapacityAndCredits) {
+  // Split evenly, two messages per lane
+  ClientCommunicationServiceImpl mailbox(6);
+  
+  helloworld::ClientMessage message;
+  message.set_from_client_id("alice");
+  message.set_sender_epoch(1);
+  
+  std::vector<int32_t> credits;
+  for (uint64_t sequence = 1; sequence <= 2; ++sequence) {
+    message.set_sequence(sequence);
+    helloworld::MessageResponse reply;
+    grpc::ServerContext context;
+    EXPECT_TRUE(mailbox.SendMessage(&context, &message, &reply).ok());
+    credits.push_back(reply.credits());
+  }
+  EXPECT_THAT(credits, ::testing::ElementsAre(1, 0));
+  
+  // The refused message is not recorded as seen, so its resend is accepted
+  message.set_sequence(3);
+  helloworld::MessageResponse reply;
+  grpc::ServerContext context;
+  EXPECT_EQ(mailbox.SendMessage(&context, &message, &reply).error_code(),
+            grpc::StatusCode::RESOURCE_EXHAUSTED);
+  EXPECT_EQ(mailbox.DeliverMessage(message), DeliveryResult::kMailboxFull);
+  
+  helloworld::MessageRequest request;
+  helloworld::ClientMessage received;
+  grpc::ServerContext receive_context;
+  mailbox.ReceiveMessage(&receive_context, &request, &received);
+  EXPECT_EQ(received.sequence(), 1u);
+  EXPECT_EQ(mailbox.DeliverMessage(message), DeliveryResult::kQueued);
+}
+
+// Test that a receive with wait_ms waits for a message to arrive
+TEST_F(ClientTest, ReceiveWaitsForMessage) {
+  ClientCommunicationServiceImpl mailbox;
+  helloworld::MessageRequest request;
+  request.set_wait_ms(50);
+  helloworld::ClientMessage received;
+  grpc::ServerContext empty_context;
+  ASSERT_TRUE(mailbox.ReceiveMessage(&empty_context, &request, &received).ok());
+  EXPECT_TRUE(received.from_client_id().empty());
+  
+  request.set_wait_ms(5000);
+  std::thread sender([&mailbox]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    helloworld::ClientMessage message;
+    message.set_from_client_id("alice");
+    mailbox.DeliverMessage(message);
+  });
+  const auto start = std::chrono::steady_clock::now();
+  grpc::ServerContext context;
+  ASSERT_TRUE(mailbox.ReceiveMessage(&context, &request, &received).ok());
+  EXPECT_EQ(received.from_client_id(), "alice");
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+  sender.join();
+}
+
+// Test that high-priority messages overtake a bulk backlog without starving it
+TEST_F(ClientTest, MailboxPriorityLanes) {
+  ClientCommunicationServiceImpl mailbox(12);
+  
+  auto deliver = [&mailbox](helloworld::MessagePriority priority, const std::string& content) {
+    helloworld::ClientMessage message;
+    message.set_from_client_id("alice");
+    message.set_message_content(content);
+    message.set_priority(priority);
+    return mailbox.DeliverMessage(message);
+  };
+  
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(deliver(helloworld::MESSAGE_PRIORITY_BULK, "b"), DeliveryResult::kQueued);
+  }
+  // A full bulk lane does not refuse other lanes
+  EXPECT_EQ(deliver(helloworld::MESSAGE_PRIORITY_BULK, "b"), DeliveryResult::kMailboxFull);
+  EXPECT_EQ(deliver(helloworld::MESSAGE_PRIORITY_NORMAL, "n"), DeliveryResult::kQueued);
+  EXPECT_EQ(deliver(helloworld::MESSAGE_PRIORITY_HIGH, "h"), DeliveryResult::kQueued);
+  EXPECT_EQ(deliver(helloworld::MESSAGE_PRIORITY_HIGH, "h"), DeliveryResult::kQueued);
+  
+  std::vector<MailboxLaneStats> stats = mailbox.LaneStats();
+  ASSERT_EQ(stats.size(), kMailboxLanes);
+  EXPECT_EQ(stats[0].priority, helloworld::MESSAGE_PRIORITY_HIGH);
+  EXPECT_EQ(stats[0].depth, 2u);
+  EXPECT_EQ(stats[2].depth, 4u);
+  
+  std::string order;
+  helloworld::ClientMessage received;
+  do {
+    grpc::ServerContext context;
+    helloworld::MessageRequest request;
+    received.Clear();
+    mailbox.ReceiveMessage(&context, &request, &received);
+    order += received.message_content();
+  } while (!received.message_content().empty());
+  EXPECT_EQ(order, "hhnbbbb");
+  
+  stats = mailbox.LaneStats();
+  EXPECT_EQ(stats[0].depth, 0u);
+  EXPECT_EQ(stats[0].dequeued, 2u);
+  EXPECT_EQ(stats[2].dequeued, 4u);
+  EXPECT_GE(stats[2].max_wait, stats[2].average_wait);
+  
+  // Under a steady high-priority load, bulk still gets one slot per round
+  mailbox.SetCapacity(48);
+  for (int i = 0; i < 2; ++i) {
+    deliver(helloworld::MESSAGE_PRIORITY_BULK, "b");
+  }
+  for (int i = 0; i < 10; ++i) {
+    deliver(helloworld::MESSAGE_PRIORITY_HIGH, "h");
+  }
+  order.clear();
+  do {
+    grpc::ServerContext context;
+    helloworld::MessageRequest request;
+    received.Clear();
+    mailbox.ReceiveMessage(&context, &request, &received);
+    order += received.message_content();
+  } while (!received.message_content().empty());
+  EXPECT_EQ(order, "hhhhhhhhbhhb");
+}
+
+// Test that batched sends are coalesced and each gets its own outcome
+TEST_F(ClientTest, BatchedSendsShareOneCall) {
+  // Three messages per lane
+  ClientCommunicationServiceImpl mailbox(9);
+  grpc::ServerBuilder builder;
+  int port = 0;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(), &port);
+  builder.RegisterService(&mailbox);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  ASSERT_TRUE(server);
+  
+  ClientCommunicationClient sender(
+      grpc::CreateChannel("localhost:" + std::to_string(port), grpc::InsecureChannelCredentials()));
+  BatchingOptions options;
+  options.linger = std::chrono::seconds(10);
+  options.max_batch_bytes = 1 << 20;
+  sender.EnableBatching(options);
+  
+  // Nothing is sent while the batch lingers
+  std::vector<std::future<BatchedSendResult>> results;
+  for (uint64_t sequence = 1; sequence <= 4; ++sequence) {
+    helloworld::ClientMessage message;
+    message.set_from_client_id("alice");
+    message.set_sender_epoch(1);
+    message.set_sequence(sequence);
+    message.set_message_content("message " + std::to_string(sequence));
+    results.push_back(sender.SendBatched(message));
+  }
+  EXPECT_EQ(results.front().wait_for(std::chrono::milliseconds(200)), std::future_status::timeout);
+  
+  // Reaching the byte limit flushes the batch; the mailbox only has room for
+  // the first three
+  options.max_batch_bytes = 1;
+  sender.EnableBatching(options);
+  helloworld::ClientMessage last;
+  last.set_from_client_id("alice");
+  last.set_sender_epoch(1);
+  last.set_sequence(5);
+  results.push_back(sender.SendBatched(last));
+  
+  std::vector<grpc::StatusCode> codes;
+  for (auto& result : results) {
+    ASSERT_EQ(result.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    BatchedSendResult sent = result.get();
+    codes.push_back(sent.status.error_code());
+    EXPECT_EQ(sent.reply.credits(), 0);
+    if (!sent.status.ok()) {
+      EXPECT_EQ(sent.retry_after, kMailboxFullRetryAfter);
+    }
+  }
+  EXPECT_THAT(codes, ::testing::ElementsAre(grpc::StatusCode::OK, grpc::StatusCode::OK, grpc::StatusCode::OK,
+                                            grpc::StatusCode::RESOURCE_EXHAUSTED,
+                                            grpc::StatusCode::RESOURCE_EXHAUSTED));
+  
+  server->Shutdown();
+}
+
+// Test flat messages decode in place and are served alongside protobuf ones
+TEST_F(ClientTest, FlatCodecMessages) {
+  helloworld::ClientMessage message;
+  message.set_from_client_id("alice");
+  message.set_to_client_id("bob");
+  message.set_message_content("flat payload");
+  message.set_timestamp("1700000000");
+  message.set_sequence(7);
+  message.set_sender_epoch(3);
+  message.set_priority(helloworld::MESSAGE_PRIORITY_HIGH);
+  
+  FlatMessageCodec flat;
+  grpc::ByteBuffer encoded = flat.Encode(message);
+  DecodedMessage decoded;
+  ASSERT_TRUE(flat.Decode(&encoded, &decoded).ok());
+  EXPECT_EQ(decoded.view.message_content, message.message_content());
+  EXPECT_EQ(decoded.view.message_content.data(), reinterpret_cast<const char*>(decoded.buffer.begin()) + 40 + 8);
+  EXPECT_EQ(ToMessage(decoded.view).SerializeAsString(), message.SerializeAsString());
+  
+  // Truncated or foreign bytes are refused
+  grpc::Slice truncated(decoded.buffer.begin(), decoded.buffer.size() - 1);
+  grpc::ByteBuffer short_buffer(&truncated, 1);
+  DecodedMessage refused;
+  EXPECT_EQ(flat.Decode(&short_buffer, &refused).error_code(), grpc::StatusCode::INVALID_ARGUMENT);
+  grpc::ByteBuffer protobuf = ProtobufMessageCodec().Encode(message);
+  EXPECT_EQ(flat.Decode(&protobuf, &refused).error_code(), grpc::StatusCode::INVALID_ARGUMENT);
+  
+  // So are strings protobuf would refuse: a bad continuation byte, a
+  // surrogate and a truncated sequence
+  for (const char* bad : {"caf\xC3\x28", "\xED\xA0\x80", "ok\xE2\x82"}) {
+    helloworld::ClientMessage invalid = message;
+    invalid.set_message_content(bad);
+    grpc::ByteBuffer invalid_buffer = flat.Encode(invalid);
+    DecodedMessage invalid_decoded;
+    EXPECT_EQ(flat.Decode(&invalid_buffer, &invalid_decoded).error_code(), grpc::StatusCode::INVALID_ARGUMENT);
+  }
+  helloworld::ClientMessage accented = message;
+  accented.set_message_content("caf\xC3\xA9 \xF0\x9F\x91\x8B");
+  grpc::ByteBuffer accented_buffer = flat.Encode(accented);
+  DecodedMessage accented_decoded;
+  EXPECT_TRUE(flat.Decode(&accented_buffer, &accented_decoded).ok());
+  
+  ClientCommunicationServiceImpl mailbox;
+  EncodedMessageService encoded_service(&mailbox);
+  grpc::ServerBuilder builder;
+  int port = 0;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(), &port);
+  builder.RegisterService(&mailbox);
+  builder.RegisterCallbackGenericService(&encoded_service);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  ASSERT_TRUE(server);
+  
+  ClientCommunicationClient sender(
+      grpc::CreateChannel("localhost:" + std::to_string(port), grpc::InsecureChannelCredentials()));
+  helloworld::MessageResponse reply;
+  ASSERT_TRUE(sender.SendEncoded(flat, message, &reply).ok());
+  EXPECT_TRUE(reply.success());
+  message.set_sequence(8);
+  ASSERT_TRUE(sender.SendEncoded(ProtobufMessageCodec(), message, &reply).ok());
+  EXPECT_TRUE(reply.success());
+  
+  for (uint64_t sequence : {7, 8}) {
+    grpc::ServerContext context;
+    MessageRequest request;
+    ClientMessage received;
+    mailbox.ReceiveMessage(&context, &request, &received);
+    EXPECT_EQ(received.sequence(), sequence);
+    EXPECT_EQ(received.message_content(), message.message_content());
+    EXPECT_EQ(received.priority(), helloworld::MESSAGE_PRIORITY_HIGH);
+  }
+  
+  server->Shutdown();
+}
+
+// Test a compact client list is read in place and checked before it is read
+TEST_F(ClientTest, CompactClientListReader) {
+  helloworld::ClientList reply;
+  helloworld::CompactClientList* list = reply.mutable_compact();
+  list->set_client_ids("alicebob");
+  list->add_id_lengths(5);
+  list->add_id_lengths(3);
+  list->add_addresses("10.0.0.1");
+  list->add_address_refs(0);
+  list->add_address_refs(0);
+  list->add_port_deltas(50052);
+  list->add_port_deltas(-2);
+  list->set_online(std::string(1, '\x02'));
+  
+  std::vector<ListedClient> clients;
+  ASSERT_TRUE(ForEachListedClient(reply, [&clients](const ListedClient& client) { clients.push_back(client); }));
+  ASSERT_EQ(clients.size(), 2u);
+  EXPECT_EQ(clients[0].client_id, "alice");
+  EXPECT_EQ(clients[0].client_id.data(), list->client_ids().data());
+  EXPECT_EQ(clients[0].port, 50052);
+  EXPECT_FALSE(clients[0].online);
+  EXPECT_EQ(clients[1].client_id, "bob");
+  EXPECT_EQ(clients[1].address, "10.0.0.1");
+  EXPECT_EQ(clients[1].port, 50050);
+  EXPECT_TRUE(clients[1].online);
+  
+  // Columns that disagree are refused without visiting anything
+  list->add_address_refs(1);
+  EXPECT_FALSE(CompactClientListReader(*list).ok());
+  list->mutable_address_refs()->RemoveLast();
+  list->set_client_ids("alicebo");
+  size_t visited = 0;
+  EXPECT_FALSE(ForEachListedClient(reply, [&visited](const ListedClient&) { ++visited; }));
+  EXPECT_EQ(visited, 0u);
+}
+
+// Test that a send's trace context reaches the peer's handler span
+TEST_F(ClientTest, TracePropagatesToPeerHandler) {
+  TraceContext parsed = TraceContext::Parse("00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01");
+  EXPECT_EQ(parsed.trace_id, "4bf92f3577b34da6a3ce929d0e0e4736");
+  EXPECT_EQ(parsed.span_id, "00f067aa0ba902b7");
+  EXPECT_TRUE(parsed.sampled);
+  EXPECT_EQ(parsed.ToTraceParent(), "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01");
+  EXPECT_FALSE(TraceContext::Parse("00-not-a-trace").valid());
+  
+  std::string trace_template = (std::filesystem::temp_directory_path() / "client_test_trace_XXXXXX").string();
+  const int trace_fd = mkstemp(trace_template.data());
+  ASSERT_GE(trace_fd, 0);
+  close(trace_fd);
+  const std::filesystem::path trace_file = trace_template;
+  auto tracer = std::make_shared<Tracer>(trace_file.string(), 1.0, "test");
+  ASSERT_TRUE(tracer->ok());
+  
+  ClientCommunicationServiceImpl mailbox;
+  mailbox.SetTracer(tracer);
+  grpc::ServerBuilder builder;
+  int port = 0;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(), &port);
+  builder.RegisterService(&mailbox);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  ASSERT_TRUE(server);
+  ClientCommunicationClient sender(
+      grpc::CreateChannel("localhost:" + std::to_string(port), grpc::InsecureChannelCredentials()));
+  
+  std::string trace_id;
+  std::string send_span_id;
+  {
+    Span span(tracer.get(), "peer.SendMessage", tracer->StartTrace());
+    trace_id = span.context().trace_id;
+    send_span_id = span.context().span_id;
+    helloworld::ClientMessage message;
+    message.set_from_client_id("alice");
+    helloworld::MessageResponse reply;
+    ASSERT_TRUE(sender.Send(message, &reply, std::chrono::system_clock::time_point::max(), nullptr,
+                            span.context()).ok());
+  }
+  
+  // Unsampled traces record nothing on either side
+  Tracer unsampled_tracer(trace_file.string(), 0.0, "test");
+  {
+    Span span(&unsampled_tracer, "peer.SendMessage", unsampled_tracer.StartTrace());
+    // Still a well-formed context, so the peer sees the trace is unsampled
+    EXPECT_TRUE(TraceContext::Parse(span.context().ToTraceParent()).valid());
+    helloworld::ClientMessage message;
+    message.set_from_client_id("bob");
+    helloworld::MessageResponse reply;
+    ASSERT_TRUE(sender.Send(message, &reply, std::chrono::system_clock::time_point::max(), nullptr,
+                            span.context()).ok());
+  }
+  server->Shutdown();
+  
+  std::ifstream in(trace_file);
+  std::vector<std::string> spans;
+  for (std::string line; std::getline(in, line);) {
+    if (line.find("\"ph\":\"X\"") != std::string::npos) {
+      spans.push_back(line);
+    }
+  }
+  ASSERT_EQ(spans.size(), 2u);
+  // The handler ends first and is the child of the send span
+  EXPECT_NE(spans[0].find("\"name\":\"HandleSendMessage\""), std::string::npos);
+  EXPECT_NE(spans[0].find("\"trace_id\":\"" + trace_id + "\""), std::string::npos);
+  EXPECT_NE(spans[0].find("\"parent_span_id\":\"" + send_span_id + "\""), std::string::npos);
+  EXPECT_NE(spans[1].find("\"span_id\":\"" + send_span_id + "\""), std::string::npos);
+  std::filesystem::remove(trace_file);
+}
+
+// Test that a blob transfer survives a broken stream and a bad chunk
+TEST_F(ClientTest, BlobTransferResumesAndVerifiesChunks) {
+  std::string directory_template = (std::filesystem::temp_directory_path() / "client_test_blobs_XXXXXX").string();
+  ASSERT_NE(mkdtemp(directory_template.data()), nullptr);
+  const std::filesystem::path directory = directory_template;
+  
+  ClientCommunicationServiceImpl mailbox;
+  mailbox.blobs().SetDirectory(directory.string());
+  grpc::ServerBuilder builder;
+  int port = 0;
+  builder.AddListeningPort("localhost:0", grpc::InsecureServerCredentials(), &port);
+  builder.RegisterService(&mailbox);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  ASSERT_TRUE(server);
+  auto channel = grpc::CreateChannel("localhost:" + std::to_string(port), grpc::InsecureChannelCredentials());
+  auto stub = helloworld::ClientCommunication::NewStub(channel);
+  
+  std::string blob(1 << 20, '\0');
+  for (size_t i = 0; i < blob.size(); ++i) {
+    blob[i] = static_cast<char>(i * 131 + i / 7);
+  }
+  const size_t chunk_size = 64 * 1024;
+  
+  // A stream that ends after three chunks leaves them committed
+  {
+    grpc::ClientContext context;
+    helloworld::BlobTransferResponse reply;
+    auto writer = stub->TransferBlob(&context, &reply);
+    for (size_t offset = 0; offset < 3 * chunk_size; offset += chunk_size) {
+      helloworld::BlobChunk chunk;
+      chunk.set_transfer_id("blob");
+      chunk.set_total_size(blob.size());
+      chunk.set_offset(offset);
+      chunk.set_data(blob.substr(offset, chunk_size));
+      chunk.set_crc32c(Crc32c(chunk.data().data(), chunk.data().size()));
+      ASSERT_TRUE(writer->Write(chunk));
+    }
+    writer->WritesDone();
+    EXPECT_TRUE(writer->Finish().ok());
+    EXPECT_EQ(reply.committed_offset(), 3 * chunk_size);
+    EXPECT_FALSE(reply.complete());
+  }
+  
+  // A chunk whose checksum does not match is rejected and not committed
+  {
+    grpc::ClientContext context;
+    helloworld::BlobTransferResponse reply;
+    auto writer = stub->TransferBlob(&context, &reply);
+    helloworld::BlobChunk chunk;
+    chunk.set_transfer_id("blob");
+    chunk.set_total_size(blob.size());
+    chunk.set_offset(3 * chunk_size);
+    chunk.set_data(blob.substr(3 * chunk_size, chunk_size));
+    chunk.set_crc32c(Crc32c(chunk.data().data(), chunk.data().size()) ^ 1);
+    writer->Write(chunk);
+    writer->WritesDone();
+    EXPECT_EQ(writer->Finish().error_code(), grpc::StatusCode::DATA_LOSS);
+  }
+  
+  ClientCommunicationClient sender(channel);
+  EXPECT_TRUE(sender.TransferBlob("blob", "alice", blob.data(), blob.size(), chunk_size).ok());
+  
+  std::string path = mailbox.blobs().CompletedPath("blob");
+  ASSERT_FALSE(path.empty());
+  
+  // A completed blob is found on disk, by a new receiver too, and sending it
+  // again succeeds at once
+  BlobReceiver restarted(directory.string());
+  helloworld::BlobTransferResponse progress;
+  EXPECT_TRUE(restarted.Progress("blob", &progress).ok());
+  EXPECT_TRUE(progress.complete());
+  EXPECT_EQ(progress.committed_offset(), blob.size());
+  EXPECT_TRUE(sender.TransferBlob("blob", "alice", blob.data(), blob.size(), chunk_size).ok());
+  std::ifstream received(path, std::ios::binary);
+  std::string contents((std::istreambuf_iterator<char>(received)), std::istreambuf_iterator<char>());
+  EXPECT_TRUE(contents == blob);
+  
+  // A memory-mapped file goes through the same path
+  const std::filesystem::path source = directory / "source.bin";
+  std::ofstream(source, std::ios::binary) << blob.substr(0, 100000);
+  EXPECT_TRUE(sender.TransferFile("file", "alice", source.string(), chunk_size).ok());
+  EXPECT_EQ(std::filesystem::file_size(mailbox.blobs().CompletedPath("file")), 100000u);
+  
+  // Ids name the stored files, so anything but a plain name is refused
+  for (const std::string& transfer_id : {"..", ".", "../escape", "a/b", ""}) {
+    helloworld::BlobOffsetRequest offset_request;
+    offset_request.set_transfer_id(transfer_id);
+    helloworld::BlobTransferResponse progress;
+    grpc::ClientContext context;
+    EXPECT_EQ(stub->GetBlobOffset(&context, offset_request, &progress).error_code(),
+              grpc::StatusCode::INVALID_ARGUMENT);
+  }
+  {
+    grpc::ClientContext context;
+    helloworld::BlobTransferResponse reply;
+    auto writer = stub->TransferBlob(&context, &reply);
+    helloworld::BlobChunk chunk;
+    chunk.set_transfer_id("huge");
+    chunk.set_total_size(kMaxBlobSize + 1);
+    writer->Write(chunk);
+    writer->WritesDone();
+    EXPECT_EQ(writer->Finish().error_code(), grpc::StatusCode::INVALID_ARGUMENT);
+  }
+  
+  // Ids follow the file's path, size and modification time
+  EXPECT_EQ(BlobTransferId("/data/a.bin", 100, 7), BlobTransferId("/data/a.bin", 100, 7));
+  EXPECT_NE(BlobTransferId("/data/a.bin", 100, 7), BlobTransferId("/data/b.bin", 100, 7));
+  EXPECT_NE(BlobTransferId("/data/a.bin", 100, 7), BlobTransferId("/data/a.bin", 100, 8));
+  EXPECT_NE(BlobTransferId("/data/a.bin", 100, 7), BlobTransferId("/data/a.bin", 101, 7));
+  EXPECT_TRUE(ValidTransferId(BlobTransferId("/data/a.bin", 100, 7)));
+  
+  server->Shutdown();
+  std::filesystem::remove_all(directory);
+}
+
+// Test that the peer channel cache drops the least recently used channel
+TEST_F(ClientTest, PeerChannelCacheEvictsLeastRecentlyUsed) {
+  ChannelFactory channels;
+  PeerChannelCache cache(&channels);
+  auto address = [](size_t i) { return "localhost:" + std::to_string(20000 + i); };
+  
+  std::shared_ptr<grpc::Channel> first = cache.Get(address(0));
+  std::shared_ptr<grpc::Channel> second = cache.Get(address(1));
+  for (size_t i = 2; i < kMaxPeerChannels; ++i) {
+    cache.Get(address(i));
+  }
+  EXPECT_EQ(cache.Get(address(0)), first);
+  
+  // The first peer was just used, so the second is the one dropped
+  cache.Get(address(kMaxPeerChannels));
+  EXPECT_EQ(cache.Get(address(0)), first);
+  EXPECT_NE(cache.Get(address(1)), second);
+}
+
+// Test batch command parsing
+TEST_F(ClientTest, BatchCommandParsing) {
+  BatchCommand send = ParseBatchCommand("send bob hello there");
+  EXPECT_EQ(send.kind, BatchCommand::Kind::kSend);
+  EXPECT_EQ(send.destination, "bob");
+  EXPECT_EQ(send.message, "hello there");
+  
+  // Only the one separating space is dropped from the message
+  EXPECT_EQ(ParseBatchCommand("  send   bob  indented").message, " indented");
+  
+  EXPECT_EQ(ParseBatchCommand("").kind, BatchCommand::Kind::kIgnored);
+  EXPECT_EQ(ParseBatchCommand("   ").kind, BatchCommand::Kind::kIgnored);
+  EXPECT_EQ(ParseBatchCommand("# send bob hello").kind, BatchCommand::Kind::kIgnored);
+  EXPECT_EQ(ParseBatchCommand("send bob").kind, BatchCommand::Kind::kInvalid);
+  EXPECT_EQ(ParseBatchCommand("send").kind, BatchCommand::Kind::kInvalid);
+  EXPECT_EQ(ParseBatchCommand("list").kind, BatchCommand::Kind::kInvalid);
+  EXPECT_EQ(ParseBatchCommand("sendmany bob,carol hello").kind, BatchCommand::Kind::kInvalid);
+}
+
+// Test that a batch run sends every command and counts failures and skips
+TEST_F(ClientTest, BatchRunStatistics) {
+  std::istringstream input(
+      "# header\n"
+      "send bob one\n"
+      "\n"
+      "send nobody two\n"
+      "list\n"
+      "send bob three\n"
+      "send carol\n"
+      "send carol four\n");
+  
+  std::mutex mutex;
+  std::vector<std::string> sent;
+  BatchStats stats = RunBatch(input, 2, [&](const std::string& destination, const std::string& message) {
+    std::lock_guard<std::mutex> lock(mutex);
+    sent.push_back(destination + ":" + message);
+    return destination != "nobody";
+  });
+  
+  EXPECT_THAT(sent, ::testing::UnorderedElementsAre("bob:one", "nobody:two", "bob:three", "carol:four"));
+  EXPECT_EQ(stats.sent, 4u);
+  EXPECT_EQ(stats.failed, 1u);
+  EXPECT_EQ(stats.skipped, 2u);
+  ASSERT_EQ(stats.latencies_ms.size(), 4u);
+  EXPECT_TRUE(std::is_sorted(stats.latencies_ms.begin(), stats.latencies_ms.end()));
+  EXPECT_EQ(stats.Percentile(1.0), stats.latencies_ms.back());
+  EXPECT_EQ(stats.Percentile(0.0), stats.latencies_ms.front());
+  EXPECT_EQ(BatchStats().Percentile(0.5), 0.0);
+}
+
 }  // namespace
 }  // namespace helloworld
\ No newline at end of file
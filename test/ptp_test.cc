@@ -1,4 +1,5 @@
 #include "cli/client.h"
+#include "srv/relay.h"
 #include "srv/server.h"
 
 #include <gmock/gmock.h>
@@ -9,8 +10,10 @@
 #include <grpcpp/server_builder.h>
 #include <grpcpp/server_context.h>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 #include <chrono>
 #include <atomic>
 
@@ -32,6 +35,10 @@ class RegistryPTPTest : public ::testing::Test {
       int port = 0;
       builder.AddListeningPort(server_address, grpc::InsecureServerCredentials(), &port);
       builder.RegisterService(service_.get());
+      relay_service_.SetHelloCheck([this](const std::string& client_id, const std::string& peer) {
+        return service_->IsRegisteredFrom(client_id, peer);
+      });
+      builder.RegisterService(&relay_service_);
       server_ = builder.BuildAndStart();
       
       server_port_ = port;
@@ -57,6 +64,7 @@ class RegistryPTPTest : public ::testing::Test {
   }
 
   std::unique_ptr<ClientRegistryServiceImpl> service_;
+  MessageRelayServiceImpl relay_service_;
   std::unique_ptr<grpc::Server> server_;
   std::thread server_thread_;
   int server_port_ = 0;
@@ -351,5 +359,161 @@ TEST_F(RegistryPTPTest, ClientRegistrationEmptyId) {
   client.Stop();
 }
 
+// Test fan-out send to several clients
+TEST_F(RegistryPTPTest, SendToMany) {
+  const int num_receivers = 3;
+  Client sender(registry_server_address_, "fanout_sender", "localhost", 50140);
+  EXPECT_TRUE(sender.Start());
+  
+  std::vector<std::unique_ptr<Client>> receivers;
+  std::vector<std::string> targets;
+  for (int i = 0; i < num_receivers; ++i) {
+    const std::string client_id = "fanout_receiver_" + std::to_string(i);
+    auto client = std::make_unique<Client>(
+        registry_server_address_, client_id, "localhost", 50141 + i);
+    EXPECT_TRUE(client->Start());
+    receivers.push_back(std::move(client));
+    targets.push_back(client_id);
+  }
+  targets.push_back("fanout_missing");
+  
+  auto results = sender.SendToMany(targets, "Hello, everyone!", 2);
+  
+  ASSERT_EQ(results.size(), targets.size());
+  for (int i = 0; i < num_receivers; ++i) {
+    EXPECT_EQ(results[i].target_client_id, targets[i]);
+    EXPECT_TRUE(results[i].success) << results[i].error;
+  }
+  EXPECT_FALSE(results.back().success);
+  EXPECT_EQ(results.back().error, "Target client is not online");
+  
+  // Each receiver gets the shared payload with its own recipient ID
+  auto channel = grpc::CreateChannel("localhost:50142", grpc::InsecureChannelCredentials());
+  auto stub = helloworld::ClientCommunication::NewStub(channel);
+  helloworld::MessageRequest request;
+  helloworld::ClientMessage received;
+  grpc::ClientContext context;
+  ASSERT_TRUE(stub->ReceiveMessage(&context, request, &received).ok());
+  EXPECT_EQ(received.from_client_id(), "fanout_sender");
+  EXPECT_EQ(received.to_client_id(), "fanout_receiver_1");
+  EXPECT_EQ(received.message_content(), "Hello, everyone!");
+  
+  // Fan-out sends spend the target's mailbox credits like direct sends
+  Client small(registry_server_address_, "fanout_small", "localhost", 0);
+  small.SetMailboxCapacity(1);
+  ASSERT_TRUE(small.Start());
+  EXPECT_TRUE(sender.SendToMany({"fanout_small"}, "fills the mailbox")[0].success);
+  auto refused = sender.SendToMany({"fanout_small"}, "no credit left");
+  EXPECT_FALSE(refused[0].success);
+  EXPECT_EQ(refused[0].error, "Mailbox of fanout_small is full, try again later");
+  EXPECT_FALSE(sender.SendMessageToClient("fanout_small", "no credit left"));
+  small.Stop();
+  
+  sender.Stop();
+  for (auto& client : receivers) {
+    client->Stop();
+  }
+}
+
+// Test that a send falls back to the relay when the peer cannot be dialed
+TEST_F(RegistryPTPTest, RelayFallback) {
+  Client sender(registry_server_address_, "relay_sender", "localhost", 50170);
+  sender.EnableRelay(registry_server_address_);
+  EXPECT_TRUE(sender.Start());
+  
+  Client receiver(registry_server_address_, "relay_receiver", "localhost", 50171);
+  receiver.EnableRelay(registry_server_address_);
+  EXPECT_TRUE(receiver.Start());
+  EXPECT_EQ(relay_service_.ConnectedClients(), 2u);
+  
+  // Advertise an address nobody listens on, as a peer behind NAT would
+  auto registry_channel = grpc::CreateChannel(registry_server_address_, grpc::InsecureChannelCredentials());
+  ClientRegistryClient registry(registry_channel);
+  ASSERT_TRUE(registry.UnregisterClient("relay_receiver"));
+  ASSERT_TRUE(registry.RegisterClient("relay_receiver", "localhost", 1));
+  
+  EXPECT_TRUE(sender.SendMessageToClient("relay_receiver", "Hello via relay!"));
+  
+  auto channel = grpc::CreateChannel("localhost:50171", grpc::InsecureChannelCredentials());
+  auto stub = helloworld::ClientCommunication::NewStub(channel);
+  helloworld::MessageRequest request;
+  helloworld::ClientMessage received;
+  grpc::ClientContext context;
+  ASSERT_TRUE(stub->ReceiveMessage(&context, request, &received).ok());
+  EXPECT_EQ(received.from_client_id(), "relay_sender");
+  EXPECT_EQ(received.message_content(), "Hello via relay!");
+  
+  // Once the receiver disconnects the relay reports it as unreachable
+  receiver.Stop();
+  EXPECT_FALSE(sender.SendMessageToClient("relay_receiver", "Anyone there?"));
+  
+  sender.Stop();
+}
+
+// Test that the relay only admits registered clients, and that clients reconnect once it drops them
+TEST_F(RegistryPTPTest, RelayChecksHelloAndReconnects) {
+  auto relay_channel = grpc::CreateChannel(registry_server_address_, grpc::InsecureChannelCredentials());
+  RelayClient impostor(relay_channel, "never_registered", [](const helloworld::ClientMessage&) {});
+  EXPECT_FALSE(impostor.Connect(std::chrono::seconds(5)));
+  EXPECT_EQ(relay_service_.ConnectedClients(), 0u);
+  
+  ClientRegistryClient registry(relay_channel);
+  ASSERT_TRUE(registry.RegisterClient("relay_reconnector", "localhost", 50172));
+  RelayClient relay(relay_channel, "relay_reconnector", [](const helloworld::ClientMessage&) {});
+  ASSERT_TRUE(relay.Connect(std::chrono::seconds(5)));
+  EXPECT_EQ(relay_service_.ConnectedClients(), 1u);
+  
+  // A stream only sends as the client it said hello as
+  std::vector<helloworld::ClientMessage> received;
+  std::mutex received_mutex;
+  ASSERT_TRUE(registry.RegisterClient("relay_victim", "localhost", 50173));
+  RelayClient victim(relay_channel, "relay_victim", [&](const helloworld::ClientMessage& message) {
+    std::lock_guard<std::mutex> lock(received_mutex);
+    received.push_back(message);
+  });
+  ASSERT_TRUE(victim.Connect(std::chrono::seconds(5)));
+  helloworld::ClientMessage forged;
+  forged.set_from_client_id("someone_else");
+  forged.set_to_client_id("relay_victim");
+  forged.set_message_content("forged");
+  EXPECT_FALSE(relay.Send(forged, std::chrono::seconds(5)));
+  forged.set_from_client_id("relay_reconnector");
+  forged.set_message_content("genuine");
+  EXPECT_TRUE(relay.Send(forged, std::chrono::seconds(5)));
+  const auto delivered_by = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  auto received_count = [&] {
+    std::lock_guard<std::mutex> lock(received_mutex);
+    return received.size();
+  };
+  while (received_count() == 0 && std::chrono::steady_clock::now() < delivered_by) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  victim.Close();
+  ASSERT_EQ(received_count(), 1u);
+  EXPECT_EQ(received[0].message_content(), "genuine");
+  while (relay_service_.ConnectedClients() != 1 && std::chrono::steady_clock::now() < delivered_by) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  
+  relay_service_.CloseConnections();
+  const auto give_up = std::chrono::steady_clock::now() + kMaxRelayReconnectBackoff + std::chrono::seconds(5);
+  while (relay.connected() && std::chrono::steady_clock::now() < give_up) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  while (!relay.connected() && std::chrono::steady_clock::now() < give_up) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  EXPECT_TRUE(relay.connected());
+  EXPECT_EQ(relay_service_.ConnectedClients(), 1u);
+  
+  // Close half-closes, so the relay ends the stream on its side too
+  relay.Close();
+  EXPECT_FALSE(relay.connected());
+  while (relay_service_.ConnectedClients() != 0 && std::chrono::steady_clock::now() < give_up) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(relay_service_.ConnectedClients(), 0u);
+}
+
 }  // namespace
 }  // namespace helloworld
\ No newline at end of file
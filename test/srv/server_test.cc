@@ -7,9 +7,14 @@
 #include <grpcpp/server.h>
 #include <grpcpp/server_builder.h>
 #include <grpcpp/server_context.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <memory>
 #include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 #include "proto/helloworld.grpc.pb.h"
 
@@ -108,6 +113,39 @@ TEST_F(ClientRegistryServiceTest, GetNonExistentClient) {
   EXPECT_FALSE(client_info.online());
 }
 
+// Test batch lookup keeps request order and reports unknown clients offline
+TEST_F(ClientRegistryServiceTest, GetClients) {
+  for (int i = 0; i < 2; ++i) {
+    helloworld::ClientRegistration request;
+    request.set_client_id("batch_client_" + std::to_string(i));
+    request.set_client_address("localhost");
+    request.set_client_port(50052 + i);
+    
+    helloworld::RegistrationResponse reply;
+    grpc::ServerContext context;
+    service_->RegisterClient(&context, &request, &reply);
+  }
+  
+  helloworld::ClientLookupBatch request;
+  request.add_client_ids("batch_client_1");
+  request.add_client_ids("unknown_client");
+  request.add_client_ids("batch_client_0");
+  
+  helloworld::ClientList reply;
+  grpc::ServerContext context;
+  
+  grpc::Status status = service_->GetClients(&context, &request, &reply);
+  
+  EXPECT_TRUE(status.ok());
+  ASSERT_EQ(reply.clients_size(), 3);
+  EXPECT_EQ(reply.clients(0).client_id(), "batch_client_1");
+  EXPECT_EQ(reply.clients(0).client_port(), 50053);
+  EXPECT_TRUE(reply.clients(0).online());
+  EXPECT_EQ(reply.clients(1).client_id(), "unknown_client");
+  EXPECT_FALSE(reply.clients(1).online());
+  EXPECT_EQ(reply.clients(2).client_port(), 50052);
+}
+
 // Test list clients
 TEST_F(ClientRegistryServiceTest, ListClients) {
   // Register multiple clients
@@ -145,6 +183,37 @@ TEST_F(ClientRegistryServiceTest, ListClients) {
   }
 }
 
+// Test a compact list has one column per field and each address once
+TEST_F(ClientRegistryServiceTest, ListClientsCompact) {
+  const std::vector<std::pair<std::string, std::string>> clients = {
+      {"compact_a", "10.0.0.1"}, {"compact_b", "10.0.0.1"}, {"compact_c", "10.0.0.2"}, {"compact_d", "10.0.0.1"}};
+  for (size_t i = 0; i < clients.size(); ++i) {
+    helloworld::ClientRegistration request;
+    request.set_client_id(clients[i].first);
+    request.set_client_address(clients[i].second);
+    request.set_client_port(50060 + static_cast<int32_t>(i));
+    helloworld::RegistrationResponse reply;
+    grpc::ServerContext context;
+    ASSERT_TRUE(service_->RegisterClient(&context, &request, &reply).ok());
+  }
+  
+  helloworld::ClientListRequest request;
+  request.set_compact(true);
+  helloworld::ClientList reply;
+  grpc::ServerContext context;
+  ASSERT_TRUE(service_->ListClients(&context, &request, &reply).ok());
+  EXPECT_EQ(reply.clients_size(), 0);
+  ASSERT_TRUE(reply.has_compact());
+  
+  const helloworld::CompactClientList& list = reply.compact();
+  EXPECT_EQ(list.client_ids(), "compact_acompact_bcompact_ccompact_d");
+  EXPECT_THAT(list.id_lengths(), ::testing::ElementsAre(9, 9, 9, 9));
+  EXPECT_THAT(list.addresses(), ::testing::ElementsAre("10.0.0.1", "10.0.0.2"));
+  EXPECT_THAT(list.address_refs(), ::testing::ElementsAre(0, 0, 1, 0));
+  EXPECT_THAT(list.port_deltas(), ::testing::ElementsAre(50060, 1, 1, 1));
+  EXPECT_EQ(list.online(), std::string(1, '\x0f'));
+}
+
 // Test unregister client
 TEST_F(ClientRegistryServiceTest, UnregisterClient) {
   // First register a client
@@ -252,5 +321,257 @@ TEST_F(ClientRegistryServiceTest, RegisterClientWithInvalidPort) {
   EXPECT_EQ(reply.message(), "Client registered successfully");
 }
 
+// Test snapshot export and restore into a fresh registry
+TEST_F(ClientRegistryServiceTest, SnapshotRoundTrip) {
+  for (int i = 0; i < 3; ++i) {
+    helloworld::ClientRegistration request;
+    request.set_client_id("snapshot_client_" + std::to_string(i));
+    request.set_client_address("localhost");
+    request.set_client_port(50052 + i);
+    
+    helloworld::RegistrationResponse reply;
+    grpc::ServerContext context;
+    service_->RegisterClient(&context, &request, &reply);
+  }
+  
+  helloworld::RegistrySnapshot snapshot;
+  service_->ExportSnapshot(&snapshot);
+  EXPECT_EQ(snapshot.clients_size(), 3);
+  
+  // A registry taking over the snapshot keeps the epoch, so its clients do
+  // not register again
+  ClientRegistryServiceImpl restored;
+  EXPECT_NE(restored.epoch(), service_->epoch());
+  restored.RestoreSnapshot(snapshot);
+  EXPECT_EQ(restored.epoch(), service_->epoch());
+  
+  helloworld::ClientLookup lookup_request;
+  lookup_request.set_client_id("snapshot_client_1");
+  helloworld::ClientInfo client_info;
+  grpc::ServerContext lookup_context;
+  
+  grpc::Status status = restored.GetClient(&lookup_context, &lookup_request, &client_info);
+  
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(client_info.client_port(), 50053);
+  EXPECT_TRUE(client_info.online());
+}
+
+// Test that the compact client table finds, erases and reuses entries
+TEST(ClientTableTest, InsertEraseAndReuse) {
+  ClientTable table;
+  const RegistryLabels labels = {{"role", "worker"}};
+  for (int i = 0; i < 1000; ++i) {
+    ASSERT_NE(table.Insert("client_" + std::to_string(i), "10.0.0." + std::to_string(i % 4), 50000 + i, true, labels),
+              ClientTable::kNoSlot);
+  }
+  EXPECT_EQ(table.Insert("client_7", "10.0.0.9", 1, true, {}), ClientTable::kNoSlot);
+  
+  // Erasing shifts probe runs back; every remaining client is still found
+  for (int i = 0; i < 1000; i += 2) {
+    table.Erase(table.Find("client_" + std::to_string(i)));
+  }
+  EXPECT_EQ(table.size(), 500u);
+  for (int i = 0; i < 1000; ++i) {
+    const uint32_t slot = table.Find("client_" + std::to_string(i));
+    if (i % 2 == 0) {
+      EXPECT_EQ(slot, ClientTable::kNoSlot);
+      continue;
+    }
+    ASSERT_NE(slot, ClientTable::kNoSlot);
+    const ClientView client = table.Get(slot);
+    EXPECT_EQ(client.client_id, "client_" + std::to_string(i));
+    EXPECT_EQ(client.address, "10.0.0." + std::to_string(i % 4));
+    EXPECT_EQ(client.port, 50000 + i);
+    EXPECT_EQ(client.labels, labels);
+  }
+  
+  // Freed slots are reused
+  const uint32_t slot = table.Insert("newcomer", "10.0.0.1", 1, false, {});
+  EXPECT_LT(slot, 1000u);
+  EXPECT_EQ(table.Get(slot).client_id, "newcomer");
+  EXPECT_FALSE(table.Get(slot).online);
+  
+  // Clients are visited in id order, whichever slots they landed in
+  std::vector<std::string> ids;
+  table.ForEach([&ids](uint32_t, const ClientView& client) { ids.emplace_back(client.client_id); });
+  EXPECT_EQ(ids.size(), 501u);
+  EXPECT_TRUE(std::is_sorted(ids.begin(), ids.end()));
+  EXPECT_EQ(ids.back(), "newcomer");
+}
+
+// Test snapshot file save and load
+TEST_F(ClientRegistryServiceTest, SnapshotFileRoundTrip) {
+  helloworld::ClientRegistration request;
+  request.set_client_id("file_client");
+  request.set_client_address("127.0.0.1");
+  request.set_client_port(50060);
+  
+  helloworld::RegistrationResponse reply;
+  grpc::ServerContext context;
+  service_->RegisterClient(&context, &request, &reply);
+  
+  const std::string path = ::testing::TempDir() + "registry_snapshot.pb";
+  ASSERT_TRUE(service_->SaveSnapshot(path));
+  
+  ClientRegistryServiceImpl restored;
+  EXPECT_TRUE(restored.LoadSnapshot(path));
+  EXPECT_FALSE(restored.LoadSnapshot(path + ".missing"));
+  
+  helloworld::RegistrySnapshot snapshot;
+  restored.ExportSnapshot(&snapshot);
+  ASSERT_EQ(snapshot.clients_size(), 1);
+  EXPECT_EQ(snapshot.clients(0).client_id(), "file_client");
+  EXPECT_EQ(snapshot.clients(0).client_address(), "127.0.0.1");
+  
+  std::remove(path.c_str());
+}
+
+// Test that RPCs wait for a pending snapshot instead of serving empty state
+TEST_F(ClientRegistryServiceTest, LookupWaitsForSnapshotRestore) {
+  service_->SetReady(false);
+  
+  helloworld::ClientInfo client_info;
+  grpc::Status status;
+  std::thread lookup_thread([this, &client_info, &status]() {
+    helloworld::ClientLookup request;
+    request.set_client_id("restored_client");
+    grpc::ServerContext context;
+    status = service_->GetClient(&context, &request, &client_info);
+  });
+  
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  
+  helloworld::RegistrySnapshot snapshot;
+  helloworld::ClientInfo* client = snapshot.add_clients();
+  client->set_client_id("restored_client");
+  client->set_client_address("localhost");
+  client->set_client_port(50070);
+  client->set_online(true);
+  service_->RestoreSnapshot(snapshot);
+  
+  lookup_thread.join();
+  
+  EXPECT_TRUE(status.ok());
+  EXPECT_TRUE(client_info.online());
+  EXPECT_EQ(client_info.client_port(), 50070);
+}
+
+// Test label queries intersect selectors and follow unregistration and restore
+TEST_F(ClientRegistryServiceTest, QueryClientsByLabel) {
+  const std::vector<std::pair<std::string, std::string>> clients = {
+      {"worker", "eu"}, {"worker", "us"}, {"gateway", "eu"}, {"worker", "eu"}};
+  for (size_t i = 0; i < clients.size(); ++i) {
+    helloworld::ClientRegistration request;
+    request.set_client_id("labeled_client_" + std::to_string(i));
+    request.set_client_address("localhost");
+    request.set_client_port(50052 + i);
+    (*request.mutable_labels())["role"] = clients[i].first;
+    (*request.mutable_labels())["region"] = clients[i].second;
+    
+    helloworld::RegistrationResponse reply;
+    grpc::ServerContext context;
+    service_->RegisterClient(&context, &request, &reply);
+  }
+  
+  auto query = [](ClientRegistryServiceImpl* service, const helloworld::ClientQuery& request,
+                  std::vector<std::string>* ids) {
+    helloworld::ClientList reply;
+    grpc::ServerContext context;
+    grpc::Status status = service->QueryClients(&context, &request, &reply);
+    ids->clear();
+    for (const auto& client : reply.clients()) {
+      ids->push_back(client.client_id());
+    }
+    return status;
+  };
+  
+  helloworld::ClientQuery request;
+  helloworld::LabelSelector* role = request.add_selectors();
+  role->set_key("role");
+  role->add_values("worker");
+  helloworld::LabelSelector* region = request.add_selectors();
+  region->set_key("region");
+  region->add_values("eu");
+  
+  std::vector<std::string> ids;
+  EXPECT_TRUE(query(service_.get(), request, &ids).ok());
+  EXPECT_THAT(ids, ::testing::UnorderedElementsAre("labeled_client_0", "labeled_client_3"));
+  
+  // Values within a selector are alternatives
+  role->add_values("gateway");
+  EXPECT_TRUE(query(service_.get(), request, &ids).ok());
+  EXPECT_THAT(ids, ::testing::UnorderedElementsAre("labeled_client_0", "labeled_client_2",
+                                                   "labeled_client_3"));
+  
+  helloworld::ClientUnregistration unregister_request;
+  unregister_request.set_client_id("labeled_client_0");
+  helloworld::UnregistrationResponse unregister_reply;
+  grpc::ServerContext unregister_context;
+  service_->UnregisterClient(&unregister_context, &unregister_request, &unregister_reply);
+  
+  EXPECT_TRUE(query(service_.get(), request, &ids).ok());
+  EXPECT_THAT(ids, ::testing::UnorderedElementsAre("labeled_client_2", "labeled_client_3"));
+  
+  // Labels survive a snapshot handoff and are re-indexed
+  helloworld::RegistrySnapshot snapshot;
+  service_->ExportSnapshot(&snapshot);
+  ClientRegistryServiceImpl restored;
+  restored.RestoreSnapshot(snapshot);
+  EXPECT_TRUE(query(&restored, request, &ids).ok());
+  EXPECT_THAT(ids, ::testing::UnorderedElementsAre("labeled_client_2", "labeled_client_3"));
+  
+  region->clear_values();
+  region->add_values("apac");
+  EXPECT_TRUE(query(service_.get(), request, &ids).ok());
+  EXPECT_TRUE(ids.empty());
+  
+  helloworld::ClientQuery empty_request;
+  EXPECT_EQ(query(service_.get(), empty_request, &ids).error_code(),
+            grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+// Test that each caller and method gets its own token bucket
+TEST_F(ClientRegistryServiceTest, RateLimitsPerCallerAndMethod) {
+  service_->rate_limiter().SetMethodLimit("ListClients", RateLimit{1, 2});
+  
+  std::chrono::milliseconds retry_after(0);
+  RateLimiter& limiter = service_->rate_limiter();
+  EXPECT_TRUE(limiter.Admit("host-a", "alice", "ListClients", &retry_after));
+  EXPECT_TRUE(limiter.Admit("host-a", "alice", "ListClients", &retry_after));
+  EXPECT_FALSE(limiter.Admit("host-a", "alice", "ListClients", &retry_after));
+  EXPECT_GT(retry_after.count(), 0);
+  EXPECT_LE(retry_after.count(), 1000);
+  
+  // Other callers and unlimited methods are unaffected
+  EXPECT_TRUE(limiter.Admit("host-a", "bob", "ListClients", &retry_after));
+  EXPECT_TRUE(limiter.Admit("host-b", "alice", "ListClients", &retry_after));
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_TRUE(limiter.Admit("host-a", "alice", "GetClient", &retry_after));
+  }
+  
+  // A host switching client ids runs out of its host budget: 16 times the
+  // burst of 2, less the three calls it made above
+  int admitted = 0;
+  for (int i = 0; i < 200; ++i) {
+    admitted += limiter.Admit("host-a", "id" + std::to_string(i), "ListClients", &retry_after) ? 1 : 0;
+  }
+  EXPECT_GE(admitted, 29);
+  EXPECT_LE(admitted, 31);
+  
+  // Over the limit, the RPC fails fast without reaching the registry
+  for (int i = 0; i < 2; ++i) {
+    helloworld::ClientListRequest request;
+    helloworld::ClientList reply;
+    grpc::ServerContext context;
+    EXPECT_TRUE(service_->ListClients(&context, &request, &reply).ok());
+  }
+  helloworld::ClientListRequest request;
+  helloworld::ClientList reply;
+  grpc::ServerContext context;
+  EXPECT_EQ(service_->ListClients(&context, &request, &reply).error_code(),
+            grpc::StatusCode::RESOURCE_EXHAUSTED);
+}
+
 }  // namespace
 }  // namespace helloworld
\ No newline at end of file